@@ -0,0 +1,629 @@
+// CPU processing of the alpha (transparency) plane before it is uploaded.
+#pragma once
+
+#include <cmath>
+#include <cstdlib>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "utility.hpp"
+
+// The SIMD paths use GCC/Clang bit scan builtins
+#if defined(__SSE2__)
+   #include <emmintrin.h>
+   #define ALPHA_USE_SSE2 1
+#endif
+
+// Bounding box of visible alpha, right and bottom are exclusive
+struct AlphaBounds
+{
+   int left = 0, top = 0, right = 0, bottom = 0;
+
+   bool Empty() const { return right <= left || bottom <= top; }
+   void Union( const AlphaBounds & other )
+   {
+      if ( other.Empty() )
+         return;
+      if ( Empty() )
+      {
+         *this = other;
+         return;
+      }
+      left = std::min( left, other.left );
+      top = std::min( top, other.top );
+      right = std::max( right, other.right );
+      bottom = std::max( bottom, other.bottom );
+   }
+};
+
+// Index of the first byte above 'threshold' in [begin, end), or 'end' if there is none
+inline int FindFirstAbove( const uint8_t * row, int begin, int end, uint8_t threshold )
+{
+   int x = begin;
+#ifdef ALPHA_USE_SSE2
+   // Unsigned compare via saturating subtract: non-zero lanes are above threshold
+   const __m128i limit = _mm_set1_epi8( char(threshold) );
+   const __m128i zero = _mm_setzero_si128();
+   for ( ; x + 16 <= end; x += 16 )
+   {
+      __m128i above = _mm_subs_epu8( _mm_loadu_si128( (const __m128i *)(row + x) ), limit );
+      int mask = ~_mm_movemask_epi8( _mm_cmpeq_epi8( above, zero ) ) & 0xffff;
+      if ( mask )
+         return x + __builtin_ctz( mask );
+   }
+#endif
+   for ( ; x < end; ++x )
+   {
+      if ( row[ x ] > threshold )
+         return x;
+   }
+   return end;
+}
+
+// Index of the last byte above 'threshold' in [begin, end), or begin - 1 if there is none
+inline int FindLastAbove( const uint8_t * row, int begin, int end, uint8_t threshold )
+{
+   int x = end;
+#ifdef ALPHA_USE_SSE2
+   const __m128i limit = _mm_set1_epi8( char(threshold) );
+   const __m128i zero = _mm_setzero_si128();
+   for ( ; x - 16 >= begin; x -= 16 )
+   {
+      __m128i above = _mm_subs_epu8( _mm_loadu_si128( (const __m128i *)(row + x - 16) ), limit );
+      int mask = ~_mm_movemask_epi8( _mm_cmpeq_epi8( above, zero ) ) & 0xffff;
+      if ( mask )
+         return x - 16 + (31 - __builtin_clz( mask ));
+   }
+#endif
+   for ( --x; x >= begin; --x )
+   {
+      if ( row[ x ] > threshold )
+         return x;
+   }
+   return begin - 1;
+}
+
+// Finds the bounding box of alpha values above 'threshold'. Each row is scanned from
+// its ends inward only until it reaches visible alpha or the box found so far, so the
+// cost is mostly proportional to the transparent area outside the box.
+inline AlphaBounds FindAlphaBounds( const uint8_t * plane,
+   int pitch,
+   int width,
+   int height,
+   uint8_t threshold = 0 )
+{
+   AlphaBounds returnValue;
+   returnValue.left = width;
+   returnValue.top = height;
+   for ( int y = 0; y < height; ++y )
+   {
+      const uint8_t * row = plane + size_t(y) * pitch;
+      bool visible = false;
+
+      int first = FindFirstAbove( row, 0, returnValue.left, threshold );
+      if ( first < returnValue.left )
+      {
+         returnValue.left = first;
+         visible = true;
+      }
+
+      int from = std::max( returnValue.right, returnValue.left );
+      int last = FindLastAbove( row, from, width, threshold );
+      if ( last >= from )
+      {
+         returnValue.right = last + 1;
+         visible = true;
+      }
+
+      // Nothing outside the current span, but the row may still extend the bottom
+      if ( !visible && returnValue.left < returnValue.right )
+         visible = FindFirstAbove( row, returnValue.left, returnValue.right, threshold ) < returnValue.right;
+
+      if ( visible )
+      {
+         returnValue.top = std::min( returnValue.top, y );
+         returnValue.bottom = y + 1;
+      }
+   }
+
+   if ( returnValue.Empty() )
+      return AlphaBounds();
+   return returnValue;
+}
+
+// Mask clean-up, applied in order to the alpha plane before it is uploaded
+enum class MaskOperation
+{
+   Erode,      // Minimum over a (2r+1) square, shrinks the visible area
+   Dilate,     // Maximum over a (2r+1) square, grows the visible area
+   Box,        // Mean over a (2r+1) square, feathers edges
+   Gaussian,   // Approximated by three box passes, feathers edges
+   Threshold,  // 255 at or above the value, otherwise 0
+   Posterize   // Quantizes to the given number of evenly spaced levels
+};
+
+struct MaskStep
+{
+   MaskOperation operation;
+   double value; // Radius, sigma, threshold or level count depending on the operation
+};
+
+// Parses "<operation>:<value>", e.g. "erode:1" or "gaussian:2.5"
+inline MaskStep ParseMaskStep( const std::string & step )
+{
+   static const std::pair< const char *, MaskOperation > names[] = {
+      { "erode", MaskOperation::Erode },
+      { "dilate", MaskOperation::Dilate },
+      { "box", MaskOperation::Box },
+      { "gaussian", MaskOperation::Gaussian },
+      { "threshold", MaskOperation::Threshold },
+      { "posterize", MaskOperation::Posterize }
+   };
+
+   size_t separator = step.find( ':' );
+   std::string name = step.substr( 0, separator );
+   double value = 0;
+   if ( separator != std::string::npos )
+   {
+      std::stringstream ss( step.substr( separator + 1 ) );
+      ss >> value;
+      if ( ss.fail() )
+         separator = std::string::npos;
+   }
+
+   for ( const auto & entry : names )
+   {
+      if ( name == entry.first && separator != std::string::npos && value >= 0 )
+         return { entry.second, value };
+   }
+   throw std::runtime_error( "Invalid mask filter, expected <erode|dilate|box|gaussian|threshold|posterize>:<value>: " + step );
+}
+
+// Runs a chain of separable mask operations. Each separable operation is a horizontal
+// pass into a scratch plane followed by a vertical pass back, both split into row bands
+// across threads and vectorized with SSE2 where available.
+class MaskFilter
+{
+public:
+   static constexpr int kMaxBoxRadius = 126; // Keeps vertical box sums within 16 bits
+
+   MaskFilter() = default;
+   explicit MaskFilter( std::vector< MaskStep > steps ) : _steps( std::move( steps ) ) {}
+
+   bool Empty() const { return _steps.empty(); }
+
+   // Const and with its scratch plane local to the call, so one filter can serve several
+   // encodes at once
+   void Apply( uint8_t * plane, int pitch, int width, int height, int threads ) const
+   {
+      std::vector< uint8_t > scratch;
+      for ( const MaskStep & step : _steps )
+      {
+         switch ( step.operation )
+         {
+            case MaskOperation::Erode:
+            case MaskOperation::Dilate:
+               MinMax( plane, pitch, width, height, int(step.value), step.operation == MaskOperation::Dilate, threads, scratch );
+               break;
+            case MaskOperation::Box:
+               Box( plane, pitch, width, height, int(step.value), threads, scratch );
+               break;
+            case MaskOperation::Gaussian:
+            {
+               // Three box passes whose combined variance matches the requested sigma
+               int radius = int(std::lround( (std::sqrt( 4.0 * step.value * step.value + 1.0 ) - 1.0) / 2.0 ));
+               for ( int pass = 0; pass < 3; ++pass )
+                  Box( plane, pitch, width, height, radius, threads, scratch );
+               break;
+            }
+            case MaskOperation::Threshold:
+               Threshold( plane, pitch, width, height, uint8_t(std::min( 255.0, step.value )), threads );
+               break;
+            case MaskOperation::Posterize:
+               Posterize( plane, pitch, width, height, int(step.value), threads );
+               break;
+         }
+      }
+   }
+
+private:
+   // Copies a row with 'radius' replicated samples on each side
+   static void PadRow( const uint8_t * row, int width, int radius, uint8_t * padded )
+   {
+      memset( padded, row[ 0 ], radius );
+      memcpy( padded + radius, row, width );
+      memset( padded + radius + width, row[ width - 1 ], radius );
+   }
+
+#ifdef ALPHA_USE_SSE2
+   // Rounded means of eight 16-bit box sums, packed into the low eight bytes. The extra half
+   // keeps exact quotients from landing just below an integer in float.
+   static __m128i Means( __m128i sums, int taps )
+   {
+      const __m128i zero = _mm_setzero_si128();
+      const __m128 offset = _mm_set1_ps( float(taps / 2) + 0.5f );
+      const __m128 scale = _mm_set1_ps( 1.0f / taps );
+      __m128i lo = _mm_cvttps_epi32( _mm_mul_ps( _mm_add_ps( _mm_cvtepi32_ps( _mm_unpacklo_epi16( sums, zero ) ), offset ), scale ) );
+      __m128i hi = _mm_cvttps_epi32( _mm_mul_ps( _mm_add_ps( _mm_cvtepi32_ps( _mm_unpackhi_epi16( sums, zero ) ), offset ), scale ) );
+      return _mm_packus_epi16( _mm_packs_epi32( lo, hi ), zero );
+   }
+#endif
+
+   static void MinMax( uint8_t * plane, int pitch, int width, int height, int radius, bool dilate, int threads,
+      std::vector< uint8_t > & scratchPlane )
+   {
+      if ( radius <= 0 )
+         return;
+      scratchPlane.resize( size_t(pitch) * height );
+      uint8_t * scratch = scratchPlane.data();
+
+      // Horizontal: plane -> scratch
+      ParallelFor( height, threads, [&]( int firstRow, int lastRow )
+      {
+         std::vector< uint8_t > padded( width + 2 * radius );
+         for ( int y = firstRow; y < lastRow; ++y )
+         {
+            PadRow( plane + size_t(y) * pitch, width, radius, padded.data() );
+            uint8_t * dst = scratch + size_t(y) * pitch;
+            int x = 0;
+#ifdef ALPHA_USE_SSE2
+            for ( ; x + 16 <= width; x += 16 )
+            {
+               __m128i acc = _mm_loadu_si128( (const __m128i *)(padded.data() + x) );
+               for ( int k = 1; k <= 2 * radius; ++k )
+               {
+                  __m128i v = _mm_loadu_si128( (const __m128i *)(padded.data() + x + k) );
+                  acc = dilate ? _mm_max_epu8( acc, v ) : _mm_min_epu8( acc, v );
+               }
+               _mm_storeu_si128( (__m128i *)(dst + x), acc );
+            }
+#endif
+            for ( ; x < width; ++x )
+            {
+               uint8_t acc = padded[ x ];
+               for ( int k = 1; k <= 2 * radius; ++k )
+                  acc = dilate ? std::max( acc, padded[ x + k ] ) : std::min( acc, padded[ x + k ] );
+               dst[ x ] = acc;
+            }
+         }
+      } );
+
+      // Vertical: scratch -> plane
+      ParallelFor( height, threads, [&]( int firstRow, int lastRow )
+      {
+         for ( int y = firstRow; y < lastRow; ++y )
+         {
+            uint8_t * dst = plane + size_t(y) * pitch;
+            auto row = [&]( int k ) { return scratch + size_t(std::max( 0, std::min( height - 1, y + k ) )) * pitch; };
+            int x = 0;
+#ifdef ALPHA_USE_SSE2
+            for ( ; x + 16 <= width; x += 16 )
+            {
+               __m128i acc = _mm_loadu_si128( (const __m128i *)(row( -radius ) + x) );
+               for ( int k = -radius + 1; k <= radius; ++k )
+               {
+                  __m128i v = _mm_loadu_si128( (const __m128i *)(row( k ) + x) );
+                  acc = dilate ? _mm_max_epu8( acc, v ) : _mm_min_epu8( acc, v );
+               }
+               _mm_storeu_si128( (__m128i *)(dst + x), acc );
+            }
+#endif
+            for ( ; x < width; ++x )
+            {
+               uint8_t acc = row( -radius )[ x ];
+               for ( int k = -radius + 1; k <= radius; ++k )
+                  acc = dilate ? std::max( acc, row( k )[ x ] ) : std::min( acc, row( k )[ x ] );
+               dst[ x ] = acc;
+            }
+         }
+      } );
+   }
+
+   static void Box( uint8_t * plane, int pitch, int width, int height, int radius, int threads,
+      std::vector< uint8_t > & scratchPlane )
+   {
+      radius = std::min( radius, kMaxBoxRadius );
+      if ( radius <= 0 )
+         return;
+      scratchPlane.resize( size_t(pitch) * height );
+      uint8_t * scratch = scratchPlane.data();
+      const int taps = 2 * radius + 1;
+
+      // Rounded mean without a division: floor( (sum + taps/2) * ceil(2^32 / taps) / 2^32 ) is exact for 16-bit sums
+      const uint64_t reciprocal = ((uint64_t(1) << 32) + taps - 1) / taps;
+      auto mean = [&]( uint32_t sum ) { return uint8_t(((sum + taps / 2) * reciprocal) >> 32); };
+
+      // Horizontal: plane -> scratch. Each window sum is the difference of two prefix sums,
+      // which wrap at 16 bits but differ by the exact window sum.
+      ParallelFor( height, threads, [&]( int firstRow, int lastRow )
+      {
+         const int paddedWidth = width + 2 * radius;
+         std::vector< uint8_t > padded( paddedWidth );
+         std::vector< uint16_t > prefix( paddedWidth + 1 );
+         for ( int y = firstRow; y < lastRow; ++y )
+         {
+            PadRow( plane + size_t(y) * pitch, width, radius, padded.data() );
+            uint8_t * dst = scratch + size_t(y) * pitch;
+            prefix[ 0 ] = 0;
+            int i = 0, x = 0;
+#ifdef ALPHA_USE_SSE2
+            // Eight prefix sums at a time: a log-step scan within the register, plus the total so far
+            const __m128i zero = _mm_setzero_si128();
+            __m128i total = _mm_setzero_si128();
+            for ( ; i + 8 <= paddedWidth; i += 8 )
+            {
+               __m128i v = _mm_unpacklo_epi8( _mm_loadl_epi64( (const __m128i *)(padded.data() + i) ), zero );
+               v = _mm_add_epi16( v, _mm_slli_si128( v, 2 ) );
+               v = _mm_add_epi16( v, _mm_slli_si128( v, 4 ) );
+               v = _mm_add_epi16( v, _mm_slli_si128( v, 8 ) );
+               v = _mm_add_epi16( v, total );
+               _mm_storeu_si128( (__m128i *)(prefix.data() + i + 1), v );
+               total = _mm_shuffle_epi32( _mm_shufflehi_epi16( v, _MM_SHUFFLE( 3, 3, 3, 3 ) ), _MM_SHUFFLE( 3, 3, 3, 3 ) );
+            }
+#endif
+            for ( ; i < paddedWidth; ++i )
+               prefix[ i + 1 ] = uint16_t(prefix[ i ] + padded[ i ]);
+#ifdef ALPHA_USE_SSE2
+            for ( ; x + 8 <= width; x += 8 )
+            {
+               __m128i sums = _mm_sub_epi16( _mm_loadu_si128( (const __m128i *)(prefix.data() + x + taps) ),
+                  _mm_loadu_si128( (const __m128i *)(prefix.data() + x) ) );
+               _mm_storel_epi64( (__m128i *)(dst + x), Means( sums, taps ) );
+            }
+#endif
+            for ( ; x < width; ++x )
+               dst[ x ] = mean( uint16_t(prefix[ x + taps ] - prefix[ x ]) );
+         }
+      } );
+
+      // Vertical running sum over 16-bit column totals: scratch -> plane
+      ParallelFor( height, threads, [&]( int firstRow, int lastRow )
+      {
+         auto row = [&]( int y ) { return scratch + size_t(std::max( 0, std::min( height - 1, y ) )) * pitch; };
+         std::vector< uint16_t > sums( width, 0 );
+         for ( int k = -radius; k <= radius; ++k )
+         {
+            const uint8_t * src = row( firstRow + k );
+            for ( int x = 0; x < width; ++x )
+               sums[ x ] += src[ x ];
+         }
+
+         for ( int y = firstRow; y < lastRow; ++y )
+         {
+            uint8_t * dst = plane + size_t(y) * pitch;
+            const uint8_t * incoming = row( y + radius + 1 );
+            const uint8_t * outgoing = row( y - radius );
+            int x = 0;
+#ifdef ALPHA_USE_SSE2
+            const __m128i zero = _mm_setzero_si128();
+            for ( ; x + 8 <= width; x += 8 )
+            {
+               __m128i sum = _mm_loadu_si128( (const __m128i *)(sums.data() + x) );
+               _mm_storel_epi64( (__m128i *)(dst + x), Means( sum, taps ) );
+
+               __m128i in = _mm_unpacklo_epi8( _mm_loadl_epi64( (const __m128i *)(incoming + x) ), zero );
+               __m128i out = _mm_unpacklo_epi8( _mm_loadl_epi64( (const __m128i *)(outgoing + x) ), zero );
+               _mm_storeu_si128( (__m128i *)(sums.data() + x), _mm_sub_epi16( _mm_add_epi16( sum, in ), out ) );
+            }
+#endif
+            for ( ; x < width; ++x )
+            {
+               dst[ x ] = mean( sums[ x ] );
+               sums[ x ] += incoming[ x ] - outgoing[ x ];
+            }
+         }
+      } );
+   }
+
+   static void Threshold( uint8_t * plane, int pitch, int width, int height, uint8_t threshold, int threads )
+   {
+      ParallelFor( height, threads, [&]( int firstRow, int lastRow )
+      {
+         for ( int y = firstRow; y < lastRow; ++y )
+         {
+            uint8_t * row = plane + size_t(y) * pitch;
+            int x = 0;
+#ifdef ALPHA_USE_SSE2
+            // max(v, t) == v exactly when v >= t, giving 0xff or 0x00 per byte
+            const __m128i limit = _mm_set1_epi8( char(threshold) );
+            for ( ; x + 16 <= width; x += 16 )
+            {
+               __m128i v = _mm_loadu_si128( (const __m128i *)(row + x) );
+               _mm_storeu_si128( (__m128i *)(row + x), _mm_cmpeq_epi8( _mm_max_epu8( v, limit ), v ) );
+            }
+#endif
+            for ( ; x < width; ++x )
+               row[ x ] = (row[ x ] >= threshold) ? 255 : 0;
+         }
+      } );
+   }
+
+   static void Posterize( uint8_t * plane, int pitch, int width, int height, int levels, int threads )
+   {
+      if ( levels < 2 || levels >= 256 )
+         return;
+
+      uint8_t table[ 256 ];
+      for ( int v = 0; v < 256; ++v )
+         table[ v ] = uint8_t(std::lround( std::round( v * (levels - 1) / 255.0 ) * 255.0 / (levels - 1) ));
+
+#ifdef ALPHA_USE_SSE2
+      // SSE2 has no byte lookup, but the table is a staircase: the output is the sum of the
+      // steps whose start the input reaches. That is cheaper than the table for a few levels.
+      std::vector< std::pair< uint8_t, uint8_t > > steps; // Start and rise
+      for ( int v = 1; v < 256; ++v )
+      {
+         if ( table[ v ] != table[ v - 1 ] )
+            steps.push_back( { uint8_t(v), uint8_t(table[ v ] - table[ v - 1 ]) } );
+      }
+      const bool stairs = table[ 0 ] == 0 && steps.size() <= 16;
+#endif
+
+      ParallelFor( height, threads, [&]( int firstRow, int lastRow )
+      {
+         for ( int y = firstRow; y < lastRow; ++y )
+         {
+            uint8_t * row = plane + size_t(y) * pitch;
+            int x = 0;
+#ifdef ALPHA_USE_SSE2
+            for ( ; stairs && x + 16 <= width; x += 16 )
+            {
+               __m128i v = _mm_loadu_si128( (const __m128i *)(row + x) );
+               __m128i out = _mm_setzero_si128();
+               for ( const auto & step : steps )
+               {
+                  __m128i reached = _mm_cmpeq_epi8( _mm_max_epu8( v, _mm_set1_epi8( char(step.first) ) ), v );
+                  out = _mm_add_epi8( out, _mm_and_si128( reached, _mm_set1_epi8( char(step.second) ) ) );
+               }
+               _mm_storeu_si128( (__m128i *)(row + x), out );
+            }
+#endif
+            for ( ; x < width; ++x )
+               row[ x ] = table[ row[ x ] ];
+         }
+      } );
+   }
+
+   std::vector< MaskStep > _steps;
+};
+
+// Temporal stabilization of a mask sequence, to stop keying noise from flickering
+// between frames and spending alpha-layer bits
+enum class TemporalMode
+{
+   Hysteresis, // Keep the previous output unless alpha moved by more than the value
+   Median      // Median of this frame and the previous value - 1 input frames (3 or 5)
+};
+
+class TemporalAlphaFilter
+{
+public:
+   TemporalAlphaFilter() = default;
+
+   // Parses "hysteresis:<levels>" or "median:<3|5>"
+   explicit TemporalAlphaFilter( const std::string & setting )
+   {
+      size_t separator = setting.find( ':' );
+      std::string name = setting.substr( 0, separator );
+      std::stringstream ss( separator == std::string::npos ? "" : setting.substr( separator + 1 ) );
+      ss >> _value;
+      bool valid = !ss.fail();
+      if ( name == "hysteresis" && valid && _value >= 0 && _value < 256 )
+         _mode = TemporalMode::Hysteresis;
+      else if ( name == "median" && valid && (_value == 3 || _value == 5) )
+         _mode = TemporalMode::Median;
+      else
+         throw std::runtime_error( "Invalid temporal alpha filter, expected hysteresis:<levels> or median:<3|5>: " + setting );
+      _enabled = true;
+   }
+
+   bool Empty() const { return !_enabled; }
+
+   // Filters a mask frame in place. Frames must be the same size from call to call.
+   void Apply( uint8_t * plane, size_t size, int threads )
+   {
+      // Previous frames live in a ring, seeded from the first frame
+      size_t depth = (_mode == TemporalMode::Hysteresis) ? 1 : size_t(_value - 1);
+      if ( _history.empty() )
+      {
+         _history.assign( depth, std::vector< uint8_t >( plane, plane + size ) );
+         return;
+      }
+
+      uint8_t * history[ 4 ];
+      for ( size_t i = 0; i < depth; ++i )
+         history[ i ] = _history[ (_oldest + i) % depth ].data();
+
+      const int chunk = 1 << 16;
+      ParallelFor( int((size + chunk - 1) / chunk), threads, [&]( int firstChunk, int lastChunk )
+      {
+         size_t begin = size_t(firstChunk) * chunk;
+         size_t end = std::min( size, size_t(lastChunk) * chunk );
+         if ( _mode == TemporalMode::Hysteresis )
+            Hysteresis( plane, history[ 0 ], begin, end, uint8_t(_value) );
+         else
+            Median( plane, history, depth, begin, end );
+      } );
+
+      // The frame just consumed replaces the oldest input for the median
+      if ( _mode == TemporalMode::Median )
+         _oldest = (_oldest + 1) % depth;
+   }
+
+private:
+   // out = |current - previous| > threshold ? current : previous, and out becomes previous
+   static void Hysteresis( uint8_t * plane, uint8_t * previous, size_t begin, size_t end, uint8_t threshold )
+   {
+      size_t i = begin;
+#ifdef ALPHA_USE_SSE2
+      const __m128i limit = _mm_set1_epi8( char(threshold) );
+      const __m128i zero = _mm_setzero_si128();
+      for ( ; i + 16 <= end; i += 16 )
+      {
+         __m128i current = _mm_loadu_si128( (const __m128i *)(plane + i) );
+         __m128i last = _mm_loadu_si128( (const __m128i *)(previous + i) );
+         __m128i difference = _mm_or_si128( _mm_subs_epu8( current, last ), _mm_subs_epu8( last, current ) );
+         __m128i keep = _mm_cmpeq_epi8( _mm_subs_epu8( difference, limit ), zero );
+         __m128i out = _mm_or_si128( _mm_and_si128( keep, last ), _mm_andnot_si128( keep, current ) );
+         _mm_storeu_si128( (__m128i *)(plane + i), out );
+         _mm_storeu_si128( (__m128i *)(previous + i), out );
+      }
+#endif
+      for ( ; i < end; ++i )
+      {
+         if ( std::abs( int(plane[ i ]) - int(previous[ i ]) ) <= threshold )
+            plane[ i ] = previous[ i ];
+         previous[ i ] = plane[ i ];
+      }
+   }
+
+   // history[ 0 ] is the oldest input and is overwritten with the current one
+   static void Median( uint8_t * plane, uint8_t * const * history, size_t depth, size_t begin, size_t end )
+   {
+      size_t i = begin;
+#ifdef ALPHA_USE_SSE2
+      auto median3 = []( __m128i a, __m128i b, __m128i c )
+      {
+         return _mm_max_epu8( _mm_min_epu8( a, b ), _mm_min_epu8( _mm_max_epu8( a, b ), c ) );
+      };
+      for ( ; i + 16 <= end; i += 16 )
+      {
+         __m128i current = _mm_loadu_si128( (const __m128i *)(plane + i) );
+         __m128i a = _mm_loadu_si128( (const __m128i *)(history[ 0 ] + i) );
+         __m128i b = _mm_loadu_si128( (const __m128i *)(history[ 1 ] + i) );
+         __m128i out;
+         if ( depth == 2 )
+            out = median3( a, b, current );
+         else
+         {
+            __m128i c = _mm_loadu_si128( (const __m128i *)(history[ 2 ] + i) );
+            __m128i d = _mm_loadu_si128( (const __m128i *)(history[ 3 ] + i) );
+            __m128i low = _mm_max_epu8( _mm_min_epu8( a, b ), _mm_min_epu8( c, d ) );
+            __m128i high = _mm_min_epu8( _mm_max_epu8( a, b ), _mm_max_epu8( c, d ) );
+            out = median3( low, high, current );
+         }
+         _mm_storeu_si128( (__m128i *)(history[ 0 ] + i), current );
+         _mm_storeu_si128( (__m128i *)(plane + i), out );
+      }
+#endif
+      for ( ; i < end; ++i )
+      {
+         uint8_t values[ 5 ] = { plane[ i ] };
+         for ( size_t k = 0; k < depth; ++k )
+            values[ k + 1 ] = history[ k ][ i ];
+         history[ 0 ][ i ] = plane[ i ];
+         std::nth_element( values, values + depth / 2, values + depth + 1 );
+         plane[ i ] = values[ depth / 2 ];
+      }
+   }
+
+   bool _enabled = false;
+   TemporalMode _mode = TemporalMode::Hysteresis;
+   int _value = 0;
+   size_t _oldest = 0;
+   std::vector< std::vector< uint8_t > > _history;
+};
@@ -0,0 +1,377 @@
+// Reports the structure and bitrate of HEVC streams with an alpha layer, no GPU needed
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <numeric>
+#include <CLI/CLI.hpp>
+
+#include "utility.hpp"
+#include "nal.hpp"
+#include "hevc.hpp"
+
+struct Args
+{
+   std::vector< std::string > inputFilenames;
+   int fpsNumerator = 30;
+   int fpsDenominator = 1;
+}args;
+
+enum PictureKind
+{
+   kPictureIdr,
+   kPictureOtherIrap,                             // CRA and BLA
+   kPictureI,
+   kPictureP,
+   kPictureB,
+   kPictureKindCount
+};
+static const char * kPictureNames[ kPictureKindCount ] = { "IDR", "CRA/BLA", "I", "P", "B" };
+static const char kPictureLetters[ kPictureKindCount ] = { 'I', 'I', 'i', 'P', 'B' };
+
+static const int kMaxLayers = 64;
+
+// Walks one stream's NAL units in order, counting pictures and bytes per layer and kind
+class StreamAnalyzer
+{
+public:
+   void Add( const NalUnit & nal )
+   {
+      int layer = nal.Layer(), type = nal.Type();
+      LayerStatistics & statistics = _layers[ layer ];
+      if ( type > kNalVclLast )
+      {
+         statistics.otherBytes += nal.size;
+         if ( type >= kNalVps && type <= kNalPps )
+         {
+            try
+            {
+               _sets.Add( nal );
+            }
+            catch ( const std::runtime_error & e )
+            {
+               Failed( e );
+            }
+         }
+         return;
+      }
+
+      Picture & picture = _pictures[ layer ];
+      // Slice headers only need reading where a picture starts, the rest just add bytes
+      if ( !picture.open || (nal.size > 2 && (nal.data[ 2 ] & 0x80)) )
+      {
+         HevcSliceHeader header;
+         try
+         {
+            header = ParseSliceHeader( nal, _sets );
+         }
+         catch ( const std::runtime_error & e )
+         {
+            Failed( e );
+            statistics.otherBytes += nal.size;
+            return;
+         }
+         if ( header.firstInPicture || !picture.open )
+         {
+            const HevcPps * pps = _sets.FindPps( layer, header.ppsId );
+            _lastSpsId[ layer ] = pps ? pps->spsId : 0;
+            ClosePicture( layer );
+            picture.open = true;
+            picture.kind = Kind( type, header.sliceType );
+            if ( layer == 0 )
+               StartBasePicture( nal, type, header );
+         }
+      }
+      picture.bytes += nal.size;
+   }
+
+   // Counts the pictures still open at the end of the stream
+   void Finish()
+   {
+      for ( int layer = 0; layer < kMaxLayers; ++layer )
+         ClosePicture( layer );
+      CloseGop();
+   }
+
+   void Report( std::ostream & out ) const
+   {
+      static const char * chromaFormats[ 4 ] = { "4:0:0", "4:2:0", "4:2:2", "4:4:4" };
+      double frameRate = double(args.fpsNumerator) / args.fpsDenominator;
+
+      for ( const auto & entry : _sets.Vps() )
+      {
+         const HevcVps & vps = entry.second;
+         out << "   VPS " << vps.id << ": " << vps.maxLayers << " layers, " << vps.maxSubLayers << " sub-layers, "
+            << ProfileName( vps.profileTierLevel ) << " level " << vps.profileTierLevel.level / 30.0;
+         if ( vps.timing && vps.unitsInTick > 0 )
+            out << ", " << double(vps.timeScale) / vps.unitsInTick << " ticks per second";
+         out << std::endl;
+         if ( !vps.extension )
+         {
+            if ( vps.maxLayers > 1 )
+               out << "      no VPS extension was read, layers are not described" << std::endl;
+            continue;
+         }
+         out << "      scalability:";
+         for ( const auto & type : vps.scalability )
+            out << " " << type;
+         out << std::endl;
+         for ( size_t i = 1; i < vps.layers.size(); ++i )
+         {
+            const HevcLayerInfo & layer = vps.layers[ i ];
+            out << "      layer " << layer.nuhLayerId << ": " << AuxName( layer.auxId );
+            for ( size_t j = 0; j < layer.dependsOn.size(); ++j )
+               out << (j ? ", " : ", predicted from layer ") << layer.dependsOn[ j ];
+            out << std::endl;
+         }
+      }
+
+      uint64_t basePictures = _layers[ 0 ].Pictures();
+      double seconds = basePictures / frameRate;
+      for ( int layer = 0; layer < kMaxLayers; ++layer )
+      {
+         const LayerStatistics & statistics = _layers[ layer ];
+         uint64_t bytes = statistics.Bytes();
+         if ( bytes == 0 )
+            continue;
+
+         out << "   layer " << layer;
+         int auxId = AuxId( layer );
+         if ( auxId != kAuxNone )
+            out << " (" << AuxName( auxId ) << ")";
+         out << ": " << statistics.Pictures() << " pictures";
+         const HevcSps * sps = _sets.FindSps( layer, _lastSpsId[ layer ] );
+         if ( sps )
+            out << ", " << sps->width << "x" << sps->height << " " << chromaFormats[ sps->chromaFormat & 3 ] << " "
+               << sps->bitDepthLuma << "-bit" << (sps->multiLayerExtension ? " (from the base layer)" : "");
+         out << ", " << bytes << " bytes";
+         if ( seconds > 0 )
+            out << ", " << bytes * 8 / seconds / 1000 << " kbit/s at " << frameRate << " fps";
+         out << std::endl;
+         for ( int kind = 0; kind < kPictureKindCount; ++kind )
+         {
+            if ( statistics.pictures[ kind ] == 0 )
+               continue;
+            out << "      " << std::setw( 7 ) << std::left << kPictureNames[ kind ] << std::right << statistics.pictures[ kind ]
+               << " pictures, " << statistics.bytes[ kind ] / statistics.pictures[ kind ] << " bytes each, "
+               << 100.0 * statistics.bytes[ kind ] / bytes << "% of the layer" << std::endl;
+         }
+         out << "      headers " << statistics.otherBytes << " bytes" << std::endl;
+      }
+
+      // Alpha is present when a layer is described as alpha, complete when it has every picture
+      bool alpha = false;
+      for ( int layer = 1; layer < kMaxLayers; ++layer )
+      {
+         if ( AuxId( layer ) == kAuxAlpha )
+         {
+            alpha = true;
+            out << "   alpha in layer " << layer << ", " << _layers[ layer ].Pictures() << " of " << basePictures << " pictures" << std::endl;
+         }
+      }
+      if ( !alpha )
+         out << "   no alpha layer" << std::endl;
+
+      if ( !_gopLengths.empty() )
+      {
+         auto range = std::minmax_element( _gopLengths.begin(), _gopLengths.end() );
+         out << "   " << _gopLengths.size() << " GOPs of " << *range.first << " to " << *range.second << " pictures, average "
+            << double(basePictures) / _gopLengths.size() << ", longest B run " << _longestBRun << std::endl;
+         out << "      first in display order: " << _firstGop << std::endl;
+      }
+      if ( _errors > 0 )
+         out << "   " << _errors << " NAL units could not be parsed, the first: " << _firstError << std::endl;
+   }
+
+private:
+   struct LayerStatistics
+   {
+      uint64_t pictures[ kPictureKindCount ] = {};
+      uint64_t bytes[ kPictureKindCount ] = {};   // Slices
+      uint64_t otherBytes = 0;                    // Parameter sets, SEI and anything else
+
+      uint64_t Pictures() const { return std::accumulate( pictures, pictures + kPictureKindCount, uint64_t(0) ); }
+      uint64_t Bytes() const { return std::accumulate( bytes, bytes + kPictureKindCount, otherBytes ); }
+   };
+
+   struct Picture
+   {
+      bool open = false;
+      int kind = kPictureI;
+      uint64_t bytes = 0;
+   };
+
+   static int Kind( int type, int sliceType )
+   {
+      if ( type == kNalIdrWithLeading || type == kNalIdrNoLeading )
+         return kPictureIdr;
+      if ( type >= kNalIrapFirst && type <= kNalIrapReservedLast )
+         return kPictureOtherIrap;
+      return (sliceType == kSliceB) ? kPictureB : (sliceType == kSliceP) ? kPictureP : kPictureI;
+   }
+
+   static std::string ProfileName( const HevcProfileTierLevel & profileTierLevel )
+   {
+      static const char * names[] = { "", "Main", "Main 10", "Main Still Picture", "Range extensions" };
+      std::string returnValue = (profileTierLevel.profile >= 1 && profileTierLevel.profile <= 4)
+         ? names[ profileTierLevel.profile ] : "profile " + std::to_string( profileTierLevel.profile );
+      return returnValue + (profileTierLevel.tier ? " High tier" : "");
+   }
+
+   static const char * AuxName( int auxId )
+   {
+      switch ( auxId )
+      {
+         case kAuxNone: return "not auxiliary";
+         case kAuxAlpha: return "alpha";
+         case kAuxDepth: return "depth";
+         default: return "other auxiliary";
+      }
+   }
+
+   int AuxId( int nuhLayerId ) const
+   {
+      for ( const auto & entry : _sets.Vps() )
+      {
+         for ( const auto & layer : entry.second.layers )
+         {
+            if ( layer.nuhLayerId == nuhLayerId && layer.auxId != kAuxNone )
+               return layer.auxId;
+         }
+      }
+      return kAuxNone;
+   }
+
+   void Failed( const std::runtime_error & e )
+   {
+      if ( _errors++ == 0 )
+         _firstError = e.what();
+   }
+
+   void ClosePicture( int layer )
+   {
+      Picture & picture = _pictures[ layer ];
+      if ( !picture.open )
+         return;
+      ++_layers[ layer ].pictures[ picture.kind ];
+      _layers[ layer ].bytes[ picture.kind ] += picture.bytes;
+      picture = Picture();
+   }
+
+   // Tracks GOPs and picture order on the base layer. The POC is derived as the decoder does,
+   // from the previous picture of temporal layer 0 that is neither leading nor non-reference.
+   void StartBasePicture( const NalUnit & nal,
+      int type,
+      const HevcSliceHeader & header )
+   {
+      int kind = _pictures[ 0 ].kind;
+      if ( kind == kPictureIdr || kind == kPictureOtherIrap )
+         CloseGop();
+
+      const HevcSps * sps = _sets.FindSps( 0, _lastSpsId[ 0 ] );
+      int maxPocLsb = 1 << (sps ? sps->log2MaxPocLsb : 4);
+      int pocMsb = 0;
+      if ( kind != kPictureIdr )
+      {
+         pocMsb = _previousPocMsb;
+         if ( header.pocLsb < _previousPocLsb && _previousPocLsb - header.pocLsb >= maxPocLsb / 2 )
+            pocMsb += maxPocLsb;
+         else if ( header.pocLsb > _previousPocLsb && header.pocLsb - _previousPocLsb > maxPocLsb / 2 )
+            pocMsb -= maxPocLsb;
+      }
+      bool temporalLayerZero = (nal.data[ 1 ] & 7) == 1;
+      bool nonReference = type <= 14 && type % 2 == 0;
+      bool leading = type >= 6 && type <= 9;
+      if ( temporalLayerZero && !nonReference && !leading )
+      {
+         _previousPocMsb = pocMsb;
+         _previousPocLsb = header.pocLsb;
+      }
+      _gop.push_back( { pocMsb + header.pocLsb, kPictureLetters[ kind ] } );
+   }
+
+   void CloseGop()
+   {
+      if ( _gop.empty() )
+         return;
+      std::stable_sort( _gop.begin(), _gop.end() );
+      int run = 0;
+      std::string pattern;
+      for ( const auto & picture : _gop )
+      {
+         run = (picture.second == 'B') ? run + 1 : 0;
+         _longestBRun = std::max( _longestBRun, run );
+         pattern += picture.second;
+      }
+      if ( _gopLengths.empty() )
+         _firstGop = (pattern.size() > 64) ? pattern.substr( 0, 64 ) + "..." : pattern;
+      _gopLengths.push_back( int(_gop.size()) );
+      _gop.clear();
+   }
+
+   HevcParameterSets _sets;
+   LayerStatistics _layers[ kMaxLayers ];
+   Picture _pictures[ kMaxLayers ];
+   int _lastSpsId[ kMaxLayers ] = {};
+   int _previousPocMsb = 0;
+   int _previousPocLsb = 0;
+   std::vector< std::pair< int, char > > _gop;    // POC and letter of each picture of the current GOP
+   std::vector< int > _gopLengths;
+   std::string _firstGop;
+   int _longestBRun = 0;
+   uint64_t _errors = 0;
+   std::string _firstError;
+};
+
+int main( int argc, char *argv[] )
+{
+   CLI::App app{ "Reports layers, bitrate per picture type and GOP structure of HEVC streams with an alpha layer" };
+   app.add_option( "input", args.inputFilenames, "Raw .265 streams to analyze\n" )->required();
+   app.add_option( "--fpsn", args.fpsNumerator, "Frame rate numerator, for bitrates\n" )->check( CLI::PositiveNumber );
+   app.add_option( "--fpsd", args.fpsDenominator, "Frame rate denominator, for bitrates\n" )->check( CLI::PositiveNumber );
+   try
+   {
+      app.parse( argc, argv );
+   }
+   catch( const CLI::ParseError &e )
+   {
+      std::cout << e.what() << "\n";
+      std::cout << app.help();
+      return 1;
+   }
+
+   int returnValue = 0;
+   uint64_t totalBytes = 0;
+   double totalSeconds = 0;
+   for ( const auto & filename : args.inputFilenames )
+   {
+      try
+      {
+         MappedFile input( ExpandTilde( filename ) );
+         StreamAnalyzer analyzer;
+         auto start = std::chrono::steady_clock::now();
+         NalScanner scanner( input.Data(), input.Size() );
+         NalUnit nal;
+         while ( scanner.Next( nal ) )
+            analyzer.Add( nal );
+         analyzer.Finish();
+         double seconds = std::chrono::duration< double >( std::chrono::steady_clock::now() - start ).count();
+         totalBytes += input.Size();
+         totalSeconds += seconds;
+
+         std::cout << filename << ": " << input.Size() << " bytes in " << seconds * 1000 << " ms";
+         if ( seconds > 0 )
+            std::cout << " (" << input.Size() / seconds / 1e6 << " MB/s)";
+         std::cout << std::endl;
+         analyzer.Report( std::cout );
+      }
+      catch ( const std::runtime_error & e )
+      {
+         std::cout << filename << ": " << e.what() << std::endl;
+         returnValue = 1;
+      }
+   }
+   if ( args.inputFilenames.size() > 1 && totalSeconds > 0 )
+      std::cout << "Analyzed " << totalBytes << " bytes at " << totalBytes / totalSeconds / 1e6 << " MB/s" << std::endl;
+   return returnValue;
+}
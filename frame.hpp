@@ -0,0 +1,124 @@
+// NV12 frame geometry, reading and edge padding.
+// Frames are staged for the encoder at an aligned size. Anything beyond the picture
+// is filled by replicating the last column and row so the encoder never sees garbage,
+// and the picture size itself is signaled through the HEVC conformance window.
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <stdexcept>
+
+inline int AlignUp( int value, int alignment )
+{
+   return (value + alignment - 1) / alignment * alignment;
+}
+
+struct Rect
+{
+   int x = 0, y = 0, width = 0, height = 0;
+
+   bool operator==( const Rect & other ) const { return x == other.x && y == other.y && width == other.width && height == other.height; }
+   bool operator!=( const Rect & other ) const { return !(*this == other); }
+};
+
+struct Nv12Geometry
+{
+   Nv12Geometry() = default;
+   Nv12Geometry( int width_, int height_, int alignment )
+      : width( width_ ),
+        height( height_ ),
+        encodeWidth( AlignUp( width_, 2 ) ),
+        encodeHeight( AlignUp( height_, 2 ) ),
+        alignedWidth( AlignUp( width_, alignment ) ),
+        alignedHeight( AlignUp( height_, alignment ) )
+   {
+      if ( width <= 0 || height <= 0 )
+         throw std::runtime_error( "Frame dimensions must be positive" );
+   }
+
+   // Bytes per frame in a raw .yuv file. Odd sizes round the chroma plane up, as FFmpeg does.
+   size_t FileFrameSize() const { return size_t(width) * height + size_t(ChromaFileRowBytes()) * ((height + 1) / 2); }
+   int ChromaFileRowBytes() const { return (width + 1) / 2 * 2; }
+
+   // Staged frames are tightly packed at the aligned size, chroma directly after luma
+   int Pitch() const { return alignedWidth; }
+   size_t LumaSize() const { return size_t(alignedWidth) * alignedHeight; }
+   size_t FrameSize() const { return LumaSize() * 3 / 2; }
+
+   int width = 0, height = 0;                // Picture size as given
+   int encodeWidth = 0, encodeHeight = 0;    // Rounded up to even, the finest crop 4:2:0 can signal
+   int alignedWidth = 0, alignedHeight = 0;  // Staged surface size
+};
+
+inline void CopyPlane( const uint8_t * src,
+   int srcPitch,
+   uint8_t * dst,
+   int dstPitch,
+   int widthInBytes,
+   int height )
+{
+   for ( int row = 0; row < height; ++row )
+      memcpy( dst + size_t(row) * dstPitch, src + size_t(row) * srcPitch, widthInBytes );
+}
+
+// Replicates the last valid column and row of a plane out to its aligned size.
+// 'channels' interleaved components are treated as one pixel (2 for NV12 chroma).
+inline void PadPlane( uint8_t * plane,
+   int pitch,
+   int width,
+   int height,
+   int alignedWidth,
+   int alignedHeight,
+   int channels )
+{
+   if ( width < alignedWidth )
+   {
+      for ( int row = 0; row < height; ++row )
+      {
+         uint8_t * line = plane + size_t(row) * pitch;
+         const uint8_t * last = line + (width - 1) * channels;
+         for ( int x = width; x < alignedWidth; ++x )
+            memcpy( line + x * channels, last, channels );
+      }
+   }
+
+   const uint8_t * lastRow = plane + size_t(height - 1) * pitch;
+   for ( int row = height; row < alignedHeight; ++row )
+      memcpy( plane + size_t(row) * pitch, lastRow, size_t(alignedWidth) * channels );
+}
+
+inline void PadNv12Frame( uint8_t * frame, const Nv12Geometry & geometry )
+{
+   PadPlane( frame, geometry.Pitch(), geometry.width, geometry.height, geometry.alignedWidth, geometry.alignedHeight, 1 );
+   PadPlane( frame + geometry.LumaSize(), geometry.Pitch(),
+      (geometry.width + 1) / 2, (geometry.height + 1) / 2,
+      geometry.alignedWidth / 2, geometry.alignedHeight / 2, 2 );
+}
+
+// Reads one raw NV12 frame into a staged buffer of geometry.FrameSize() bytes and pads it.
+// Returns false if the input ended before a whole frame was read.
+inline bool ReadNv12Frame( std::istream & input, const Nv12Geometry & geometry, uint8_t * frame )
+{
+   if ( geometry.width == geometry.alignedWidth && geometry.height == geometry.alignedHeight )
+   {
+      // Already aligned, so the file layout matches the staged layout
+      input.read( (char *)frame, geometry.FrameSize() );
+      return input.gcount() == std::streamsize(geometry.FrameSize());
+   }
+
+   for ( int row = 0; row < geometry.height; ++row )
+   {
+      if ( !input.read( (char *)frame + size_t(row) * geometry.Pitch(), geometry.width ) )
+         return false;
+   }
+   uint8_t * chroma = frame + geometry.LumaSize();
+   for ( int row = 0; row < (geometry.height + 1) / 2; ++row )
+   {
+      if ( !input.read( (char *)chroma + size_t(row) * geometry.Pitch(), geometry.ChromaFileRowBytes() ) )
+         return false;
+   }
+
+   PadNv12Frame( frame, geometry );
+   return true;
+}
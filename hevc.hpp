@@ -0,0 +1,509 @@
+// HEVC parameter set and slice header parsing, as far as analyzing a stream needs.
+// The VPS is read through vps_extension up to the layer dependencies, which is where a
+// multi-layer stream says which layer is an auxiliary picture and what kind. SPS and PPS
+// keep only what a slice header needs to be read up to its type and picture order count.
+// A slice is read from its first few bytes only, so parsing costs next to nothing per picture.
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "nal.hpp"
+
+enum HevcSliceType
+{
+   kSliceB = 0,
+   kSliceP = 1,
+   kSliceI = 2
+};
+
+// AuxId of an auxiliary picture layer
+enum HevcAuxId
+{
+   kAuxNone = 0,
+   kAuxAlpha = 1,
+   kAuxDepth = 2
+};
+
+struct HevcProfileTierLevel
+{
+   int profile = 0;
+   int tier = 0;
+   int level = 0;                                 // 30 times the level number
+};
+
+struct HevcLayerInfo
+{
+   int nuhLayerId = 0;
+   int auxId = kAuxNone;
+   std::vector< int > dependsOn;                  // nuh_layer_id of each direct reference layer
+};
+
+struct HevcVps
+{
+   int id = 0;
+   int maxLayers = 1;
+   int maxSubLayers = 1;
+   HevcProfileTierLevel profileTierLevel;
+   bool timing = false;
+   uint32_t unitsInTick = 0;
+   uint32_t timeScale = 0;
+   bool extension = false;                        // vps_extension was read
+   std::vector< std::string > scalability;        // Scalability types the extension uses
+   std::vector< HevcLayerInfo > layers;           // Index 0 is the base layer
+};
+
+struct HevcSps
+{
+   int id = 0;
+   int vpsId = 0;
+   bool multiLayerExtension = false;              // Takes its profile and picture format from the VPS
+   HevcProfileTierLevel profileTierLevel;
+   int maxSubLayers = 1;
+   int chromaFormat = 1;
+   bool separateColourPlanes = false;
+   int width = 0;                                 // Inside the conformance window
+   int height = 0;
+   int codedWidth = 0;                            // Before the conformance window
+   int codedHeight = 0;
+   int bitDepthLuma = 8;
+   int bitDepthChroma = 8;
+   int log2MaxPocLsb = 4;
+   int log2CtbSize = 4;
+   int picSizeInCtbs = 0;
+};
+
+struct HevcPps
+{
+   int id = 0;
+   int spsId = 0;
+   bool dependentSliceSegments = false;
+   bool outputFlagPresent = false;
+   int extraSliceHeaderBits = 0;
+};
+
+struct HevcSliceHeader
+{
+   bool firstInPicture = false;
+   bool dependent = false;                        // Continues the previous slice, type and POC not coded
+   int ppsId = 0;
+   int sliceType = kSliceI;
+   int pocLsb = 0;                                // 0 for IDR pictures, where it isn't coded
+};
+
+// profile_tier_level(), keeping the general fields
+inline HevcProfileTierLevel ParseProfileTierLevel( BitReader & reader,
+   bool profilePresent,
+   int maxSubLayersMinus1 )
+{
+   HevcProfileTierLevel returnValue;
+   if ( profilePresent )
+   {
+      reader.Bits( 2 );                           // general_profile_space
+      returnValue.tier = int(reader.Bits( 1 ));
+      returnValue.profile = int(reader.Bits( 5 ));
+      reader.Skip( 32 + 48 );                     // Compatibility, constraint and reserved flags
+   }
+   returnValue.level = int(reader.Bits( 8 ));
+
+   std::vector< bool > subProfile( maxSubLayersMinus1 ), subLevel( maxSubLayersMinus1 );
+   for ( int i = 0; i < maxSubLayersMinus1; ++i )
+   {
+      subProfile[ i ] = reader.Bits( 1 );
+      subLevel[ i ] = reader.Bits( 1 );
+   }
+   if ( maxSubLayersMinus1 > 0 )
+      reader.Skip( 2 * (8 - maxSubLayersMinus1) );
+   for ( int i = 0; i < maxSubLayersMinus1; ++i )
+      reader.Skip( (subProfile[ i ] ? 88 : 0) + (subLevel[ i ] ? 8 : 0) );
+   return returnValue;
+}
+
+// The part of hrd_parameters() that a later one without its common info takes from the one before
+struct HrdCommonInfo
+{
+   bool nalHrd = false;
+   bool vclHrd = false;
+   bool subPicture = false;
+};
+
+// Skips hrd_parameters(), keeping only what the next one may inherit
+inline void SkipHrdParameters( BitReader & reader,
+   bool commonInfoPresent,
+   int maxSubLayersMinus1,
+   HrdCommonInfo & common )
+{
+   bool & nalHrd = common.nalHrd;
+   bool & vclHrd = common.vclHrd;
+   bool & subPicture = common.subPicture;
+   if ( commonInfoPresent )
+   {
+      nalHrd = reader.Bits( 1 );
+      vclHrd = reader.Bits( 1 );
+      subPicture = false;
+      if ( nalHrd || vclHrd )
+      {
+         subPicture = reader.Bits( 1 );
+         if ( subPicture )
+            reader.Skip( 8 + 5 + 1 + 5 );         // Tick divisor, DU delay lengths
+         reader.Skip( 4 + 4 );                    // bit_rate_scale, cpb_size_scale
+         if ( subPicture )
+            reader.Skip( 4 );                     // cpb_size_du_scale
+         reader.Skip( 5 + 5 + 5 );                // Delay lengths
+      }
+   }
+   for ( int i = 0; i <= maxSubLayersMinus1; ++i )
+   {
+      bool fixedRate = reader.Bits( 1 );          // fixed_pic_rate_general_flag
+      if ( !fixedRate )
+         fixedRate = reader.Bits( 1 );            // fixed_pic_rate_within_cvs_flag
+      bool lowDelay = false;
+      if ( fixedRate )
+         reader.Golomb();                         // elemental_duration_in_tc_minus1
+      else
+         lowDelay = reader.Bits( 1 );
+      int cpbCount = lowDelay ? 1 : int(reader.Golomb()) + 1;
+      for ( int hrd = (nalHrd ? 1 : 0) + (vclHrd ? 1 : 0); hrd > 0; --hrd )
+      {
+         // sub_layer_hrd_parameters()
+         for ( int j = 0; j < cpbCount; ++j )
+         {
+            reader.Golomb();
+            reader.Golomb();
+            if ( subPicture )
+            {
+               reader.Golomb();
+               reader.Golomb();
+            }
+            reader.Bits( 1 );                     // cbr_flag
+         }
+      }
+   }
+}
+
+// vps_extension() through the direct dependency flags
+inline void ParseVpsExtension( BitReader & reader,
+   HevcVps & vps,
+   bool baseLayerInternal )
+{
+   static const char * kScalabilityNames[ 4 ] = { "depth", "multiview", "spatial/quality", "auxiliary" };
+
+   if ( vps.maxLayers > 1 && baseLayerInternal )
+      ParseProfileTierLevel( reader, false, vps.maxSubLayers - 1 );
+   bool splitting = reader.Bits( 1 );
+   std::vector< int > types;                      // Scalability mask index of each dimension
+   for ( int i = 0; i < 16; ++i )
+   {
+      if ( reader.Bits( 1 ) )
+      {
+         types.push_back( i );
+         vps.scalability.push_back( (i < 4) ? kScalabilityNames[ i ] : "reserved " + std::to_string( i ) );
+      }
+   }
+   std::vector< int > lengths( types.size(), 0 );
+   for ( size_t j = 0; j + (splitting ? 1 : 0) < types.size(); ++j )
+      lengths[ j ] = int(reader.Bits( 3 )) + 1;
+   if ( splitting && !types.empty() )
+   {
+      int used = 0;
+      for ( size_t j = 0; j + 1 < types.size(); ++j )
+         used += lengths[ j ];
+      lengths.back() = 6 - used;
+   }
+
+   bool layerIdPresent = reader.Bits( 1 );
+   std::vector< std::vector< int > > dimensions( vps.maxLayers, std::vector< int >( types.size(), 0 ) );
+   for ( int i = 1; i < vps.maxLayers; ++i )
+   {
+      vps.layers[ i ].nuhLayerId = layerIdPresent ? int(reader.Bits( 6 )) : i;
+      if ( splitting )
+      {
+         int offset = 0;
+         for ( size_t j = 0; j < types.size(); ++j )
+         {
+            dimensions[ i ][ j ] = (vps.layers[ i ].nuhLayerId >> offset) & ((1 << lengths[ j ]) - 1);
+            offset += lengths[ j ];
+         }
+      }
+      else
+      {
+         for ( size_t j = 0; j < types.size(); ++j )
+            dimensions[ i ][ j ] = int(reader.Bits( lengths[ j ] ));
+      }
+   }
+
+   // Views are counted to skip their ids, then auxiliary layers get their kind
+   std::set< int > views = { 0 };
+   for ( size_t j = 0; j < types.size(); ++j )
+   {
+      for ( int i = 1; i < vps.maxLayers; ++i )
+      {
+         if ( types[ j ] == 1 )
+            views.insert( dimensions[ i ][ j ] );
+         else if ( types[ j ] == 3 )
+            vps.layers[ i ].auxId = dimensions[ i ][ j ];
+      }
+   }
+   int viewIdLength = int(reader.Bits( 4 ));
+   if ( viewIdLength > 0 )
+      reader.Skip( views.size() * size_t(viewIdLength) );
+
+   for ( int i = 1; i < vps.maxLayers; ++i )
+   {
+      for ( int j = 0; j < i; ++j )
+      {
+         if ( reader.Bits( 1 ) )
+            vps.layers[ i ].dependsOn.push_back( vps.layers[ j ].nuhLayerId );
+      }
+   }
+   vps.extension = true;
+}
+
+inline HevcVps ParseVps( const NalUnit & nal )
+{
+   std::vector< uint8_t > rbsp = ExtractRbsp( nal );
+   BitReader reader( rbsp, 0 );
+   HevcVps returnValue;
+   returnValue.id = int(reader.Bits( 4 ));
+   bool baseLayerInternal = reader.Bits( 1 );
+   reader.Bits( 1 );                              // vps_base_layer_available_flag
+   returnValue.maxLayers = int(reader.Bits( 6 )) + 1;
+   returnValue.maxSubLayers = int(reader.Bits( 3 )) + 1;
+   reader.Skip( 1 + 16 );                         // Temporal id nesting, reserved 0xffff
+   returnValue.profileTierLevel = ParseProfileTierLevel( reader, true, returnValue.maxSubLayers - 1 );
+   returnValue.layers.resize( returnValue.maxLayers );
+   for ( int i = 0; i < returnValue.maxLayers; ++i )
+      returnValue.layers[ i ].nuhLayerId = i;
+
+   bool orderingInfo = reader.Bits( 1 );
+   for ( int i = orderingInfo ? 0 : returnValue.maxSubLayers - 1; i < returnValue.maxSubLayers; ++i )
+   {
+      reader.Golomb();
+      reader.Golomb();
+      reader.Golomb();
+   }
+   int maxLayerId = int(reader.Bits( 6 ));
+   int layerSets = int(reader.Golomb()) + 1;
+   reader.Skip( size_t(layerSets - 1) * size_t(maxLayerId + 1) );
+
+   returnValue.timing = reader.Bits( 1 );
+   if ( returnValue.timing )
+   {
+      returnValue.unitsInTick = reader.Bits( 32 );
+      returnValue.timeScale = reader.Bits( 32 );
+      if ( reader.Bits( 1 ) )
+         reader.Golomb();
+      int hrdCount = int(reader.Golomb());        // vps_num_hrd_parameters
+      HrdCommonInfo common;
+      for ( int i = 0; i < hrdCount; ++i )
+      {
+         reader.Golomb();                         // hrd_layer_set_idx
+         bool commonInfoPresent = i == 0 || reader.Bits( 1 );
+         SkipHrdParameters( reader, commonInfoPresent, returnValue.maxSubLayers - 1, common );
+      }
+   }
+   if ( reader.Bits( 1 ) )
+   {
+      while ( !reader.ByteAligned() )
+         reader.Bits( 1 );
+      ParseVpsExtension( reader, returnValue, baseLayerInternal );
+   }
+   return returnValue;
+}
+
+// Parses an SPS of any layer. One of a layer above the base that takes its format from the VPS
+// copies the picture format from 'base' instead, when given.
+inline HevcSps ParseLayerSps( const NalUnit & nal,
+   const HevcSps * base )
+{
+   std::vector< uint8_t > rbsp = ExtractRbsp( nal );
+   BitReader reader( rbsp, 0 );
+   HevcSps returnValue;
+   returnValue.vpsId = int(reader.Bits( 4 ));
+   int maxSubLayersMinus1 = int(reader.Bits( 3 ));
+   returnValue.multiLayerExtension = nal.Layer() > 0 && maxSubLayersMinus1 == 7;
+   if ( !returnValue.multiLayerExtension )
+   {
+      returnValue.maxSubLayers = maxSubLayersMinus1 + 1;
+      reader.Bits( 1 );                           // sps_temporal_id_nesting_flag
+      returnValue.profileTierLevel = ParseProfileTierLevel( reader, true, maxSubLayersMinus1 );
+   }
+   returnValue.id = int(reader.Golomb());
+
+   if ( returnValue.multiLayerExtension )
+   {
+      if ( reader.Bits( 1 ) )                     // update_rep_format_flag
+         reader.Bits( 8 );
+      if ( base )
+      {
+         returnValue.profileTierLevel = base->profileTierLevel;
+         returnValue.maxSubLayers = base->maxSubLayers;
+         returnValue.chromaFormat = base->chromaFormat;
+         returnValue.separateColourPlanes = base->separateColourPlanes;
+         returnValue.width = base->width;
+         returnValue.height = base->height;
+         returnValue.codedWidth = base->codedWidth;
+         returnValue.codedHeight = base->codedHeight;
+         returnValue.bitDepthLuma = base->bitDepthLuma;
+         returnValue.bitDepthChroma = base->bitDepthChroma;
+      }
+   }
+   else
+   {
+      returnValue.chromaFormat = int(reader.Golomb());
+      if ( returnValue.chromaFormat == 3 )
+         returnValue.separateColourPlanes = reader.Bits( 1 );
+      returnValue.codedWidth = returnValue.width = int(reader.Golomb());
+      returnValue.codedHeight = returnValue.height = int(reader.Golomb());
+      if ( reader.Bits( 1 ) )
+      {
+         // Conformance window, in chroma samples
+         int left = int(reader.Golomb()), right = int(reader.Golomb());
+         int top = int(reader.Golomb()), bottom = int(reader.Golomb());
+         int subWidth = (returnValue.chromaFormat == 1 || returnValue.chromaFormat == 2) ? 2 : 1;
+         int subHeight = (returnValue.chromaFormat == 1) ? 2 : 1;
+         returnValue.width -= subWidth * (left + right);
+         returnValue.height -= subHeight * (top + bottom);
+      }
+      returnValue.bitDepthLuma = 8 + int(reader.Golomb());
+      returnValue.bitDepthChroma = 8 + int(reader.Golomb());
+   }
+   returnValue.log2MaxPocLsb = int(reader.Golomb()) + 4;
+   if ( !returnValue.multiLayerExtension )
+   {
+      bool orderingInfo = reader.Bits( 1 );
+      for ( int i = orderingInfo ? 0 : maxSubLayersMinus1; i <= maxSubLayersMinus1; ++i )
+      {
+         reader.Golomb();
+         reader.Golomb();
+         reader.Golomb();
+      }
+   }
+   int log2MinCbSize = int(reader.Golomb()) + 3;
+   returnValue.log2CtbSize = log2MinCbSize + int(reader.Golomb());
+   int ctbSize = 1 << returnValue.log2CtbSize;
+   returnValue.picSizeInCtbs = ((returnValue.codedWidth + ctbSize - 1) / ctbSize) * ((returnValue.codedHeight + ctbSize - 1) / ctbSize);
+   return returnValue;
+}
+
+inline HevcPps ParsePps( const NalUnit & nal )
+{
+   std::vector< uint8_t > rbsp = ExtractRbsp( nal, 16 );
+   BitReader reader( rbsp, 0 );
+   HevcPps returnValue;
+   returnValue.id = int(reader.Golomb());
+   returnValue.spsId = int(reader.Golomb());
+   returnValue.dependentSliceSegments = reader.Bits( 1 );
+   returnValue.outputFlagPresent = reader.Bits( 1 );
+   returnValue.extraSliceHeaderBits = int(reader.Bits( 3 ));
+   return returnValue;
+}
+
+// The parameter sets seen so far, by layer and id. A layer without its own set of an id
+// uses the one of the nearest layer below it.
+class HevcParameterSets
+{
+public:
+   void Add( const NalUnit & nal )
+   {
+      int layer = nal.Layer();
+      switch ( nal.Type() )
+      {
+         case kNalVps:
+         {
+            HevcVps vps = ParseVps( nal );
+            _vps[ vps.id ] = vps;
+            break;
+         }
+         case kNalSps:
+         {
+            // An extension SPS inherits from the base layer's latest
+            HevcSps sps = ParseLayerSps( nal, FindSps( 0, _baseSpsId ) );
+            _sps[ layer * 16 + sps.id ] = sps;
+            if ( layer == 0 )
+               _baseSpsId = sps.id;
+            break;
+         }
+         case kNalPps:
+         {
+            HevcPps pps = ParsePps( nal );
+            _pps[ layer * 64 + pps.id ] = pps;
+            break;
+         }
+      }
+   }
+
+   const HevcVps * FindVps( int id ) const
+   {
+      auto it = _vps.find( id );
+      return (it == _vps.end()) ? nullptr : &it->second;
+   }
+   const HevcSps * FindSps( int layer, int id ) const { return Find( _sps, layer, 16, id ); }
+   const HevcPps * FindPps( int layer, int id ) const { return Find( _pps, layer, 64, id ); }
+
+   const std::map< int, HevcVps > & Vps() const { return _vps; }
+
+private:
+   template< class T >
+   static const T * Find( const std::map< int, T > & sets, int layer, int ids, int id )
+   {
+      for ( ; layer >= 0; --layer )
+      {
+         auto it = sets.find( layer * ids + id );
+         if ( it != sets.end() )
+            return &it->second;
+      }
+      return nullptr;
+   }
+
+   std::map< int, HevcVps > _vps;
+   std::map< int, HevcSps > _sps;                 // By layer * 16 + id
+   std::map< int, HevcPps > _pps;                 // By layer * 64 + id
+   int _baseSpsId = 0;
+};
+
+// Reads a slice segment header up to its type and, for the base layer, its picture order count.
+// Throws if the parameter sets it refers to haven't been seen.
+inline HevcSliceHeader ParseSliceHeader( const NalUnit & nal,
+   const HevcParameterSets & sets )
+{
+   std::vector< uint8_t > rbsp = ExtractRbsp( nal, 32 );
+   BitReader reader( rbsp, 0 );
+   HevcSliceHeader returnValue;
+   int type = nal.Type(), layer = nal.Layer();
+   returnValue.firstInPicture = reader.Bits( 1 );
+   if ( type >= kNalIrapFirst && type <= kNalIrapReservedLast )
+      reader.Bits( 1 );                           // no_output_of_prior_pics_flag
+   returnValue.ppsId = int(reader.Golomb());
+   const HevcPps * pps = sets.FindPps( layer, returnValue.ppsId );
+   const HevcSps * sps = pps ? sets.FindSps( layer, pps->spsId ) : nullptr;
+   if ( !sps )
+      throw std::runtime_error( "Slice refers to a parameter set that hasn't been sent" );
+
+   if ( !returnValue.firstInPicture )
+   {
+      if ( pps->dependentSliceSegments )
+         returnValue.dependent = reader.Bits( 1 );
+      int addressBits = 0;
+      while ( (1 << addressBits) < sps->picSizeInCtbs )
+         ++addressBits;
+      reader.Skip( size_t(addressBits) );
+   }
+   if ( returnValue.dependent )
+      return returnValue;
+
+   reader.Skip( size_t(pps->extraSliceHeaderBits) );
+   returnValue.sliceType = int(reader.Golomb());
+   if ( pps->outputFlagPresent )
+      reader.Bits( 1 );
+   if ( sps->separateColourPlanes )
+      reader.Bits( 2 );
+   // An IDR codes no POC. Layers above the base may leave it out too, which only the
+   // deeper VPS extension says, so theirs isn't read.
+   if ( layer == 0 && type != kNalIdrWithLeading && type != kNalIdrNoLeading )
+      returnValue.pocLsb = int(reader.Bits( sps->log2MaxPocLsb ));
+   return returnValue;
+}
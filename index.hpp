@@ -0,0 +1,92 @@
+// Per-frame index of a raw HEVC output, so a clip can be cut or remuxed without parsing the stream.
+// The file is a 16 byte header followed by one fixed-size entry per access unit in decode order,
+// little-endian as written. It is read back through a memory map, so any entry is one lookup.
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <fstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "utility.hpp"
+
+// One access unit as NV_ENC_LOCK_BITSTREAM reported it
+struct FrameIndexEntry
+{
+   uint64_t offset = 0;                           // Of the access unit's first byte in the stream
+   uint64_t timeStamp = 0;                        // outputTimeStamp, when the frame is shown in timeScale ticks
+   uint32_t size = 0;                             // Both layers
+   uint32_t alphaSize = 0;                        // The alpha layer's share of 'size'
+   uint32_t frameIdx = 0;                         // NVENC's frame number, counting frames in input order
+   uint32_t pictureType = 0;                      // NV_ENC_PIC_TYPE
+};
+static_assert( sizeof( FrameIndexEntry ) == 32, "The index entry layout is part of the file format" );
+
+struct FrameIndexHeader
+{
+   char magic[ 4 ] = { 'H', 'A', 'I', 'X' };
+   uint32_t version = 2;
+   uint32_t entrySize = sizeof( FrameIndexEntry );
+   uint32_t timeScale = 0;                        // Timestamp ticks per second
+};
+static_assert( sizeof( FrameIndexHeader ) == 16, "The index header layout is part of the file format" );
+
+inline void WriteFrameIndex( const std::string & filename,
+   const std::vector< FrameIndexEntry > & entries,
+   uint32_t timeScale )
+{
+   std::ofstream output( filename, std::ios::binary );
+   FrameIndexHeader header;
+   header.timeScale = timeScale;
+   output.write( (const char *)&header, sizeof( header ) );
+   output.write( (const char *)entries.data(), std::streamsize(entries.size() * sizeof( FrameIndexEntry )) );
+   if ( !output.good() )
+      throw std::runtime_error( "Failed writing index " + filename );
+}
+
+// A frame index mapped read-only. Entries point straight into the file.
+class FrameIndex
+{
+public:
+   explicit FrameIndex( const std::string & filename ) : _file( filename )
+   {
+      FrameIndexHeader expected, header;
+      if ( _file.Size() < sizeof( header ) )
+         throw std::runtime_error( "Not a frame index: " + filename );
+      memcpy( &header, _file.Data(), sizeof( header ) );
+      if ( memcmp( header.magic, expected.magic, sizeof( header.magic ) ) != 0 || header.version != expected.version
+         || header.entrySize != expected.entrySize || (_file.Size() - sizeof( header )) % sizeof( FrameIndexEntry ) != 0 )
+         throw std::runtime_error( "Not a frame index, or an unsupported version: " + filename );
+      _entries = (const FrameIndexEntry *)(_file.Data() + sizeof( header ));
+      _size = (_file.Size() - sizeof( header )) / sizeof( FrameIndexEntry );
+      _timeScale = header.timeScale;
+   }
+
+   size_t Size() const { return _size; }
+   uint32_t TimeScale() const { return _timeScale; }
+   const FrameIndexEntry & operator[]( size_t entry ) const { return _entries[ entry ]; }
+
+   // The IDR decoding has to start from to reach 'entry'
+   size_t KeyFrameBefore( size_t entry ) const
+   {
+      while ( entry > 0 && _entries[ entry ].pictureType != kIdr )
+         --entry;
+      return entry;
+   }
+
+   // Where an entry starts in the stream, or where the stream ends for one past the last
+   uint64_t Offset( size_t first ) const { return (first < _size) ? _entries[ first ].offset : End(); }
+   // Bytes of the stream holding entries [first, last), for cutting them out with one read
+   uint64_t Bytes( size_t first, size_t last ) const { return Offset( last ) - Offset( first ); }
+
+private:
+   static constexpr uint32_t kIdr = 3;            // NV_ENC_PIC_TYPE_IDR, kept here so readers need no SDK
+
+   uint64_t End() const { return _size ? _entries[ _size - 1 ].offset + _entries[ _size - 1 ].size : 0; }
+
+   MappedFile _file;
+   const FrameIndexEntry * _entries = nullptr;
+   size_t _size = 0;
+   uint32_t _timeScale = 0;
+};
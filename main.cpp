@@ -6,9 +6,33 @@
 #include <unordered_map>
 #include <sstream>
 #include <cstring>
+#include <cmath>
+#include <memory>
+#include <tuple>
+#include <atomic>
+#include <chrono>
+#include <numeric>
 #include <CLI/CLI.hpp>
 #include <cuda.h>
+#ifndef _WIN32
+   #include <cerrno>
+   #include <csignal>
+   #include <climits>
+   #include <sys/socket.h>
+   #include <sys/stat.h>
+   #include <sys/un.h>
+   #include <unistd.h>
+#endif
 #include "utility.hpp"
+#include "frame.hpp"
+#include "scaler.hpp"
+#include "alpha.hpp"
+#include "scenecut.hpp"
+#include "writer.hpp"
+#include "nal.hpp"
+#include "mp4.hpp"
+#include "index.hpp"
+#include "playlist.hpp"
 #include "nvEncodeAPI.h"
 
 // Error handling
@@ -49,15 +73,18 @@ struct MyNv
       // Put caps and expected values here as {key,val} pairs
       { NV_ENC_CAPS_SUPPORT_ALPHA_LAYER_ENCODING, 1 }
    };
-   int cudaDeviceIndex = 0;
    NV_ENCODE_API_FUNCTION_LIST functions = { NV_ENCODE_API_FUNCTION_LIST_VER };
    int baseToAlphaBitDistributionRatio = 15;
+   int surfaceAlignment = 16; // Input surfaces are padded to a multiple of this by edge replication
+   int retrievalSurfaces = 4; // Surfaces beyond the encoder's own delay, so upload and retrieval overlap
 } g_nv;
 
 struct MyFile
 {
-   std::ifstream inputVideo;
-   std::ofstream outputVideo;
+   int inputFrameCount = 0;     // Whole frames in the input video
+   int maskFrameCount = 0;      // Whole frames in the mask
+   bool maskIsSequence = false; // One mask per video frame rather than a single still mask
+   std::vector< int64_t > timeStamps; // Presentation time of every input frame from --timecodes, in TimeScale() ticks
 } g_file;
 
 struct MyNvBuffer
@@ -70,12 +97,194 @@ struct Args
 {
    std::string inputYuvFramesFilename;
    std::string maskFilename;
+   std::string outputFilename;                    // '-' for stdout
+   std::string timecodesFilename;
    int width = 0;
    int height = 0;
    int fpsNumerator = 0;
    int fpsDenominator = 0;
+   std::vector< std::string > renditions;
+   std::string scaleFilter = "area";
+   int threads = std::max( 1u, std::thread::hardware_concurrency() );
+   bool autoCrop = false;
+   std::vector< std::string > maskFilters;
+   std::string alphaTemporal;
+   int lookahead = 0;
+   std::string latency;
+   std::vector< int > bitrates;
+   std::vector< int > devices;
+   int chunks = 0;
+   int sessionLimit = 3;
+   std::string controlFilename;
+   int sceneCut = 0;
+   std::string container = "265";
+   int fragment = 0;
+   double segment = 0;                            // Seconds per rolling output file, 0 for one file
+   bool preallocate = false;
+   bool splitLayers = false;
+   bool index = false;
+   bool paramSets = false;
 }args;
 
+// New rate control for running sessions. Anything left negative is unchanged.
+struct RateControlChange
+{
+   int bitrate = -1;                              // kbit/s
+   int maxBitrate = -1;                           // kbit/s
+   int minQp = -1;
+   int maxQp = -1;
+   int alphaRatio = -1;                           // Base to alpha layer bit split as <ratio>:1
+};
+
+// Rate control changes read from the control file while encoding
+struct MyControl
+{
+   std::mutex mutex;
+   std::chrono::steady_clock::time_point lastPoll;
+   int generation = 0;                            // Counts the changes read so far
+   RateControlChange settings;                    // All of them merged, for sessions to catch up to
+} g_control;
+
+// stdout as it was before printing moved to stderr, while it carries the output stream
+int g_streamOutput = -1;
+
+// Clean-up applied to every mask frame as it is read, shared by all jobs
+MaskFilter g_maskFilter;
+
+// Page-locked host memory for fast transfers to the device
+struct PinnedBuffer
+{
+   PinnedBuffer( void * cudaContext, size_t size ) : _cudaContext(cudaContext)
+   {
+      CudaScope cs( (CUcontext)_cudaContext );
+      CUDA_CHECK( cuMemHostAlloc( (void **)&data, size, 0 ) );
+   }
+   ~PinnedBuffer()
+   {
+      CudaScope cs( (CUcontext)_cudaContext );
+      cuMemFreeHost( data );
+   }
+   PinnedBuffer( const PinnedBuffer & ) = delete;
+   PinnedBuffer & operator=( const PinnedBuffer & ) = delete;
+
+   uint8_t * data = nullptr;
+private:
+   void * _cudaContext = nullptr;
+};
+
+// Device memory holding one padded NV12 frame
+struct DeviceFrame
+{
+   void * cudaBuffer = nullptr;
+   size_t cudaPitch = 0;
+};
+
+// One frame in flight. It is uploaded once, then mapped by every session of its rendition,
+// and goes back to the pool after the last of them has retrieved its bitstream.
+struct EncodeSurface
+{
+   DeviceFrame input;
+   DeviceFrame alpha;                             // Only when the mask is a sequence
+   std::vector< MyNvBuffer > inputs;              // Per session registration and mapping of 'input'
+   std::vector< MyNvBuffer > alphas;              // Per session mapping of 'alpha', or of the still mask
+   std::vector< void * > outputBitstreams;        // Per session
+   std::atomic< int > outstanding{ 0 };           // Sessions yet to retrieve this frame
+   std::chrono::steady_clock::time_point captureTime; // When the frame was read
+   CUstream stream = nullptr;                     // Uploads, and the encodes that read them
+   CUevent uploaded = nullptr;                    // Recorded once the uploads are queued
+};
+
+// An encode session of a rendition with its own rate control and output file
+struct EncodeSession
+{
+   int bitrate = 0;                               // kbit/s, 0 keeps the preset's rate control
+   void * nvEncoder = nullptr;
+   NV_ENC_INITIALIZE_PARAMS initParams;           // As initialized, the base for any reconfigure
+   NV_ENC_CONFIG encodeConfig;                    // Current settings, pointed to by initParams
+   MyNvBuffer stillAlpha;                         // The rendition's still mask registered with this session
+   std::vector< uint8_t > sequenceParams;         // VPS/SPS/PPS of both layers, from the encoder once initialized
+   std::string outputFilename;
+   std::unique_ptr< AsyncFileWriter > output;     // Raw stream or container, written on its own thread
+   bool streaming = false;                        // The output is a pipe, read while it is written
+   std::unique_ptr< Mp4Writer > muxer;            // Writes the output as MP4 or MOV instead of raw HEVC
+   std::unique_ptr< AsyncFileWriter > baseOutput; // Base and alpha layers as their own streams, when split
+   std::unique_ptr< AsyncFileWriter > alphaOutput;
+   std::unique_ptr< LayerSplitter > splitter;
+   std::vector< AccessUnitInfo > accessUnits;     // Raw chunk output, muxed when the chunks are joined
+   std::vector< FrameIndexEntry > frameIndex;     // Every access unit written, for the index sidecar
+   std::deque< EncodeSurface * > pendingSurfaces; // Submitted, output not available yet
+   BlockingQueue< EncodeSurface * > encodedSurfaces; // Output available, waiting for the retrieval thread
+   std::thread retrieval;
+   int outputDelay = 0;                           // Frames the encoder holds before their output is available
+   int outputFrameCount = 0;
+   uint64_t outputBytes = 0;                      // Everything written, both layers
+   uint64_t alphaBytes = 0;                       // The alpha layer's share of it
+   std::vector< double > latencies;               // Milliseconds from each frame being read to its bitstream being written
+   std::vector< double > writeStalls;             // Milliseconds each frame waited for a free output buffer
+   std::chrono::steady_clock::time_point fragmentStart; // When the first frame of the current fragment was read
+   std::vector< double > fragmentLatencies;       // Milliseconds from each fragment's first frame being read to the fragment being written
+   std::unique_ptr< SegmentPlaylist > playlist;   // Finished segments, when the output rolls over to a new file every segment
+   int64_t segmentStart = 0;                      // Presentation time of the current segment's first frame
+   int64_t segmentEnd = 0;                        // And of the end of its last frame
+   std::string error;                             // First failure writing the output, other than a failed write, for the job to report
+};
+
+// One output size, all fed from the same source frame. Its sessions share every upload.
+struct Rendition
+{
+   Rect sourceRegion;                             // Part of the source picture encoded, in source pixels
+   Rect canvasRegion;                             // The same area in this rendition's full-size pixels
+   int canvasWidth = 0;                           // Requested output size, before any cropping
+   int canvasHeight = 0;
+   Nv12Geometry geometry;                         // Encoded picture
+   std::unique_ptr< Nv12Scaler > scaler;          // Null when the region is encoded at its source size
+   std::unique_ptr< PinnedBuffer > stagedFrame;   // Cropped or scaled frame, null when the source is uploaded as-is
+   std::unique_ptr< PinnedBuffer > stagedAlpha;   // NV12 alpha with neutral chroma
+   DeviceFrame stillAlpha;                        // A still mask, uploaded once
+   std::deque< EncodeSession > sessions;          // One per bitrate, never moved as each owns a running thread
+   std::deque< EncodeSurface > surfaces;          // Pool bounding the frames in flight
+   BlockingQueue< EncodeSurface * > freeSurfaces; // Retrieved by every session, still mapped
+   EncodeSurface * lastUploaded = nullptr;        // Latest upload from the staging buffers
+};
+
+// A GPU and the context shared by every job scheduled on it
+struct Device
+{
+   int index = 0;
+   std::string name;
+   void * cudaContext = nullptr;
+   int frameCount = 0;                            // Frames encoded here, for the throughput report
+   std::chrono::steady_clock::time_point start;   // First job started to last job finished
+   std::chrono::steady_clock::time_point end;
+};
+
+// An independently encoded run over a range of input frames. It owns its input streams and
+// an encode session per rendition on its device, so several jobs can run side by side.
+struct EncodeJob
+{
+   EncodeJob() = default;
+   EncodeJob( const EncodeJob & ) = delete;
+   EncodeJob & operator=( const EncodeJob & ) = delete;
+   ~EncodeJob();
+
+   int firstFrame = 0;
+   int frameCount = 0;
+   std::string outputSuffix;                      // Appended to every output filename
+   Device * device = nullptr;
+   void * cudaContext = nullptr;                  // The device's context
+   std::string error;                             // Why the job stopped, if it failed
+   std::ifstream inputVideo;
+   std::ifstream inputMask;
+   std::unique_ptr< PinnedBuffer > sourceFrame;
+   std::vector< uint8_t > mask;                   // Current source mask luma
+   TemporalAlphaFilter temporalFilter;            // Frame-to-frame stabilization of a mask sequence
+   SceneCutDetector sceneCuts;
+   std::vector< int > cuts;                       // Input frames found to start a shot, each encoded as an IDR
+   std::deque< Rendition > renditions;            // Never moved, each owns a running thread
+   int inputFrameCount = 0;
+   bool reused = false;                           // Ran on the sessions of an earlier request
+};
+
 auto CreateOutputFile( std::string filename )
 {
    filename = ExpandTilde( filename );
@@ -90,6 +299,61 @@ auto CreateOutputFile( std::string filename )
    
    return file;
 }
+auto CreateOutputWriter( std::string filename )
+{
+   // stdout was set aside for the one output when the encode started
+   if ( filename == "-" )
+   {
+      if ( g_streamOutput < 0 )
+         throw std::runtime_error( "Only one output can go to stdout" );
+      int fd = g_streamOutput;
+      g_streamOutput = -1;
+      return std::unique_ptr< AsyncFileWriter >( new AsyncFileWriter( fd ) );
+   }
+   return std::unique_ptr< AsyncFileWriter >( new AsyncFileWriter( ExpandTilde( filename ), args.preallocate ) );
+}
+// Adds to the name of a file, keeping its extension last
+std::string InsertBeforeExtension( std::string filename,
+   const std::string & suffix )
+{
+   size_t dot = filename.find_last_of( '.' );
+   size_t directory = filename.find_last_of( "/\\" );
+   if ( dot == std::string::npos || (directory != std::string::npos && dot < directory) )
+      dot = filename.size();
+   return filename.insert( dot, suffix );
+}
+// Name of one of an output's rolling segments, numbered from 0
+std::string SegmentFilename( const std::string & outputFilename,
+   size_t segment )
+{
+   char number[ 16 ];
+   snprintf( number, sizeof( number ), "_%05zu", segment );
+   return InsertBeforeExtension( outputFilename, number );
+}
+// Whether an output is written strictly in order, with no going back to patch it
+bool IsPipe( const std::string & filename )
+{
+#ifdef _WIN32
+   return filename == "-";
+#else
+   if ( filename == "-" )
+      return lseek( (g_streamOutput >= 0) ? g_streamOutput : STDOUT_FILENO, 0, SEEK_CUR ) < 0;
+   struct stat info;
+   return stat( ExpandTilde( filename ).c_str(), &info ) == 0 && (S_ISFIFO( info.st_mode ) || S_ISSOCK( info.st_mode ));
+#endif
+}
+
+// Parses "<width>x<height>"
+std::pair< int, int > ParseSize( const std::string & size )
+{
+   int width = 0, height = 0;
+   char separator = 0;
+   std::stringstream ss( size );
+   ss >> width >> separator >> height;
+   if ( ss.fail() || separator != 'x' || width <= 0 || height <= 0 )
+      throw std::runtime_error( "Invalid size, expected <width>x<height>: " + size );
+   return { width, height };
+}
 
 int GetCapabilityValue( void * encoder,
    GUID encoderGuid,
@@ -133,20 +397,114 @@ NV_ENC_INITIALIZE_PARAMS CreateInitParams( void * encoder,
    
    return returnValue;
 }
+// Ticks per second of every timestamp. Frames at a constant rate use the rate's own clock, so
+// each lasts exactly fpsDenominator ticks. Timecodes are kept on the 90 kHz MPEG clock.
+int TimeScale()
+{
+   return g_file.timeStamps.empty() ? args.fpsNumerator : 90000;
+}
+// How long a frame lasts at the nominal frame rate, in TimeScale() ticks
+uint32_t DefaultFrameDuration()
+{
+   if ( g_file.timeStamps.empty() )
+      return uint32_t(args.fpsDenominator);
+   return uint32_t(std::lround( 90000.0 * args.fpsDenominator / args.fpsNumerator ));
+}
+// When an input frame is shown, in TimeScale() ticks
+int64_t FrameTimeStamp( int frame )
+{
+   return g_file.timeStamps.empty() ? int64_t(frame) * args.fpsDenominator : g_file.timeStamps[ size_t(frame) ];
+}
+// How long an input frame is shown: until the next one, and the last as long as the one before it
+uint32_t FrameDuration( int frame )
+{
+   const auto & timeStamps = g_file.timeStamps;
+   if ( size_t(frame) + 1 < timeStamps.size() )
+      return uint32_t(timeStamps[ size_t(frame) + 1 ] - timeStamps[ size_t(frame) ]);
+   if ( frame > 0 && size_t(frame) < timeStamps.size() )
+      return uint32_t(timeStamps[ size_t(frame) ] - timeStamps[ size_t(frame) - 1 ]);
+   return DefaultFrameDuration();
+}
+// The longest any input frame is shown, in TimeScale() ticks
+uint32_t LongestFrameDuration()
+{
+   uint32_t returnValue = DefaultFrameDuration();
+   for ( size_t frame = 0; frame < g_file.timeStamps.size(); ++frame )
+      returnValue = std::max( returnValue, FrameDuration( int(frame) ) );
+   return returnValue;
+}
+// Length of a segment in TimeScale() ticks
+int64_t SegmentTicks()
+{
+   return std::max( int64_t(1), int64_t(std::llround( args.segment * TimeScale() )) );
+}
+// Which segment period a presentation time falls in, counted from the first frame
+int64_t SegmentOf( int64_t timeStamp )
+{
+   return (timeStamp - FrameTimeStamp( 0 )) / SegmentTicks();
+}
+// Frames in each fragment of fragmented output, at least one
+int FragmentFrames()
+{
+   return std::max( 1, int(std::lround( double(args.fragment) * args.fpsNumerator / (1000.0 * args.fpsDenominator) )) );
+}
 NV_ENC_CONFIG CreateInitParamsHevc( void * encoder,
    GUID encoderGuid,
-   GUID presetGuid )
+   GUID presetGuid,
+   int bitrate )
 {
-   // Start by populating from the preset 
+   // Start by populating from the preset, as tuned
    NV_ENC_PRESET_CONFIG presetConfig = { NV_ENC_PRESET_CONFIG_VER, { NV_ENC_CONFIG_VER } };
-   NVE_CHECK( (*g_nv.functions.nvEncGetEncodePresetConfig)( encoder,
+   NVE_CHECK( (*g_nv.functions.nvEncGetEncodePresetConfigEx)( encoder,
       encoderGuid,
       presetGuid,
+      g_nv.tuningInfo,
       &presetConfig ), "Failed retrieving default preset configuration" );
 
    // Anything set here will override the preset
    //presetConfig.presetCfg.rcParams = NV_ENC_PARAMS_RC_CBR;
    
+   if ( bitrate > 0 )
+   {
+      presetConfig.presetCfg.rcParams.rateControlMode = NV_ENC_PARAMS_RC_VBR;
+      presetConfig.presetCfg.rcParams.averageBitRate = uint32_t(bitrate) * 1000;
+      presetConfig.presetCfg.rcParams.maxBitRate = presetConfig.presetCfg.rcParams.averageBitRate * 3 / 2;
+   }
+
+   // Low latency: every frame is output as soon as it is encoded, and CBR with a VBV of one
+   // frame keeps each frame's size, and so its transmit time, close to the average
+   if ( !args.latency.empty() )
+   {
+      NV_ENC_RC_PARAMS & rcParams = presetConfig.presetCfg.rcParams;
+      if ( rcParams.averageBitRate == 0 )
+         throw std::runtime_error( "Low latency mode needs a --bitrate" );
+      presetConfig.presetCfg.frameIntervalP = 1;
+      rcParams.rateControlMode = NV_ENC_PARAMS_RC_CBR;
+      rcParams.maxBitRate = rcParams.averageBitRate;
+      rcParams.vbvBufferSize = uint32_t(uint64_t(rcParams.averageBitRate) * args.fpsDenominator / args.fpsNumerator);
+      rcParams.vbvInitialDelay = rcParams.vbvBufferSize;
+      rcParams.zeroReorderDelay = 1;
+      rcParams.enableLookahead = 0;
+   }
+
+   // Fragments can only start on an IDR, so there has to be one at least every fragment.
+   // Every IDR repeats the parameter sets so a fragment can be decoded on its own.
+   if ( args.fragment > 0 )
+   {
+      presetConfig.presetCfg.gopLength = uint32_t(FragmentFrames());
+      presetConfig.presetCfg.encodeCodecConfig.hevcConfig.idrPeriod = presetConfig.presetCfg.gopLength;
+      presetConfig.presetCfg.encodeCodecConfig.hevcConfig.repeatSPSPPS = 1;
+   }
+   // Segments are IDRs forced per frame, and each carries the parameter sets the same way
+   if ( args.segment > 0 )
+      presetConfig.presetCfg.encodeCodecConfig.hevcConfig.repeatSPSPPS = 1;
+
+   if ( args.lookahead > 0 )
+   {
+      presetConfig.presetCfg.rcParams.enableLookahead = 1;
+      presetConfig.presetCfg.rcParams.lookaheadDepth = uint16_t(args.lookahead);
+   }
+   
    if ( g_useAlpha )
    {
       presetConfig.presetCfg.encodeCodecConfig.hevcConfig.enableAlphaLayerEncoding = 1;
@@ -155,174 +513,310 @@ NV_ENC_CONFIG CreateInitParamsHevc( void * encoder,
 
    return presetConfig.presetCfg;
 }
-MyNvBuffer LockInputBuffer( void * encoder,
-   void * cudaContext,
-   int width,
-   int height )
+// Whole frames in a raw file
+int CountFrames( const std::string & filename,
+   const Nv12Geometry & geometry )
 {
-   MyNvBuffer returnValue;
-   void * cudaBuffer = nullptr;
-
-   // Manage file state
-   if ( g_file.inputVideo.eof() )
+   std::ifstream file( filename, std::ios::binary | std::ios::ate );
+   if ( !file.good() )
+      throw std::runtime_error( "Could not open " + filename );
+   return int(size_t(file.tellg()) / geometry.FileFrameSize());
+}
+// Reads a timecode file in the mkvmerge v2 format: one presentation time per frame in milliseconds,
+// in display order, after any '#' comment lines. Returned in 90 kHz ticks.
+std::vector< int64_t > ReadTimecodes( const std::string & filename )
+{
+   std::ifstream file( ExpandTilde( filename ) );
+   if ( !file.good() )
+      throw std::runtime_error( "Could not open " + filename );
+   std::vector< int64_t > returnValue;
+   std::string line;
+   while ( std::getline( file, line ) )
    {
-      // We reached the end of data last time we were here,
-      // so set to null and exit
-      returnValue.inputResource.mappedResource = nullptr;
-      return returnValue;
+      size_t start = line.find_first_not_of( " \t\r" );
+      if ( start == std::string::npos || line[ start ] == '#' )
+         continue;
+      double milliseconds = 0;
+      std::istringstream field( line.substr( start ) );
+      if ( !(field >> milliseconds) )
+         throw std::runtime_error( "Not a timecode in " + filename + ": " + line );
+      int64_t timeStamp = std::llround( milliseconds * 90 );
+      if ( !returnValue.empty() && timeStamp <= returnValue.back() )
+         throw std::runtime_error( "Timecodes must increase from frame to frame, " + line + " in " + filename + " does not" );
+      returnValue.push_back( timeStamp );
    }
-   else if ( !g_file.inputVideo.is_open() )
+   return returnValue;
+}
+// Reads the job's next source frame, returning false at the end of its range
+bool ReadInputFrame( EncodeJob & job,
+   const Nv12Geometry & geometry )
+{
+   if ( job.inputFrameCount >= job.frameCount )
+      return false;
+
+   // TODO: THIS ASSUMES NV12
+   return ReadNv12Frame( job.inputVideo, geometry, job.sourceFrame->data );
+}
+// Reads the luma plane of the next mask frame into 'mask', filtered and padded to the aligned size.
+// Chroma is skipped, only luma carries transparency. Returns false at the end of the file.
+bool ReadMaskFrame( std::istream & inputMask,
+   const Nv12Geometry & geometry,
+   uint8_t * mask )
+{
+   for ( int row = 0; row < geometry.height; ++row )
    {
-      // Must be the first time here, open and ensure our input video file is good
-      g_file.inputVideo.open( args.inputYuvFramesFilename );
-      if ( !g_file.inputVideo.good() )
-         throw std::runtime_error( "Could not load input video file" );
+      if ( !inputMask.read( (char *)mask + size_t(row) * geometry.Pitch(), geometry.width ) )
+         return false;
    }
+   inputMask.seekg( geometry.FileFrameSize() - size_t(geometry.width) * geometry.height, std::ios::cur );
+   if ( !g_maskFilter.Empty() )
+      g_maskFilter.Apply( mask, geometry.Pitch(), geometry.width, geometry.height, args.threads );
+   PadPlane( mask, geometry.Pitch(), geometry.width, geometry.height, geometry.alignedWidth, geometry.alignedHeight, 1 );
 
-   // TODO: THIS ASSUMES NV12
-   uint32_t byteHeight = height * 3 / 2;
+   return true;
+}
+// Opens the job's input streams at its first frame and reads the mask for that frame.
+// A mask sequence shorter than the video holds its last frame.
+void OpenInput( EncodeJob & job,
+   const Nv12Geometry & geometry )
+{
+   job.inputVideo.open( args.inputYuvFramesFilename, std::ios::binary );
+   if ( !job.inputVideo.good() )
+      throw std::runtime_error( "Could not load input video file" );
+   job.inputVideo.seekg( job.firstFrame * geometry.FileFrameSize() );
+
+   job.inputMask.open( args.maskFilename, std::ios::binary );
+   if ( !job.inputMask.good() )
+      throw std::runtime_error( "Could not load mask file" );
+   if ( g_file.maskIsSequence )
+      job.inputMask.seekg( std::min( job.firstFrame, g_file.maskFrameCount - 1 ) * geometry.FileFrameSize() );
+
+   job.mask.resize( geometry.LumaSize() );
+   if ( !ReadMaskFrame( job.inputMask, geometry, job.mask.data() ) )
+      throw std::runtime_error( "Mask file is smaller than one frame" );
+   job.temporalFilter = args.alphaTemporal.empty() ? TemporalAlphaFilter() : TemporalAlphaFilter( args.alphaTemporal );
+   job.sceneCuts = SceneCutDetector( args.sceneCut );
+   job.cuts.clear();
+}
+// First pass over the mask: the union of every frame's visible alpha, in source pixels
+AlphaBounds ScanMaskBounds( const Nv12Geometry & geometry )
+{
+   std::ifstream inputMask( args.maskFilename, std::ios::binary );
+   if ( !inputMask.good() )
+      throw std::runtime_error( "Could not load mask file" );
+
+   AlphaBounds returnValue;
+   std::vector< uint8_t > mask( geometry.LumaSize() );
+   while ( ReadMaskFrame( inputMask, geometry, mask.data() ) )
+      returnValue.Union( FindAlphaBounds( mask.data(), geometry.Pitch(), geometry.width, geometry.height ) );
+
+   return returnValue;
+}
+// First pass over the video: every frame that starts a new shot
+std::vector< int > ScanSceneCuts( const Nv12Geometry & geometry )
+{
+   std::ifstream inputVideo( args.inputYuvFramesFilename, std::ios::binary );
+   if ( !inputVideo.good() )
+      throw std::runtime_error( "Could not load input video file" );
 
-   // Create a device buffer first so we have pitch
-   size_t cudaPitch;
+   std::vector< int > returnValue;
+   SceneCutDetector detector( args.sceneCut );
+   std::vector< uint8_t > luma( size_t(geometry.width) * geometry.height );
+   for ( int frame = 0; inputVideo.read( (char *)luma.data(), luma.size() ); ++frame )
    {
-      CudaScope cs( (CUcontext)cudaContext );
+      if ( detector.IsCut( luma.data(), geometry.width, geometry.width, geometry.height ) )
+         returnValue.push_back( frame );
+      inputVideo.seekg( geometry.FileFrameSize() - luma.size(), std::ios::cur );
+   }
+   return returnValue;
+}
+// Grows 'region' around its center to at least the minimum size and keeps it inside the
+// limits, with an even origin and size so chroma stays aligned
+Rect FitRegion( Rect region,
+   int minWidth,
+   int minHeight,
+   int limitWidth,
+   int limitHeight )
+{
+   auto fit = []( int & origin, int & size, int minSize, int limit )
+   {
+      int end = AlignUp( origin + size, 2 );
+      origin &= ~1;
+      int grow = std::max( 0, AlignUp( minSize, 2 ) - (end - origin) );
+      origin -= (grow / 2) & ~1;
+      end += grow - ((grow / 2) & ~1);
+      if ( origin < 0 )
+      {
+         end -= origin;
+         origin = 0;
+      }
+      if ( end > limit )
+      {
+         origin = std::max( 0, (origin - (end - limit)) & ~1 );
+         end = limit;
+      }
+      size = end - origin;
+   };
+   fit( region.x, region.width, minWidth, limitWidth );
+   fit( region.y, region.height, minHeight, limitHeight );
+   return region;
+}
+// Produces a rendition's NV12 picture from its source region: scaled or copied, then padded
+void StageFrame( const Rendition & rendition,
+   const Nv12Geometry & sourceGeometry,
+   const uint8_t * source,
+   uint8_t * staged )
+{
+   const Rect & region = rendition.sourceRegion;
+   const Nv12Geometry & geometry = rendition.geometry;
+   const uint8_t * sourceLuma = source + size_t(region.y) * sourceGeometry.Pitch() + region.x;
+   const uint8_t * sourceChroma = source + sourceGeometry.LumaSize() + size_t(region.y / 2) * sourceGeometry.Pitch() + region.x;
+   uint8_t * stagedChroma = staged + geometry.LumaSize();
 
-      CUDA_CHECK( cuMemAllocPitch( (CUdeviceptr *)&cudaBuffer,
-         &cudaPitch,
-         width,
-         byteHeight,
-         8 ) );   
+   if ( rendition.scaler )
+   {
+      rendition.scaler->Scale( sourceLuma, sourceChroma, sourceGeometry.Pitch(),
+         staged, stagedChroma, geometry.Pitch(),
+         args.threads );
+   }
+   else
+   {
+      CopyPlane( sourceLuma, sourceGeometry.Pitch(), staged, geometry.Pitch(), geometry.encodeWidth, geometry.encodeHeight );
+      CopyPlane( sourceChroma, sourceGeometry.Pitch(), stagedChroma, geometry.Pitch(), geometry.encodeWidth, geometry.encodeHeight / 2 );
+   }
+   PadNv12Frame( staged, geometry );
+}
+// Same as StageFrame() for the luma plane of the mask
+void StageMask( const Rendition & rendition,
+   const Nv12Geometry & sourceGeometry,
+   const uint8_t * sourceMask,
+   uint8_t * staged )
+{
+   const Rect & region = rendition.sourceRegion;
+   const Nv12Geometry & geometry = rendition.geometry;
+   sourceMask += size_t(region.y) * sourceGeometry.Pitch() + region.x;
 
-      // Create a pinned host buffer with proper alignment for CUDA   
-      char * tempBuffer = nullptr;
-      CUDA_CHECK( cuMemHostAlloc( (void **)&tempBuffer, byteHeight * cudaPitch, 0 ) );
+   if ( rendition.scaler )
+      rendition.scaler->ScaleLuma( sourceMask, sourceGeometry.Pitch(), staged, geometry.Pitch(), args.threads );
+   else
+      CopyPlane( sourceMask, sourceGeometry.Pitch(), staged, geometry.Pitch(), geometry.encodeWidth, geometry.encodeHeight );
+   PadPlane( staged, geometry.Pitch(), geometry.width, geometry.height, geometry.alignedWidth, geometry.alignedHeight, 1 );
+}
+// Lists the frames that start a shot, one per line, for splitting or seeking the output
+void WriteCutsSidecar( const std::vector< int > & cuts,
+   const std::string & outputFilename )
+{
+   std::ofstream sidecar = CreateOutputFile( outputFilename + ".cuts" );
+   for ( int frame : cuts )
+      sidecar << frame << "\n";
+}
+// Records where a cropped picture sits on its full-size canvas
+void WriteCropSidecar( const Rendition & rendition,
+   const std::string & outputFilename )
+{
+   std::ofstream sidecar = CreateOutputFile( outputFilename + ".crop" );
+   sidecar << "x=" << rendition.canvasRegion.x << "\n"
+      << "y=" << rendition.canvasRegion.y << "\n"
+      << "width=" << rendition.geometry.width << "\n"
+      << "height=" << rendition.geometry.height << "\n"
+      << "canvasWidth=" << rendition.canvasWidth << "\n"
+      << "canvasHeight=" << rendition.canvasHeight << "\n";
+}
+// The parameter sets of both layers as Annex-B, what a decoder or muxer needs before the first frame
+void WriteParamsSidecar( const std::vector< uint8_t > & sequenceParams,
+   const std::string & outputFilename )
+{
+   std::ofstream sidecar( ExpandTilde( outputFilename + ".params" ), std::ios::binary );
+   sidecar.write( (const char *)sequenceParams.data(), std::streamsize(sequenceParams.size()) );
+   if ( !sidecar.good() )
+      throw std::runtime_error( "Failed writing " + outputFilename + ".params" );
+}
+// Allocates device memory for one frame at the padded size
+DeviceFrame AllocateDeviceFrame( void * cudaContext,
+   const Nv12Geometry & geometry )
+{
+   DeviceFrame returnValue;
 
-      // Read the next frame from disk to our temp buffer
-      for( int row = 0; row < byteHeight; ++row )
-         g_file.inputVideo.read( tempBuffer + (row * cudaPitch), width );
+   // The surface holds the whole padded frame, the encoder crops to the picture
+   // TODO: THIS ASSUMES NV12
+   CudaScope cs( (CUcontext)cudaContext );
+   CUDA_CHECK( cuMemAllocPitch( (CUdeviceptr *)&returnValue.cudaBuffer,
+      &returnValue.cudaPitch,
+      geometry.alignedWidth,
+      geometry.alignedHeight * 3 / 2,
+      8 ) );   
 
-      // Transport from pinned host buffer to device buffer
-      CUDA_CHECK( cuMemcpyHtoD( (CUdeviceptr)cudaBuffer, tempBuffer, byteHeight * cudaPitch ) );
+   return returnValue;
+}
+void FreeDeviceFrame( void * cudaContext,
+   DeviceFrame & deviceFrame )
+{
+   if ( deviceFrame.cudaBuffer == nullptr )
+      return;
 
-      // Delete our temp buffer
-      cuMemFreeHost( tempBuffer );
+   CudaScope cs( (CUcontext)cudaContext );
+   CUDA_CHECK( cuMemFree( (CUdeviceptr)deviceFrame.cudaBuffer ) );
+   deviceFrame.cudaBuffer = nullptr;
+}
+// Transports a staged frame from pinned host memory to the pitched device buffer. With a stream the
+// copy is only queued and 'frame' must not change until it is done, otherwise this waits for it.
+// The device's context must be current.
+void UploadFrame( const Nv12Geometry & geometry,
+   const uint8_t * frame,
+   const DeviceFrame & deviceFrame,
+   CUstream stream )
+{
+   CUDA_MEMCPY2D copy = {};
+   copy.srcMemoryType = CU_MEMORYTYPE_HOST;
+   copy.srcHost = frame;
+   copy.srcPitch = geometry.Pitch();
+   copy.dstMemoryType = CU_MEMORYTYPE_DEVICE;
+   copy.dstDevice = (CUdeviceptr)deviceFrame.cudaBuffer;
+   copy.dstPitch = deviceFrame.cudaPitch;
+   copy.WidthInBytes = geometry.alignedWidth;
+   copy.Height = geometry.alignedHeight * 3 / 2;
+   if ( stream )
+   {
+      CUDA_CHECK( cuMemcpy2DAsync( &copy, stream ) );
    }
-   
-   // Register the CUDA buffer with the encode session
+   else
+   {
+      CUDA_CHECK( cuMemcpy2D( &copy ) );
+   }
+}
+// Registers device memory with an encode session. Any number of sessions can register the same frame.
+MyNvBuffer RegisterInputBuffer( void * encoder,
+   const Nv12Geometry & geometry,
+   const DeviceFrame & deviceFrame )
+{
+   MyNvBuffer returnValue = {};
    returnValue.registerResource = {
       NV_ENC_REGISTER_RESOURCE_VER,
       NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR,
-      uint32_t(width),
-      uint32_t(height),
-      uint32_t(cudaPitch),
+      uint32_t(geometry.alignedWidth),
+      uint32_t(geometry.alignedHeight),
+      uint32_t(deviceFrame.cudaPitch),
       0,
-      cudaBuffer,
+      deviceFrame.cudaBuffer,
       nullptr, // This will be populated after the call to NvEncRegisterResource()
       g_nv.inputFormat,
       NV_ENC_INPUT_IMAGE
    };
    NVE_CHECK( (*g_nv.functions.nvEncRegisterResource)( encoder, &returnValue.registerResource ), "Failed registering CUDA buffer with encode session" );
    
-   // Map as an input buffer
-   returnValue.inputResource = {
-      NV_ENC_MAP_INPUT_RESOURCE_VER,
-      0, 0, // Deprecated
-      returnValue.registerResource.registeredResource,
-      nullptr, NV_ENC_BUFFER_FORMAT_UNDEFINED // These will be populated after the call to NvEncMapInputResource()
-   };
-   NVE_CHECK( (*g_nv.functions.nvEncMapInputResource)( encoder, &returnValue.inputResource ), "Failed mapping CUDA buffer as encoder input" );
-   
    return returnValue;
 }
-MyNvBuffer LockAlphaBuffer( void * encoder,
-   void * cudaContext,
-   const MyNvBuffer & inputBuffer )
+// Maps a registered buffer as encoder input
+void LockInputBuffer( void * encoder,
+   MyNvBuffer & inputBuffer )
 {
-   if ( !g_useAlpha )
-   {
-      MyNvBuffer emptyReturn = {};
-      return emptyReturn;
-   }
-
-   // We're using an image for a mask, so only do this once
-   static std::shared_ptr< MyNvBuffer > returnValue = nullptr;
-   if ( returnValue == nullptr )
-   {
-      void * cudaBuffer = nullptr;
-      std::shared_ptr< MyNvBuffer > newBuffer = std::make_shared< MyNvBuffer >();
-
-      // Open the maks file
-      // Must be the first time here, open and ensure our input video file is good
-      std::ifstream inputMask( args.maskFilename );
-      if ( !inputMask.good() )
-         throw std::runtime_error( "Could not load mask file" );
-   
-      // TODO: THIS ASSUMES NV12
-      uint32_t byteHeight = inputBuffer.registerResource.height * 3 / 2;
-
-      size_t cudaPitch;
-      {
-         CudaScope cs( (CUcontext)cudaContext );
-
-         // Create a device buffer first so we have pitch
-         CUDA_CHECK( cuMemAllocPitch( (CUdeviceptr *)&cudaBuffer,
-            &cudaPitch,
-            inputBuffer.registerResource.width,
-            byteHeight,
-            8 ) );   
-
-         // Create a pinned host buffer with proper alignment for CUDA   
-         char * tempBuffer = nullptr;
-         CUDA_CHECK( cuMemHostAlloc( (void **)&tempBuffer, byteHeight * cudaPitch, 0 ) );
-
-         // Read the frame from disk to our temp buffer
-         for( int row = 0; row < byteHeight; ++row )
-            inputMask.read( tempBuffer + (row * cudaPitch), inputBuffer.registerResource.width );
-
-         // Memset chroma to 0x80 per the docs
-         memset( tempBuffer + (inputBuffer.registerResource.height * cudaPitch),
-            0x80,
-            inputBuffer.registerResource.height * cudaPitch / 2 );
-
-         // Transport from pinned host buffer to device buffer
-         CUDA_CHECK( cuMemcpyHtoD( (CUdeviceptr)cudaBuffer,
-            tempBuffer,
-            byteHeight * cudaPitch ) );
-
-         // Delete our temp buffer
-         cuMemFreeHost( tempBuffer );
-
-         // Register the CUDA buffer with the encode session
-         newBuffer->registerResource = {
-            NV_ENC_REGISTER_RESOURCE_VER,
-            NV_ENC_INPUT_RESOURCE_TYPE_CUDADEVICEPTR,
-            uint32_t(inputBuffer.registerResource.width),
-            uint32_t(inputBuffer.registerResource.height),
-            uint32_t(cudaPitch),
-            0,
-            cudaBuffer, // resourceToRegister field
-            nullptr, // This will be populated after the call to NvEncRegisterResource()
-            g_nv.inputFormat,
-            NV_ENC_INPUT_IMAGE,
-            0
-         };
-         NVE_CHECK( (*g_nv.functions.nvEncRegisterResource)( encoder, &newBuffer->registerResource ), "Failed registering CUDA buffer with encode session" );
-         
-         returnValue = newBuffer;
-      }
-   }
-   
-   // Map as an input buffer
-   returnValue->inputResource = {
+   inputBuffer.inputResource = {
       NV_ENC_MAP_INPUT_RESOURCE_VER,
       0, 0, // Deprecated
-      returnValue->registerResource.registeredResource,
-      nullptr, NV_ENC_BUFFER_FORMAT_UNDEFINED, // These will be populated after the call to NvEncMapInputResource()
-      0
+      inputBuffer.registerResource.registeredResource,
+      nullptr, NV_ENC_BUFFER_FORMAT_UNDEFINED // These will be populated after the call to NvEncMapInputResource()
    };
-   NVE_CHECK( (*g_nv.functions.nvEncMapInputResource)( encoder, &returnValue->inputResource ), "Failed mapping CUDA buffer as encoder input" );
-   
-   return *returnValue;
+   NVE_CHECK( (*g_nv.functions.nvEncMapInputResource)( encoder, &inputBuffer.inputResource ), "Failed mapping CUDA buffer as encoder input" );
 }
 void * LockOutputBuffer( void * encoder,
    const MyNvBuffer & inputBuffer,
@@ -375,130 +869,368 @@ void * LockOutputBuffer( void * encoder,
    return returnValue;
 }
 void UnlockInputBuffer( void * encoder,
-   void * cudaContext,
    MyNvBuffer & inputBuffer )
 {
-   // Completely destroy the input
-   NVE_CHECK( (*g_nv.functions.nvEncUnmapInputResource)( encoder, inputBuffer.inputResource.mappedResource ), "Failed unmapping input buffer" );
-   NVE_CHECK( (*g_nv.functions.nvEncUnregisterResource)( encoder, inputBuffer.registerResource.registeredResource ), "Failed unmapping input buffer" );
+   // Unmap only, the registration is kept for the next frame
+   if ( inputBuffer.inputResource.mappedResource != nullptr )
    {
-      CudaScope cs( (CUcontext)cudaContext );
-      CUDA_CHECK( cuMemFree( (CUdeviceptr)inputBuffer.registerResource.resourceToRegister ) );
+      NVE_CHECK( (*g_nv.functions.nvEncUnmapInputResource)( encoder, inputBuffer.inputResource.mappedResource ), "Failed unmapping input buffer" );
+      inputBuffer.inputResource.mappedResource = nullptr;
    }
 }
-void UnlockAlphaBuffer( void * encoder,
-   void * cudaContext,
-   MyNvBuffer & alphaBuffer )
+void UnregisterInputBuffer( void * encoder,
+   MyNvBuffer & inputBuffer )
 {
-   if ( alphaBuffer.inputResource.mappedResource != nullptr )
-   {
-      // Unmap the alpha, but don't delete it
-      NVE_CHECK( (*g_nv.functions.nvEncUnmapInputResource)( encoder, alphaBuffer.inputResource.mappedResource ), "Failed unmapping alpha buffer" );
-   }
+   if ( inputBuffer.registerResource.registeredResource == nullptr )
+      return;
+
+   NVE_CHECK( (*g_nv.functions.nvEncUnregisterResource)( encoder, inputBuffer.registerResource.registeredResource ), "Failed unregistering input buffer" );
+   inputBuffer.registerResource.registeredResource = nullptr;
 }
 void UnlockOutputBuffer( void * encoder, void * outputBuffer )
 {
    NVE_CHECK( (*g_nv.functions.nvEncDestroyBitstreamBuffer)( encoder, outputBuffer ), "Failed to destroy bitstream buffer" );
 }
-int main( int argc, char *argv[] )
+// Fills a rendition's pool. Each surface is registered with every session and has a bitstream per session.
+void CreateSurfaces( Rendition & rendition,
+   void * cudaContext )
 {
-   // Process command-line arguments
-   CLI::App app{ "App description" };
-   
-   app.add_option( "--yuvFrames", args.inputYuvFramesFilename, "Monolithic input file containing a sequence of YUV 4:2:0 frames\n" )->required();
-   app.add_option( "--mask", args.maskFilename, "Single frame YUV image representing transparency mask, data only (no BMP, etc). Dimensions MUST match input YUV frames\n" )->required();
-   app.add_option( "--width", args.width, "Width of the input YUV frames and mask\n" )->required();
-   app.add_option( "--height", args.height, "Height of the input YUV frames and mask\n" )->required();
-   app.add_option( "--fpsn", args.fpsNumerator, "Frame rate numerator\n" )->required();
-   app.add_option( "--fpsd", args.fpsDenominator, "Frame rate denominator\n" )->required();
-   
-   try
+   // Enough to fill the deepest encoder delay with one frame going in, plus some for the retrieval threads
+   int outputDelay = 0;
+   for ( const auto & session : rendition.sessions )
+      outputDelay = std::max( outputDelay, session.outputDelay );
+
+   for ( int i = 0; i < outputDelay + 1 + g_nv.retrievalSurfaces; ++i )
    {
-      app.parse(argc, argv);
+      rendition.surfaces.emplace_back();
+      EncodeSurface & surface = rendition.surfaces.back();
+      {
+         CudaScope cs( (CUcontext)cudaContext );
+         CUDA_CHECK( cuStreamCreate( &surface.stream, CU_STREAM_NON_BLOCKING ) );
+         CUDA_CHECK( cuEventCreate( &surface.uploaded, CU_EVENT_DISABLE_TIMING ) );
+      }
+      surface.input = AllocateDeviceFrame( cudaContext, rendition.geometry );
+      if ( g_useAlpha && g_file.maskIsSequence )
+         surface.alpha = AllocateDeviceFrame( cudaContext, rendition.geometry );
+      for ( auto & session : rendition.sessions )
+      {
+         surface.inputs.push_back( RegisterInputBuffer( session.nvEncoder, rendition.geometry, surface.input ) );
+         surface.alphas.push_back( (g_useAlpha && g_file.maskIsSequence) ? RegisterInputBuffer( session.nvEncoder, rendition.geometry, surface.alpha ) : session.stillAlpha );
+         surface.outputBitstreams.push_back( LockOutputBuffer( session.nvEncoder, surface.inputs.back(), g_nv.externalAlloc ) );
+      }
+      rendition.freeSurfaces.Push( &surface );
    }
-   catch( const CLI::ParseError &e )
+}
+// Unmaps a surface every session has finished with so it can take the next frame
+void ReleaseSurface( Rendition & rendition,
+   EncodeSurface & surface )
+{
+   for ( size_t i = 0; i < surface.inputs.size(); ++i )
    {
-      std::cout << e.what() << "\n";
-      std::cout << app.help();
-      return 1;
+      UnlockInputBuffer( rendition.sessions[ i ].nvEncoder, surface.inputs[ i ] );
+      if ( i < surface.alphas.size() ) // Registration can fail between a session's input and alpha
+         UnlockInputBuffer( rendition.sessions[ i ].nvEncoder, surface.alphas[ i ] );
    }
-   
-   struct RAII
+}
+// Called once per session that is done with a surface, the last one returns it to the pool
+void ReturnSurface( Rendition & rendition,
+   EncodeSurface & surface )
+{
+   if ( --surface.outstanding == 0 )
+      rendition.freeSurfaces.Push( &surface );
+}
+void DestroySurfaces( Rendition & rendition,
+   void * cudaContext )
+{
+   for ( auto & surface : rendition.surfaces )
    {
-      ~RAII()
+      ReleaseSurface( rendition, surface );
+      for ( size_t i = 0; i < surface.inputs.size(); ++i )
       {
-         if ( nvEncoder )
-         {
-            (*g_nv.functions.nvEncDestroyEncoder)( nvEncoder );
-            nvEncoder = nullptr;
-         }
-         if ( cudaContext )
-         {
-            cuCtxDestroy( (CUcontext)cudaContext );
-            cudaContext = nullptr;
-         }
+         void * encoder = rendition.sessions[ i ].nvEncoder;
+         UnregisterInputBuffer( encoder, surface.inputs[ i ] );
+         if ( surface.alpha.cudaBuffer && i < surface.alphas.size() )
+            UnregisterInputBuffer( encoder, surface.alphas[ i ] );
+         if ( i < surface.outputBitstreams.size() )
+            UnlockOutputBuffer( encoder, surface.outputBitstreams[ i ] );
       }
-      
-      void * nvEncoder = nullptr;
-      void * cudaContext = nullptr;
-   } raii;
-   
-   try
-   {
-      // Ensure we don't have critical version mismatch
-      uint32_t version = 0;
-      uint32_t currentVersion = (NVENCAPI_MAJOR_VERSION << 4) | NVENCAPI_MINOR_VERSION;
-      NVE_CHECK( NvEncodeAPIGetMaxSupportedVersion( &version ), "Failed retrieving driver version" );
-      if ( currentVersion > version )
-         ThrowNveErorr( NV_ENC_ERR_INVALID_VERSION, "Current driver version does not support this NvEncodeAPI version, please upgrade driver" );
+      FreeDeviceFrame( cudaContext, surface.input );
+      FreeDeviceFrame( cudaContext, surface.alpha );
 
-      // Get the functions as they are not explicitely dynamic in the shared objectc
-      NVE_CHECK( NvEncodeAPICreateInstance( &g_nv.functions ), "Failed getting NVidia encode functions" );
-      
-      // Retain the primary CUDA context
-      CUDA_CHECK( cuInit( 0 ) );
-      CUdevice cudaDevice;
-      CUDA_CHECK( cuDeviceGet( &cudaDevice, g_nv.cudaDeviceIndex ) );
-      CUDA_CHECK( cuCtxCreate( (CUcontext *)&raii.cudaContext, 0, cudaDevice ) );
-
-      // Initialize the encoder
-      NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS sessionParams = { NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS_VER,
-         NV_ENC_DEVICE_TYPE_CUDA,
-         raii.cudaContext,
-         0,
-         NVENCAPI_VERSION,
-         0,
-         0
-      };
-      NVE_CHECK( (*g_nv.functions.nvEncOpenEncodeSessionEx)( &sessionParams,
-         &raii.nvEncoder), "Failed initializing NVidia encode session" );
+      CudaScope cs( (CUcontext)cudaContext );
+      if ( surface.uploaded )
+         cuEventDestroy( surface.uploaded );
+      if ( surface.stream )
+         cuStreamDestroy( surface.stream );
+   }
+   rendition.surfaces.clear();
+   rendition.lastUploaded = nullptr;
 
-      // Ensure we have support for the desired encoder
-      uint32_t numEncoderGuids = 0;
-      bool hasHevcSupport = false;
-      NVE_CHECK( (*g_nv.functions.nvEncGetEncodeGUIDCount)( raii.nvEncoder, &numEncoderGuids ), "Failed getting NVidia encode GUID count" );
-      std::vector< GUID > guids( numEncoderGuids );
-      NVE_CHECK( (*g_nv.functions.nvEncGetEncodeGUIDs)( raii.nvEncoder,
-         guids.data(),
-         numEncoderGuids,
-         &numEncoderGuids ), "Failed getting NVidia encode GUIDs" );
-      for ( GUID guid : guids )
+   for ( auto & session : rendition.sessions )
+   {
+      if ( session.nvEncoder )
+         UnregisterInputBuffer( session.nvEncoder, session.stillAlpha );
+   }
+   FreeDeviceFrame( cudaContext, rendition.stillAlpha );
+}
+// Time the session's output writes waited for a free buffer
+double WriteStallMilliseconds( const EncodeSession & session )
+{
+   double returnValue = 0;
+   for ( const auto * output : { session.output.get(), session.baseOutput.get(), session.alphaOutput.get() } )
+      returnValue += output ? output->StallMilliseconds() : 0;
+   return returnValue;
+}
+// Whether any of the session's outputs can no longer be written
+bool OutputFailed( const EncodeSession & session )
+{
+   for ( const auto * output : { session.output.get(), session.baseOutput.get(), session.alphaOutput.get() } )
+   {
+      if ( output && output->Failed() )
+         return true;
+   }
+   return false;
+}
+// Finishes a session's output files, throwing if any write failed
+void CloseOutputs( EncodeSession & session )
+{
+   if ( session.muxer )
+   {
+      session.muxer->Finish();
+      if ( args.fragment > 0 && session.outputFrameCount > 0 )
+         session.fragmentLatencies.push_back( std::chrono::duration< double, std::milli >( std::chrono::steady_clock::now() - session.fragmentStart ).count() );
+   }
+   for ( auto * output : { session.output.get(), session.baseOutput.get(), session.alphaOutput.get() } )
+   {
+      if ( output )
+         output->Close();
+   }
+}
+// Drops a session's outputs. Any still open are closed without reporting errors.
+void ReleaseOutputs( EncodeSession & session )
+{
+   session.splitter = nullptr;
+   session.muxer = nullptr;
+   session.output = nullptr;
+   session.baseOutput = nullptr;
+   session.alphaOutput = nullptr;
+}
+// Writes a session's stream to 'output', through a muxer unless it is raw HEVC.
+// Chunk parts stay raw HEVC whatever the container, they are muxed when joined.
+void AttachOutput( const Rendition & rendition,
+   EncodeSession & session,
+   std::unique_ptr< AsyncFileWriter > output,
+   bool part )
+{
+   session.output = std::move( output );
+   if ( args.container != "265" && !part )
+   {
+      session.muxer.reset( new Mp4Writer( *session.output, rendition.geometry.width, rendition.geometry.height,
+         TimeScale(), int(DefaultFrameDuration()), args.container == "mov", (args.fragment > 0) ? FragmentFrames() : 0 ) );
+      session.muxer->SetParameterSets( session.sequenceParams.data(), session.sequenceParams.size() );
+   }
+}
+// Lists the segment being written as finished
+void ListSegment( EncodeSession & session )
+{
+   std::string filename = SegmentFilename( session.outputFilename, session.playlist->Size() );
+   session.playlist->Add( filename.substr( filename.find_last_of( "/\\" ) + 1 ), double(session.segmentEnd - session.segmentStart) / TimeScale() );
+}
+// Finishes the current segment and carries on in the next file from the IDR at 'start'.
+// Every IDR repeats the parameter sets, so each segment decodes on its own.
+void NextSegment( const Rendition & rendition,
+   EncodeSession & session,
+   int64_t start )
+{
+   auto output = CreateOutputWriter( SegmentFilename( session.outputFilename, session.playlist->Size() + 1 ) );
+   CloseOutputs( session );
+   ReleaseOutputs( session );
+   ListSegment( session );
+   AttachOutput( rendition, session, std::move( output ), false );
+   session.segmentStart = start;
+   session.segmentEnd = start;
+}
+// Retrieval thread of one session: locks finished bitstreams in encode order and writes them out.
+// nvEncLockBitstream blocks until the GPU is done, which is why this is kept off the thread
+// that uploads and submits frames.
+void RetrieveBitstreams( Rendition & rendition,
+   size_t sessionIndex )
+{
+   EncodeSession & session = rendition.sessions[ sessionIndex ];
+   EncodeSurface * surface = nullptr;
+   while ( session.encodedSurfaces.Pop( surface ) )
+   {
+      try
       {
-         if ( memcmp( &guid, &g_nv.encoderGuid, sizeof(guid) ) == 0 )
+         // Lock output buffer, copy it out for the writer thread, unlock
+         NV_ENC_LOCK_BITSTREAM outBitstream = { NV_ENC_LOCK_BITSTREAM_VER }; outBitstream.outputBitstream = surface->outputBitstreams[ sessionIndex ];
+         NVE_CHECK( (*g_nv.functions.nvEncLockBitstream)( session.nvEncoder, &outBitstream ), "Failed locking the output bitstream" );
+         double stalled = WriteStallMilliseconds( session );
+         // A write fails for good when the disk fills or a pipe's reader goes away. The bitstream
+         // is still unlocked, and the failure is reported once, when the output is closed. Any
+         // other failure is kept for the job to report.
+         try
          {
-            hasHevcSupport = true;
-            break;
+            // A segment ends at the first IDR of the next segment period, scene cuts don't end one
+            int64_t timeStamp = int64_t(outBitstream.outputTimeStamp);
+            if ( session.playlist )
+            {
+               if ( outBitstream.pictureType == NV_ENC_PIC_TYPE_IDR && session.segmentEnd > session.segmentStart
+                  && SegmentOf( timeStamp ) > SegmentOf( session.segmentStart ) )
+                  NextSegment( rendition, session, timeStamp );
+               session.segmentEnd = std::max( session.segmentEnd, timeStamp + int64_t(outBitstream.outputDuration) );
+            }
+            if ( session.muxer )
+            {
+               bool fragmentWritten = session.muxer->WriteSample( (const uint8_t *)outBitstream.bitstreamBufferPtr, outBitstream.bitstreamSizeInBytes,
+                  int64_t(outBitstream.outputTimeStamp), uint32_t(outBitstream.outputDuration) );
+               auto now = std::chrono::steady_clock::now();
+               if ( fragmentWritten )
+                  session.fragmentLatencies.push_back( std::chrono::duration< double, std::milli >( now - session.fragmentStart ).count() );
+               if ( fragmentWritten || session.outputFrameCount == 0 )
+                  session.fragmentStart = surface->captureTime;
+            }
+            else
+            {
+               if ( args.index )
+                  session.frameIndex.push_back( { session.output->Position(), outBitstream.outputTimeStamp, outBitstream.bitstreamSizeInBytes,
+                     outBitstream.alphaLayerSizeInBytes, outBitstream.frameIdx, uint32_t(outBitstream.pictureType) } );
+               session.output->Write( outBitstream.bitstreamBufferPtr, outBitstream.bitstreamSizeInBytes );
+               if ( session.streaming )
+                  session.output->Flush();        // The reader gets each frame as soon as it is encoded
+               if ( args.container != "265" )
+                  session.accessUnits.push_back( { outBitstream.bitstreamSizeInBytes, int64_t(outBitstream.outputTimeStamp), uint32_t(outBitstream.outputDuration) } );
+            }
+            if ( session.splitter )
+               session.splitter->Write( (const uint8_t *)outBitstream.bitstreamBufferPtr, outBitstream.bitstreamSizeInBytes );
          }
+         catch ( const std::runtime_error & e )
+         {
+            if ( !OutputFailed( session ) && session.error.empty() )
+               session.error = e.what();
+         }
+         session.outputBytes += outBitstream.bitstreamSizeInBytes;
+         session.alphaBytes += outBitstream.alphaLayerSizeInBytes;
+         NVE_CHECK( (*g_nv.functions.nvEncUnlockBitstream)( session.nvEncoder, outBitstream.outputBitstream ), "Failed unlocking the output bitstream" );
+         session.writeStalls.push_back( WriteStallMilliseconds( session ) - stalled );
+         ++session.outputFrameCount;
+         session.latencies.push_back( std::chrono::duration< double, std::milli >( std::chrono::steady_clock::now() - surface->captureTime ).count() );
       }
-      if ( !hasHevcSupport )
-         throw std::runtime_error( "NVidia hardware does not support HEVC" );
+      catch ( const std::runtime_error & e )
+      {
+         std::cout << e.what() << std::endl;
+      }
+
+      // Inputs are unmapped by the submitting thread when it reuses the surface
+      ReturnSurface( rendition, *surface );
+   }
+}
+// Passes the oldest submitted frames to the retrieval thread, leaving 'keep' with the encoder
+void HandOffEncoded( EncodeSession & session,
+   int keep )
+{
+   while ( int(session.pendingSurfaces.size()) > keep )
+   {
+      session.encodedSurfaces.Push( session.pendingSurfaces.front() );
+      session.pendingSurfaces.pop_front();
+   }
+}
+// Signals end of stream so the encoder finishes everything it holds, and retrieves all of it
+void FlushEncoder( EncodeSession & session )
+{
+   NV_ENC_PIC_PARAMS picParams = { NV_ENC_PIC_PARAMS_VER };
+   picParams.encodePicFlags = NV_ENC_PIC_FLAG_EOS;
+   NVE_CHECK( (*g_nv.functions.nvEncEncodePicture)( session.nvEncoder, &picParams ), "Failed to flush the encoder" );
+   HandOffEncoded( session, 0 );
+}
+// Stops a session's retrieval thread once everything handed to it is written
+void StopRetrieval( EncodeSession & session )
+{
+   session.encodedSurfaces.Close();
+   if ( session.retrieval.joinable() )
+      session.retrieval.join();
+}
+// Opens a session's output file and starts writing what the session encodes
+void StartOutput( Rendition & rendition,
+   size_t sessionIndex,
+   const std::string & outputFilename,
+   bool part )
+{
+   EncodeSession & session = rendition.sessions[ sessionIndex ];
+   // Refused before any output is created
+   if ( args.splitLayers )
+      LayerSplitter::Check( session.sequenceParams.data(), session.sequenceParams.size() );
+   session.outputFilename = outputFilename;
+   session.accessUnits.clear();
+   session.frameIndex.clear();
+   session.error.clear();
+   session.streaming = IsPipe( outputFilename );
+   session.playlist = nullptr;
+   if ( args.segment > 0 && !part )
+   {
+      // A segment ends at the first frame of the next period, so it runs at most a frame over
+      double longestSegment = args.segment + double(LongestFrameDuration()) / TimeScale();
+      session.playlist.reset( new SegmentPlaylist( ExpandTilde( outputFilename + ".m3u8" ), longestSegment ) );
+      session.segmentStart = FrameTimeStamp( 0 );
+      session.segmentEnd = session.segmentStart;
+      AttachOutput( rendition, session, CreateOutputWriter( SegmentFilename( outputFilename, 0 ) ), part );
+   }
+   else
+      AttachOutput( rendition, session, CreateOutputWriter( outputFilename ), part );
+   if ( args.splitLayers )
+   {
+      session.baseOutput = CreateOutputWriter( outputFilename + ".base.265" );
+      session.alphaOutput = CreateOutputWriter( outputFilename + ".alpha.265" );
+      session.splitter.reset( new LayerSplitter( *session.baseOutput, *session.alphaOutput ) );
+   }
+   session.encodedSurfaces.Reopen();
+   session.retrieval = std::thread( RetrieveBitstreams, std::ref( rendition ), sessionIndex );
+}
+// Opens an encode session on the CUDA context and validates hardware support
+void * OpenEncodeSession( void * cudaContext )
+{
+   void * nvEncoder = nullptr;
+
+   // Initialize the encoder
+   NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS sessionParams = { NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS_VER,
+      NV_ENC_DEVICE_TYPE_CUDA,
+      cudaContext,
+      0,
+      NVENCAPI_VERSION,
+      0,
+      0
+   };
+   NVE_CHECK( (*g_nv.functions.nvEncOpenEncodeSessionEx)( &sessionParams,
+      &nvEncoder), "Failed initializing NVidia encode session" );
+
+   try
+   {
+      // Ensure we have support for the desired encoder
+      uint32_t numEncoderGuids = 0;
+      bool hasHevcSupport = false;
+      NVE_CHECK( (*g_nv.functions.nvEncGetEncodeGUIDCount)( nvEncoder, &numEncoderGuids ), "Failed getting NVidia encode GUID count" );
+      std::vector< GUID > guids( numEncoderGuids );
+      NVE_CHECK( (*g_nv.functions.nvEncGetEncodeGUIDs)( nvEncoder,
+         guids.data(),
+         numEncoderGuids,
+         &numEncoderGuids ), "Failed getting NVidia encode GUIDs" );
+      for ( GUID guid : guids )
+      {
+         if ( memcmp( &guid, &g_nv.encoderGuid, sizeof(guid) ) == 0 )
+         {
+            hasHevcSupport = true;
+            break;
+         }
+      }
+      if ( !hasHevcSupport )
+         throw std::runtime_error( "NVidia hardware does not support HEVC" );
    
       // Ensure we have support for the desired profile
       uint32_t numProfileGuids = 0;
       bool hasProfileSupport = false;
-      NVE_CHECK( (*g_nv.functions.nvEncGetEncodeProfileGUIDCount)( raii.nvEncoder, g_nv.encoderGuid, &numProfileGuids ), "Failed getting NVidia encode profile GUID count" );
+      NVE_CHECK( (*g_nv.functions.nvEncGetEncodeProfileGUIDCount)( nvEncoder, g_nv.encoderGuid, &numProfileGuids ), "Failed getting NVidia encode profile GUID count" );
       guids = std::vector< GUID >( numProfileGuids );
-      NVE_CHECK( (*g_nv.functions.nvEncGetEncodeProfileGUIDs)( raii.nvEncoder,
+      NVE_CHECK( (*g_nv.functions.nvEncGetEncodeProfileGUIDs)( nvEncoder,
          g_nv.encoderGuid,
          guids.data(),
          numProfileGuids,
@@ -517,24 +1249,1058 @@ int main( int argc, char *argv[] )
       // Ensure we have support for the desired capabilities
       for ( auto capValPair : g_nv.requiredCaps )
       {
-         if ( GetCapabilityValue( raii.nvEncoder, g_nv.encoderGuid, capValPair.first ) != capValPair.second )
+         if ( GetCapabilityValue( nvEncoder, g_nv.encoderGuid, capValPair.first ) != capValPair.second )
             throw std::runtime_error( "NVidia encoder doesn't support required capabilities" );
       }
+   }
+   catch ( ... )
+   {
+      (*g_nv.functions.nvEncDestroyEncoder)( nvEncoder );
+      throw;
+   }
 
-      // Create the initial parameters
-      NV_ENC_INITIALIZE_PARAMS initParams = CreateInitParams( raii.nvEncoder,
-         g_nv.encoderGuid,
-         args.width,
-         args.height,
-         args.fpsNumerator,
-         args.fpsDenominator );
-         
-      // Codec-specific settings
-      NV_ENC_CONFIG initParamsHevc = CreateInitParamsHevc( raii.nvEncoder, g_nv.encoderGuid, g_nv.presetGuid );
-      initParams.encodeConfig = &initParamsHevc;
-    
-      // Initialize the encoder
-      NVE_CHECK( (*g_nv.functions.nvEncInitializeEncoder)( raii.nvEncoder, &initParams ), "Failed initializing NVidia encoder" );
+   return nvEncoder;
+}
+// The VPS/SPS/PPS of both layers as a session writes them, available as soon as it is initialized
+std::vector< uint8_t > GetSequenceParams( void * encoder )
+{
+   std::vector< uint8_t > returnValue( 1024 );
+   uint32_t size = 0;
+   NV_ENC_SEQUENCE_PARAM_PAYLOAD payload = { NV_ENC_SEQUENCE_PARAM_PAYLOAD_VER };
+   payload.inBufferSize = uint32_t(returnValue.size());
+   payload.spsppsBuffer = returnValue.data();
+   payload.outSPSPPSPayloadSize = &size;
+   NVE_CHECK( (*g_nv.functions.nvEncGetSequenceParams)( encoder, &payload ), "Failed getting sequence parameters" );
+   returnValue.resize( size );
+   return returnValue;
+}
+// Initializes an open encode session for the given picture, keeping its parameters for later reconfiguring.
+// Returns how many frames the encoder holds for B-frames and lookahead before output is available.
+int InitializeEncoder( EncodeSession & session,
+   const Nv12Geometry & geometry )
+{
+   void * nvEncoder = session.nvEncoder;
+   if ( args.lookahead > 0 && GetCapabilityValue( nvEncoder, g_nv.encoderGuid, NV_ENC_CAPS_SUPPORT_LOOKAHEAD ) == 0 )
+      throw std::runtime_error( "NVidia encoder doesn't support lookahead" );
+
+   // Create the initial parameters
+   // We encode the picture size rounded to even, NVENC writes the conformance window
+   // that crops the coded size back down to it
+   session.initParams = CreateInitParams( nvEncoder,
+      g_nv.encoderGuid,
+      geometry.encodeWidth,
+      geometry.encodeHeight,
+      args.fpsNumerator,
+      args.fpsDenominator );
+      
+   // Codec-specific settings
+   session.encodeConfig = CreateInitParamsHevc( nvEncoder, g_nv.encoderGuid, g_nv.presetGuid, session.bitrate );
+   session.initParams.encodeConfig = &session.encodeConfig;
+ 
+   // Initialize the encoder
+   NVE_CHECK( (*g_nv.functions.nvEncInitializeEncoder)( nvEncoder, &session.initParams ), "Failed initializing NVidia encoder" );
+   session.sequenceParams = GetSequenceParams( nvEncoder );
+
+   int bFrames = std::max( 0, int(session.encodeConfig.frameIntervalP) - 1 );
+   int lookahead = session.encodeConfig.rcParams.enableLookahead ? session.encodeConfig.rcParams.lookaheadDepth : 0;
+   return bFrames + lookahead;
+}
+// Reads whitespace separated <key>=<value> settings: bitrate and maxBitrate in kbit/s,
+// minQp and maxQp, and alphaRatio
+RateControlChange ParseRateControlChange( std::istream & input )
+{
+   RateControlChange returnValue;
+   std::string token;
+   while ( input >> token )
+   {
+      size_t separator = token.find( '=' );
+      if ( separator == std::string::npos )
+         throw std::runtime_error( "Expected <key>=<value> in control file: " + token );
+      std::string key = token.substr( 0, separator );
+      int value = 0;
+      try
+      {
+         value = std::stoi( token.substr( separator + 1 ) );
+      }
+      catch ( const std::logic_error & )
+      {
+         throw std::runtime_error( "Bad value in control file: " + token );
+      }
+
+      if ( key == "minQp" || key == "maxQp" )
+      {
+         if ( value < 0 || value > 51 )
+            throw std::runtime_error( "QP must be from 0 to 51: " + token );
+         (key == "minQp" ? returnValue.minQp : returnValue.maxQp) = value;
+      }
+      else if ( key == "bitrate" || key == "maxBitrate" || key == "alphaRatio" )
+      {
+         if ( value <= 0 )
+            throw std::runtime_error( "Value must be positive: " + token );
+         if ( key == "bitrate" )
+            returnValue.bitrate = value;
+         else if ( key == "maxBitrate" )
+            returnValue.maxBitrate = value;
+         else
+            returnValue.alphaRatio = value;
+      }
+      else
+         throw std::runtime_error( "Unknown setting in control file: " + key );
+   }
+   return returnValue;
+}
+// Picks up a new control file, at most every 100 ms. The file is removed once read, so a
+// controller should write it elsewhere and rename it into place.
+// Returns the number of changes so far and all of them merged.
+int PollControl( RateControlChange & settings )
+{
+   std::lock_guard< std::mutex > lock( g_control.mutex );
+   auto now = std::chrono::steady_clock::now();
+   if ( now - g_control.lastPoll >= std::chrono::milliseconds( 100 ) )
+   {
+      g_control.lastPoll = now;
+      std::ifstream input( args.controlFilename );
+      if ( input.good() )
+      {
+         try
+         {
+            RateControlChange change = ParseRateControlChange( input );
+            RateControlChange & merged = g_control.settings;
+            for ( auto field : { &RateControlChange::bitrate, &RateControlChange::maxBitrate, &RateControlChange::minQp,
+               &RateControlChange::maxQp, &RateControlChange::alphaRatio } )
+            {
+               if ( change.*field >= 0 )
+                  merged.*field = change.*field;
+            }
+
+            // A new bitrate without its own peak gets the default one
+            if ( change.bitrate > 0 && change.maxBitrate < 0 )
+               merged.maxBitrate = -1;
+            ++g_control.generation;
+         }
+         catch ( const std::runtime_error & e )
+         {
+            std::cout << e.what() << std::endl;
+         }
+         input.close();
+         std::remove( args.controlFilename.c_str() );
+      }
+   }
+   settings = g_control.settings;
+   return g_control.generation;
+}
+// Applies new rate control to a running session between frames. The encoder keeps its
+// state, reference frames and registered surfaces. Bitrates are given for the first
+// bitrate of the ladder, the other sessions keep their ratio to it.
+// Returns how long the reconfigure took in milliseconds.
+double ReconfigureEncoder( EncodeSession & session,
+   const RateControlChange & change )
+{
+   auto start = std::chrono::steady_clock::now();
+   double scale = (args.bitrates[ 0 ] > 0 && session.bitrate > 0) ? double(session.bitrate) / args.bitrates[ 0 ] : 1.0;
+   NV_ENC_CONFIG encodeConfig = session.encodeConfig;
+   NV_ENC_RC_PARAMS & rcParams = encodeConfig.rcParams;
+   if ( change.bitrate > 0 )
+   {
+      if ( rcParams.rateControlMode == NV_ENC_PARAMS_RC_CONSTQP )
+         rcParams.rateControlMode = NV_ENC_PARAMS_RC_VBR;
+      rcParams.averageBitRate = uint32_t(std::llround( change.bitrate * scale )) * 1000;
+      rcParams.maxBitRate = rcParams.averageBitRate * 3 / 2;
+   }
+   if ( change.maxBitrate > 0 )
+      rcParams.maxBitRate = uint32_t(std::llround( change.maxBitrate * scale )) * 1000;
+   if ( !args.latency.empty() && change.bitrate > 0 )
+   {
+      // Still CBR with a one frame VBV
+      rcParams.maxBitRate = rcParams.averageBitRate;
+      rcParams.vbvBufferSize = uint32_t(uint64_t(rcParams.averageBitRate) * args.fpsDenominator / args.fpsNumerator);
+      rcParams.vbvInitialDelay = rcParams.vbvBufferSize;
+   }
+   if ( rcParams.averageBitRate > 0 && rcParams.maxBitRate < rcParams.averageBitRate )
+      throw std::runtime_error( "Max bitrate is below the bitrate of " + session.outputFilename );
+   if ( change.minQp >= 0 )
+   {
+      rcParams.enableMinQP = 1;
+      rcParams.minQP = { uint32_t(change.minQp), uint32_t(change.minQp), uint32_t(change.minQp) };
+   }
+   if ( change.maxQp >= 0 )
+   {
+      rcParams.enableMaxQP = 1;
+      rcParams.maxQP = { uint32_t(change.maxQp), uint32_t(change.maxQp), uint32_t(change.maxQp) };
+   }
+   if ( rcParams.enableMinQP && rcParams.enableMaxQP && rcParams.minQP.qpIntra > rcParams.maxQP.qpIntra )
+      throw std::runtime_error( "Min QP is above max QP" );
+   if ( change.alphaRatio > 0 && g_useAlpha )
+      rcParams.alphaLayerBitrateRatio = uint32_t(change.alphaRatio);
+
+   // Same picture and GOP, so no IDR is needed
+   NV_ENC_RECONFIGURE_PARAMS reconfigureParams = { NV_ENC_RECONFIGURE_PARAMS_VER };
+   reconfigureParams.reInitEncodeParams = session.initParams;
+   reconfigureParams.reInitEncodeParams.encodeConfig = &encodeConfig;
+   NVE_CHECK( (*g_nv.functions.nvEncReconfigureEncoder)( session.nvEncoder, &reconfigureParams ), "Failed reconfiguring NVidia encoder" );
+   session.encodeConfig = encodeConfig;
+   return std::chrono::duration< double, std::milli >( std::chrono::steady_clock::now() - start ).count();
+}
+// Releases the job's sessions and buffers. Sessions keep their counters for the final report.
+void CloseJob( EncodeJob & job )
+{
+   for ( auto & rendition : job.renditions )
+   {
+      for ( auto & session : rendition.sessions )
+         StopRetrieval( session );
+      DestroySurfaces( rendition, job.cudaContext );
+      for ( auto & session : rendition.sessions )
+      {
+         if ( session.nvEncoder )
+         {
+            (*g_nv.functions.nvEncDestroyEncoder)( session.nvEncoder );
+            session.nvEncoder = nullptr;
+         }
+         ReleaseOutputs( session );
+      }
+
+      // Pinned buffers must go before the device context
+      rendition.scaler = nullptr;
+      rendition.stagedFrame = nullptr;
+      rendition.stagedAlpha = nullptr;
+   }
+   job.sourceFrame = nullptr;
+}
+EncodeJob::~EncodeJob()
+{
+   CloseJob( *this );
+}
+// Name of the output file for a rendition at one bitrate
+std::string OutputFilename( const std::string & size,
+   int bitrate )
+{
+   std::string returnValue = args.outputFilename.empty() ? "outputWithTransparency." + args.container : args.outputFilename;
+   if ( returnValue == "-" )
+      return returnValue;
+
+   // Several outputs tell themselves apart before the extension
+   std::string suffix;
+   if ( args.renditions.size() > 1 )
+      suffix += "_" + size;
+   if ( args.bitrates.size() > 1 )
+      suffix += "_" + std::to_string( bitrate ) + "k";
+   return InsertBeforeExtension( returnValue, suffix );
+}
+// Opens the job's input at its first frame and starts an encode session per rendition on
+// its device. 'visibleRegion' is the part of the source that is encoded.
+void OpenJob( EncodeJob & job,
+   const Nv12Geometry & sourceGeometry,
+   const Rect & visibleRegion )
+{
+   job.cudaContext = job.device->cudaContext;
+
+   // The source is read once per frame and shared by all renditions
+   job.sourceFrame.reset( new PinnedBuffer( job.cudaContext, sourceGeometry.FrameSize() ) );
+   OpenInput( job, sourceGeometry );
+
+   Rect fullRegion = { 0, 0, sourceGeometry.encodeWidth, sourceGeometry.encodeHeight };
+   ScaleFilter scaleFilter = ParseScaleFilter( args.scaleFilter );
+   for ( const auto & size : args.renditions )
+   {
+      job.renditions.emplace_back();
+      Rendition & rendition = job.renditions.back();
+      std::tie( rendition.canvasWidth, rendition.canvasHeight ) = ParseSize( size );
+      for ( int bitrate : args.bitrates )
+      {
+         rendition.sessions.emplace_back();
+         rendition.sessions.back().bitrate = bitrate;
+         rendition.sessions.back().nvEncoder = OpenEncodeSession( job.cudaContext );
+      }
+      double scaleX = double(rendition.canvasWidth) / sourceGeometry.width;
+      double scaleY = double(rendition.canvasHeight) / sourceGeometry.height;
+
+      if ( visibleRegion == fullRegion )
+      {
+         rendition.sourceRegion = fullRegion;
+         rendition.canvasRegion = { 0, 0, rendition.canvasWidth, rendition.canvasHeight };
+      }
+      else
+      {
+         // Crop in source pixels, grown so the scaled picture is still one the encoder accepts
+         void * nvEncoder = rendition.sessions.front().nvEncoder;
+         int minWidth = int(std::ceil( GetCapabilityValue( nvEncoder, g_nv.encoderGuid, NV_ENC_CAPS_WIDTH_MIN ) / scaleX ));
+         int minHeight = int(std::ceil( GetCapabilityValue( nvEncoder, g_nv.encoderGuid, NV_ENC_CAPS_HEIGHT_MIN ) / scaleY ));
+         rendition.sourceRegion = FitRegion( visibleRegion, minWidth, minHeight, fullRegion.width, fullRegion.height );
+         const Rect & region = rendition.sourceRegion;
+         rendition.canvasRegion = {
+            int(std::lround( region.x * scaleX )) & ~1,
+            int(std::lround( region.y * scaleY )) & ~1,
+            AlignUp( int(std::lround( region.width * scaleX )), 2 ),
+            AlignUp( int(std::lround( region.height * scaleY )), 2 )
+         };
+      }
+      const Rect & region = rendition.sourceRegion;
+      const Nv12Geometry & geometry = rendition.geometry = Nv12Geometry( rendition.canvasRegion.width, rendition.canvasRegion.height, g_nv.surfaceAlignment );
+
+      // Scale between the even-sized pictures, then pad out to the aligned size
+      if ( region.width != geometry.encodeWidth || region.height != geometry.encodeHeight )
+         rendition.scaler.reset( new Nv12Scaler( region.width, region.height, geometry.encodeWidth, geometry.encodeHeight, scaleFilter ) );
+      if ( rendition.scaler || region != fullRegion )
+         rendition.stagedFrame.reset( new PinnedBuffer( job.cudaContext, geometry.FrameSize() ) );
+
+      // The mask is staged into an NV12 buffer with neutral chroma, a sequence every frame
+      // and a still once, uploaded here for every session to share
+      if ( g_useAlpha )
+      {
+         rendition.stagedAlpha.reset( new PinnedBuffer( job.cudaContext, geometry.FrameSize() ) );
+         memset( rendition.stagedAlpha->data + geometry.LumaSize(), 0x80, geometry.FrameSize() - geometry.LumaSize() );
+      }
+      if ( g_useAlpha && !g_file.maskIsSequence )
+      {
+         StageMask( rendition, sourceGeometry, job.mask.data(), rendition.stagedAlpha->data );
+         rendition.stillAlpha = AllocateDeviceFrame( job.cudaContext, geometry );
+         CudaScope cs( (CUcontext)job.cudaContext );
+         UploadFrame( geometry, rendition.stagedAlpha->data, rendition.stillAlpha, nullptr );
+      }
+
+      for ( auto & session : rendition.sessions )
+      {
+         session.outputDelay = InitializeEncoder( session, geometry );
+         if ( rendition.stillAlpha.cudaBuffer )
+            session.stillAlpha = RegisterInputBuffer( session.nvEncoder, geometry, rendition.stillAlpha );
+      }
+
+      // Encoded frames are written out on a thread per session
+      CreateSurfaces( rendition, job.cudaContext );
+      for ( size_t i = 0; i < rendition.sessions.size(); ++i )
+         StartOutput( rendition, i, OutputFilename( size, rendition.sessions[ i ].bitrate ) + job.outputSuffix, !job.outputSuffix.empty() );
+   }
+}
+// Keeps a finished job's sessions, surfaces and buffers open for a later request with the same settings
+void ParkJob( EncodeJob & job )
+{
+   job.inputVideo.close();
+   job.inputMask.close();
+   for ( auto & rendition : job.renditions )
+   {
+      for ( auto & session : rendition.sessions )
+         ReleaseOutputs( session );
+   }
+}
+// Runs a parked job again over new inputs and outputs. Every encoder is reset so its
+// output starts over with an IDR and fresh rate control.
+void ReopenJob( EncodeJob & job,
+   const Nv12Geometry & sourceGeometry )
+{
+   job.error.clear();
+   job.inputFrameCount = 0;
+   job.reused = true;
+   OpenInput( job, sourceGeometry );
+
+   for ( size_t r = 0; r < job.renditions.size(); ++r )
+   {
+      Rendition & rendition = job.renditions[ r ];
+      if ( rendition.stillAlpha.cudaBuffer )
+      {
+         StageMask( rendition, sourceGeometry, job.mask.data(), rendition.stagedAlpha->data );
+         CudaScope cs( (CUcontext)job.cudaContext );
+         UploadFrame( rendition.geometry, rendition.stagedAlpha->data, rendition.stillAlpha, nullptr );
+      }
+
+      for ( size_t i = 0; i < rendition.sessions.size(); ++i )
+      {
+         EncodeSession & session = rendition.sessions[ i ];
+         session.encodeConfig = CreateInitParamsHevc( session.nvEncoder, g_nv.encoderGuid, g_nv.presetGuid, session.bitrate );
+         NV_ENC_RECONFIGURE_PARAMS reconfigureParams = { NV_ENC_RECONFIGURE_PARAMS_VER };
+         reconfigureParams.reInitEncodeParams = session.initParams;
+         reconfigureParams.resetEncoder = 1;
+         reconfigureParams.forceIDR = 1;
+         NVE_CHECK( (*g_nv.functions.nvEncReconfigureEncoder)( session.nvEncoder, &reconfigureParams ), "Failed resetting NVidia encoder" );
+         session.sequenceParams = GetSequenceParams( session.nvEncoder );
+
+         session.outputFrameCount = 0;
+         session.outputBytes = 0;
+         session.alphaBytes = 0;
+         session.latencies.clear();
+         session.fragmentLatencies.clear();
+         session.writeStalls.clear();
+         StartOutput( rendition, i, OutputFilename( args.renditions[ r ], session.bitrate ) + job.outputSuffix, !job.outputSuffix.empty() );
+      }
+   }
+}
+// Encodes every frame of the job, then flushes the encoders and waits for the output
+void RunJob( EncodeJob & job,
+   const Nv12Geometry & sourceGeometry )
+{
+   // Every upload below is on this thread, so the context is made current once
+   CudaScope cs( (CUcontext)job.cudaContext );
+   int controlGeneration = 0;
+   for ( ;; )
+   {
+      // The previous frame's uploads may still be reading the staging buffers about to be refilled
+      for ( const auto & rendition : job.renditions )
+      {
+         if ( rendition.lastUploaded )
+            CUDA_CHECK( cuEventSynchronize( rendition.lastUploaded->uploaded ) );
+      }
+      if ( !ReadInputFrame( job, sourceGeometry ) )
+         break;
+
+      // Nothing more can be written once a reader has gone away or the disk is full
+      bool outputFailed = false;
+      for ( const auto & rendition : job.renditions )
+      {
+         for ( const auto & session : rendition.sessions )
+            outputFailed = outputFailed || OutputFailed( session );
+      }
+      if ( outputFailed )
+      {
+         std::cout << "Stopping at frame " << job.firstFrame + job.inputFrameCount << ", an output can't be written" << std::endl;
+         break;
+      }
+      auto captureTime = std::chrono::steady_clock::now();
+
+      // A new shot starts with an IDR rather than wasting bits predicting from the last one
+      bool sceneCut = false;
+      if ( !job.sceneCuts.Empty() )
+      {
+         sceneCut = job.sceneCuts.IsCut( job.sourceFrame->data, sourceGeometry.Pitch(), sourceGeometry.width, sourceGeometry.height );
+         if ( sceneCut )
+            job.cuts.push_back( job.firstFrame + job.inputFrameCount );
+      }
+
+      // Each segment period starts with an IDR, for the output to roll over to a new file there
+      int frame = job.firstFrame + job.inputFrameCount;
+      bool segmentStart = args.segment > 0 && frame > 0 && SegmentOf( FrameTimeStamp( frame ) ) != SegmentOf( FrameTimeStamp( frame - 1 ) );
+
+      // Rate control changes take effect from this frame on
+      if ( !args.controlFilename.empty() )
+      {
+         RateControlChange settings;
+         int generation = PollControl( settings );
+         if ( generation != controlGeneration )
+         {
+            controlGeneration = generation;
+            for ( auto & rendition : job.renditions )
+            {
+               for ( auto & session : rendition.sessions )
+               {
+                  try
+                  {
+                     double milliseconds = ReconfigureEncoder( session, settings );
+                     const NV_ENC_RC_PARAMS & rcParams = session.encodeConfig.rcParams;
+                     std::cout << "Reconfigured `" << session.outputFilename << "' at frame " << job.firstFrame + job.inputFrameCount
+                        << " to " << rcParams.averageBitRate / 1000 << "/" << rcParams.maxBitRate / 1000 << " kbit/s in "
+                        << milliseconds << " ms" << std::endl;
+                  }
+                  catch ( const std::runtime_error & e )
+                  {
+                     std::cout << e.what() << std::endl;
+                  }
+               }
+            }
+         }
+      }
+
+      // The first mask frame was read when the input was opened, later ones track the video.
+      // If a mask sequence is shorter than the video its last frame is held.
+      bool newMask = job.inputFrameCount == 0;
+      if ( g_file.maskIsSequence && job.inputFrameCount > 0 )
+         newMask = ReadMaskFrame( job.inputMask, sourceGeometry, job.mask.data() );
+      if ( g_file.maskIsSequence && newMask && !job.temporalFilter.Empty() )
+         job.temporalFilter.Apply( job.mask.data(), job.mask.size(), args.threads );
+
+      for ( auto & rendition : job.renditions )
+      {
+         const Nv12Geometry & geometry = rendition.geometry;
+
+         // Waits here while every surface is in flight
+         EncodeSurface * surface = nullptr;
+         rendition.freeSurfaces.Pop( surface );
+         try
+         {
+            ReleaseSurface( rendition, *surface );
+            surface->captureTime = captureTime;
+
+            // Crop and scale the source to this rendition, or use it as-is
+            const uint8_t * frame = job.sourceFrame->data;
+            if ( rendition.stagedFrame )
+            {
+               StageFrame( rendition, sourceGeometry, frame, rendition.stagedFrame->data );
+               frame = rendition.stagedFrame->data;
+            }
+
+            // Input video frame and this frame's alpha mask, uploaded once for every session
+            UploadFrame( geometry, frame, surface->input, surface->stream );
+            if ( g_useAlpha && g_file.maskIsSequence )
+            {
+               StageMask( rendition, sourceGeometry, job.mask.data(), rendition.stagedAlpha->data );
+               UploadFrame( geometry, rendition.stagedAlpha->data, surface->alpha, surface->stream );
+            }
+            CUDA_CHECK( cuEventRecord( surface->uploaded, surface->stream ) );
+            rendition.lastUploaded = surface;
+         }
+         catch ( const std::runtime_error & e )
+         {
+            std::cout << e.what() << std::endl;
+            rendition.freeSurfaces.Push( surface );
+            continue;
+         }
+
+         // The surface goes back to the pool once every session is done with it
+         surface->outstanding = int(rendition.sessions.size());
+         for ( size_t i = 0; i < rendition.sessions.size(); ++i )
+         {
+            EncodeSession & session = rendition.sessions[ i ];
+            try
+            {
+               // The encode waits on the surface's stream for its uploads, the host doesn't
+               NVE_CHECK( (*g_nv.functions.nvEncSetIOCudaStreams)( session.nvEncoder, &surface->stream, &surface->stream ), "Failed setting encoder CUDA streams" );
+               LockInputBuffer( session.nvEncoder, surface->inputs[ i ] );
+               if ( g_useAlpha )
+                  LockInputBuffer( session.nvEncoder, surface->alphas[ i ] );
+
+               // Create a frame, tying all the data together
+               // TODO: WAS SETTING PITCH, but don't think I need to
+               NV_ENC_PIC_PARAMS picParams = { NV_ENC_PIC_PARAMS_VER, uint32_t(geometry.encodeWidth), uint32_t(geometry.encodeHeight) };
+               picParams.bufferFmt = g_nv.inputFormat;
+               picParams.pictureStruct = NV_ENC_PIC_STRUCT_FRAME;
+               picParams.inputBuffer = surface->inputs[ i ].inputResource.mappedResource;
+               picParams.alphaBuffer = surface->alphas[ i ].inputResource.mappedResource;
+               picParams.outputBitstream = surface->outputBitstreams[ i ];
+               picParams.inputTimeStamp = uint64_t(FrameTimeStamp( job.firstFrame + job.inputFrameCount )); // Comes back as outputTimeStamp in decode order
+               picParams.inputDuration = FrameDuration( job.firstFrame + job.inputFrameCount );
+
+               // A reused session was reset, but make sure its new stream starts as a fresh one
+               if ( job.reused && job.inputFrameCount == 0 )
+                  picParams.encodePicFlags |= NV_ENC_PIC_FLAG_FORCEIDR | NV_ENC_PIC_FLAG_OUTPUT_SPSPPS;
+               if ( sceneCut )
+                  picParams.encodePicFlags |= NV_ENC_PIC_FLAG_FORCEIDR;
+               if ( segmentStart )
+                  picParams.encodePicFlags |= NV_ENC_PIC_FLAG_FORCEIDR | NV_ENC_PIC_FLAG_OUTPUT_SPSPPS;
+
+               // Encode a frame
+               NVENCSTATUS nvStatus = (*g_nv.functions.nvEncEncodePicture)( session.nvEncoder, &picParams );
+               if ( nvStatus != NV_ENC_ERR_NEED_MORE_INPUT )
+                  NVE_CHECK( nvStatus, "Failed to encode frame" );
+
+               // Keep track of frames to handle encoder latency
+               session.pendingSurfaces.push_back( surface );
+               
+               // If we don't need more input to get an output, everything older than the encoder's
+               // delay is done or about to be, the retrieval thread waits in nvEncLockBitstream
+               if ( nvStatus == NV_ENC_SUCCESS )
+                  HandOffEncoded( session, session.outputDelay );
+            }
+            catch ( const std::runtime_error & e )
+            {
+               std::cout << e.what() << std::endl;
+               ReturnSurface( rendition, *surface );
+            }
+         }
+      }
+
+      ++job.inputFrameCount;
+   }
+   
+   // End of stream flushes every frame the encoders still hold, then wait for it all to be written
+   for ( auto & rendition : job.renditions )
+   {
+      for ( auto & session : rendition.sessions )
+      {
+         try
+         {
+            FlushEncoder( session );
+         }
+         catch ( const std::runtime_error & e )
+         {
+            std::cout << e.what() << std::endl;
+         }
+         StopRetrieval( session );
+         if ( !session.error.empty() && job.error.empty() )
+            job.error = session.error;
+
+         // The sample tables are complete once everything is written, then the writer
+         // thread finishes and reports any failed write. An incomplete output fails the job.
+         try
+         {
+            CloseOutputs( session );
+            if ( session.playlist )
+            {
+               if ( session.segmentEnd > session.segmentStart )
+                  ListSegment( session );
+               session.playlist->Finish();
+            }
+         }
+         catch ( const std::runtime_error & e )
+         {
+            if ( job.error.empty() )
+               job.error = e.what();
+            else
+               std::cout << e.what() << std::endl;
+         }
+         ReleaseOutputs( session );
+      }
+   }
+}
+// Joins chunk outputs into one stream. Every part starts with an IDR carrying the same
+// parameter sets, so the concatenation is a conformant stream. The parts are only removed
+// once the joined stream is complete.
+void StitchParts( const std::string & filename,
+   const std::vector< std::string > & parts )
+{
+   {
+      std::ofstream output = CreateOutputFile( filename );
+      for ( const auto & part : parts )
+      {
+         std::ifstream input( ExpandTilde( part ), std::ios::binary );
+         if ( !input.good() )
+            throw std::runtime_error( "Could not read chunk output " + part );
+         if ( input.peek() != std::ifstream::traits_type::eof() ) // Inserting nothing sets failbit
+            output << input.rdbuf();
+      }
+      output.close();
+      if ( !output.good() )
+         throw std::runtime_error( "Failed writing " + filename );
+   }
+   for ( const auto & part : parts )
+      std::remove( ExpandTilde( part ).c_str() );
+}
+// Joins chunk outputs into one MP4 or MOV, muxing the access units each session recorded.
+// The parts are only removed once the container is complete.
+void MuxParts( const std::string & filename,
+   const std::vector< const EncodeSession * > & sessions,
+   const Nv12Geometry & geometry )
+{
+   auto output = CreateOutputWriter( filename );
+   Mp4Writer muxer( *output, geometry.width, geometry.height, TimeScale(), int(DefaultFrameDuration()),
+      args.container == "mov", (args.fragment > 0) ? FragmentFrames() : 0 );
+   if ( !sessions.empty() )
+      muxer.SetParameterSets( sessions[ 0 ]->sequenceParams.data(), sessions[ 0 ]->sequenceParams.size() );
+   std::vector< uint8_t > accessUnit;
+   for ( const EncodeSession * session : sessions )
+   {
+      {
+         std::ifstream input( ExpandTilde( session->outputFilename ), std::ios::binary );
+         if ( !input.good() )
+            throw std::runtime_error( "Could not read chunk output " + session->outputFilename );
+         for ( const auto & info : session->accessUnits )
+         {
+            accessUnit.resize( info.size );
+            if ( !input.read( (char *)accessUnit.data(), info.size ) )
+               throw std::runtime_error( "Chunk output " + session->outputFilename + " ended early" );
+            muxer.WriteSample( accessUnit.data(), accessUnit.size(), info.presentation, info.duration );
+         }
+      }
+   }
+   muxer.Finish();
+   output->Close();
+   for ( const EncodeSession * session : sessions )
+      std::remove( ExpandTilde( session->outputFilename ).c_str() );
+}
+// Removes the chunk outputs of an encode that failed, they are never joined
+void RemoveParts( const std::vector< std::unique_ptr< EncodeJob > > & jobs )
+{
+   for ( const auto & job : jobs )
+   {
+      if ( job->outputSuffix.empty() )
+         continue;
+      for ( const auto & size : args.renditions )
+      {
+         for ( int bitrate : args.bitrates )
+         {
+            std::string part = ExpandTilde( OutputFilename( size, bitrate ) + job->outputSuffix );
+            std::remove( part.c_str() );
+            if ( args.splitLayers )
+            {
+               for ( const char * layer : { ".base.265", ".alpha.265" } )
+                  std::remove( (part + layer).c_str() );
+            }
+         }
+      }
+   }
+}
+// Hands chunks to device workers in input order, so faster GPUs simply take more of them
+struct Scheduler
+{
+   std::vector< std::unique_ptr< EncodeJob > > jobs;
+   std::atomic< int > nextJob{ 0 };
+   std::mutex mutex;
+   std::vector< std::vector< uint8_t > > sequenceParams; // Per session, from the first job opened
+   bool keepWarm = false;                         // Finished jobs are parked rather than closed
+   std::vector< std::unique_ptr< EncodeJob > > warmJobs; // Parked, sessions open for the next request
+   std::string warmKey;                           // Settings the parked jobs were opened with
+};
+// Everything a job's sessions and buffers are created from. Parked jobs only run again
+// for a request with the same key.
+std::string JobKey( const Nv12Geometry & sourceGeometry,
+   const Rect & visibleRegion )
+{
+   std::stringstream ss;
+   ss << sourceGeometry.width << "x" << sourceGeometry.height << " " << args.fpsNumerator << "/" << args.fpsDenominator
+      << " crop " << visibleRegion.x << "," << visibleRegion.y << "," << visibleRegion.width << "," << visibleRegion.height
+      << " " << args.scaleFilter << " lookahead " << args.lookahead << " latency " << args.latency << " sequence " << g_file.maskIsSequence
+      << " segment " << (args.segment > 0) << " container " << args.container << " fragment " << args.fragment;
+   for ( const auto & size : args.renditions )
+      ss << " rendition " << size;
+   for ( int bitrate : args.bitrates )
+      ss << " bitrate " << bitrate;
+   for ( int index : args.devices )
+      ss << " device " << index;
+   return ss.str();
+}
+// Takes a parked job on the device, if there is one
+std::unique_ptr< EncodeJob > TakeWarmJob( Scheduler & scheduler,
+   const Device & device )
+{
+   std::lock_guard< std::mutex > lock( scheduler.mutex );
+   for ( auto it = scheduler.warmJobs.begin(); it != scheduler.warmJobs.end(); ++it )
+   {
+      if ( (*it)->device == &device )
+      {
+         std::unique_ptr< EncodeJob > returnValue = std::move( *it );
+         scheduler.warmJobs.erase( it );
+         return returnValue;
+      }
+   }
+   return nullptr;
+}
+// Chunks can only be joined if every session writes the same parameter sets
+void CheckSequenceParams( Scheduler & scheduler,
+   const EncodeJob & job )
+{
+   std::lock_guard< std::mutex > lock( scheduler.mutex );
+   size_t index = 0;
+   for ( const auto & rendition : job.renditions )
+   {
+      for ( const auto & session : rendition.sessions )
+      {
+         if ( scheduler.sequenceParams.size() <= index )
+            scheduler.sequenceParams.push_back( session.sequenceParams );
+         else if ( session.sequenceParams != scheduler.sequenceParams[ index ] )
+            throw std::runtime_error( "Chunk encoders disagree on parameter sets, cannot join their output" );
+         ++index;
+      }
+   }
+}
+// One of a device's workers: opens, encodes and closes chunks until none are left
+void RunWorker( Scheduler & scheduler,
+   Device & device,
+   const Nv12Geometry & sourceGeometry,
+   const Rect & visibleRegion )
+{
+   for ( int i = scheduler.nextJob++; i < int(scheduler.jobs.size()); i = scheduler.nextJob++ )
+   {
+      auto start = std::chrono::steady_clock::now();
+
+      // A parked job takes over the chunk, skipping session setup
+      std::unique_ptr< EncodeJob > warmJob = TakeWarmJob( scheduler, device );
+      if ( warmJob )
+      {
+         warmJob->firstFrame = scheduler.jobs[ i ]->firstFrame;
+         warmJob->frameCount = scheduler.jobs[ i ]->frameCount;
+         warmJob->outputSuffix = scheduler.jobs[ i ]->outputSuffix;
+         scheduler.jobs[ i ] = std::move( warmJob );
+      }
+      EncodeJob & job = *scheduler.jobs[ i ];
+      job.device = &device;
+      try
+      {
+         if ( job.renditions.empty() )
+            OpenJob( job, sourceGeometry, visibleRegion );
+         else
+            ReopenJob( job, sourceGeometry );
+         CheckSequenceParams( scheduler, job );
+         RunJob( job, sourceGeometry );
+         if ( scheduler.keepWarm )
+            ParkJob( job );
+         else
+            CloseJob( job );
+      }
+      catch ( const std::runtime_error & e )
+      {
+         job.error = e.what();
+      }
+
+      std::lock_guard< std::mutex > lock( scheduler.mutex );
+      if ( device.start == std::chrono::steady_clock::time_point() || start < device.start )
+         device.start = start;
+      device.end = std::chrono::steady_clock::now();
+      device.frameCount += job.inputFrameCount;
+   }
+}
+
+// Registers the encode options. With 'serve', none of them can be given with it, and the ones
+// an encode requires are returned for the caller to require when it isn't serving instead.
+std::vector< CLI::Option * > AddOptions( CLI::App & app,
+   CLI::Option * serve = nullptr )
+{
+   std::vector< CLI::Option * > returnValue;
+   auto required = [&]( CLI::Option * option )
+   {
+      if ( serve )
+         returnValue.push_back( option );
+      else
+         option->required();
+   };
+   required( app.add_option( "--yuvFrames", args.inputYuvFramesFilename, "Monolithic input file containing a sequence of YUV 4:2:0 frames\n" ) );
+   required( app.add_option( "--mask", args.maskFilename, "Single frame YUV image representing transparency mask, data only (no BMP, etc), or a monolithic sequence with one mask per frame. Dimensions MUST match input YUV frames\n" ) );
+   required( app.add_option( "--width", args.width, "Width of the input YUV frames and mask. Need not be even or aligned\n" ) );
+   required( app.add_option( "--height", args.height, "Height of the input YUV frames and mask. Need not be even or aligned\n" ) );
+   required( app.add_option( "--fpsn", args.fpsNumerator, "Frame rate numerator\n" ) );
+   required( app.add_option( "--fpsd", args.fpsDenominator, "Frame rate denominator\n" ) );
+   app.add_option( "--timecodes", args.timecodesFilename, "Presentation time of every frame in milliseconds, one per line in display order (mkvmerge timestamp format v2). Defaults to a constant rate from --fpsn and --fpsd\n" );
+   app.add_option( "--rendition", args.renditions, "Output size as <width>x<height>, repeat for more sizes. Each size gets its own encode session and output file. Defaults to the input size\n" );
+   app.add_option( "--scaleFilter", args.scaleFilter, "Filter used to produce renditions: area or bicubic\n" );
+   app.add_option( "--threads", args.threads, "Number of CPU threads used for scaling\n" );
+   app.add_option( "--maskFilter", args.maskFilters, "Mask clean-up step as <operation>:<value>, repeat to chain them in order. Operations are erode:<radius>, dilate:<radius>, box:<radius>, gaussian:<sigma>, threshold:<level> and posterize:<levels>\n" );
+   app.add_option( "--alphaTemporal", args.alphaTemporal, "Stabilize a mask sequence over time to save alpha bits: hysteresis:<levels> keeps the previous alpha unless it moved by more than <levels>, median:<3|5> takes the median over that many frames\n" );
+   app.add_option( "--bitrate", args.bitrates, "Average bitrate in kbit/s, repeat for a ladder. Every bitrate of a rendition encodes the same uploaded frames in its own session and output file. Defaults to the preset's rate control\n" );
+   app.add_option( "--latency", args.latency, "Low latency streaming: low or ultra tuning, CBR with a VBV of one frame, no B-frames and no reordering. Needs --bitrate. Per frame latency percentiles are printed at the end\n" );
+   app.add_option( "--lookahead", args.lookahead, "Rate control lookahead depth in frames, 0 keeps the preset's setting. Deeper lookahead delays output but every frame is still written\n" );
+   app.add_option( "--devices", args.devices, "CUDA device indices to encode on, chunks are spread across them. Defaults to device 0\n" );
+   app.add_option( "--chunks", args.chunks, "Split the input into this many segments, each starting with an IDR, and encode them concurrently with separate sessions. The segments are joined into one output. Defaults to one per device\n" );
+   app.add_option( "--sessionLimit", args.sessionLimit, "Most encode sessions to run at once on each device, further chunks wait their turn. Consumer GPUs allow only a few\n" );
+   app.add_option( "--control", args.controlFilename, "File polled while encoding for rate control changes as <key>=<value> pairs: bitrate, maxBitrate, minQp, maxQp and alphaRatio. It is applied to every session between frames and then removed. Bitrates are for the first --bitrate, the others keep their ratio to it\n" );
+   app.add_option( "--sceneCut", args.sceneCut, "Encode the first frame of every shot as an IDR. A shot changes when 8x8 block averages differ by this many luma levels on average, and their histogram changes too. Around 30 suits most content, 0 turns detection off. Cut frames are written to <output>.cuts and chunks are moved to start on them\n" );
+   app.add_option( "-o,--output", args.outputFilename, "Output file, '-' for stdout. Several renditions or bitrates add _<size> and _<bitrate>k before the extension. stdout and pipes are written strictly in order, mp4 needs --fragment. Defaults to outputWithTransparency.<container>\n" );
+   app.add_option( "--container", args.container, "Output format: 265 for a raw HEVC stream, or mp4 or mov with the alpha layer signaled as an auxiliary picture layer\n" );
+   app.add_option( "--fragment", args.fragment, "Fragmented MP4 (CMAF) for live delivery: an init segment, then a fragment starting at an IDR about every this many milliseconds, each written as soon as it is complete. Needs --container mp4. IDRs are placed to match\n" );
+   app.add_option( "--segment", args.segment, "Roll the output over to a new file every this many seconds, <output>_00000.265 and so on, each starting with an IDR and the parameter sets. Finished segments are listed in the playlist <output>.m3u8 as they complete\n" );
+   app.add_flag( "--preallocate", args.preallocate, "Reserve disk space for outputs ahead of writing them, in large steps, where the file system supports it\n" );
+   app.add_flag( "--index", args.index, "Also write <output>.idx, the offset, size, alpha size, picture type and timestamp of every frame, for cutting and remuxing without parsing the stream\n" );
+   app.add_flag( "--paramSets", args.paramSets, "Also write <output>.params, the VPS, SPS and PPS of both layers as the encoder reports them before the first frame\n" );
+   app.add_flag( "--splitLayers", args.splitLayers, "Also write the base and alpha layers as separate elementary streams, <output>.base.265 and <output>.alpha.265. Both get the VPS, the alpha stream keeps its layer id of 1. Refused when the alpha SPS uses multi-layer extension syntax, which can't stand alone\n" );
+   app.add_flag( "--autoCrop", args.autoCrop, "Encode only the bounding box of visible alpha across all mask frames. The crop position is written to <output>.crop\n" );
+
+   // A server takes its encode options from each request, so any given with it is an error
+   if ( serve )
+   {
+      for ( CLI::Option * option : app.get_options() )
+      {
+         if ( option != serve && option != app.get_help_ptr() )
+            serve->excludes( option );
+      }
+   }
+   return returnValue;
+}
+// Loads the encode API and initializes CUDA, once per process
+void InitializeApi()
+{
+   // Ensure we don't have critical version mismatch
+   uint32_t version = 0;
+   uint32_t currentVersion = (NVENCAPI_MAJOR_VERSION << 4) | NVENCAPI_MINOR_VERSION;
+   NVE_CHECK( NvEncodeAPIGetMaxSupportedVersion( &version ), "Failed retrieving driver version" );
+   if ( currentVersion > version )
+      ThrowNveErorr( NV_ENC_ERR_INVALID_VERSION, "Current driver version does not support this NvEncodeAPI version, please upgrade driver" );
+
+   // Get the functions as they are not explicitely dynamic in the shared objectc
+   NVE_CHECK( NvEncodeAPICreateInstance( &g_nv.functions ), "Failed getting NVidia encode functions" );
+   CUDA_CHECK( cuInit( 0 ) );
+}
+// The devices named by --devices, creating a CUDA context on any not opened before
+std::vector< Device * > OpenDevices( std::deque< Device > & devices )
+{
+   if ( args.devices.empty() )
+      args.devices.push_back( 0 );
+
+   std::vector< Device * > returnValue;
+   for ( int index : args.devices )
+   {
+      auto it = std::find_if( devices.begin(), devices.end(), [&]( const Device & device ) { return device.index == index; } );
+      if ( it == devices.end() )
+      {
+         devices.emplace_back();
+         Device & device = devices.back();
+         device.index = index;
+         CUdevice cudaDevice;
+         CUDA_CHECK( cuDeviceGet( &cudaDevice, index ) );
+         char name[ 256 ] = {};
+         CUDA_CHECK( cuDeviceGetName( name, sizeof(name), cudaDevice ) );
+         device.name = name;
+         CUDA_CHECK( cuCtxCreate( (CUcontext *)&device.cudaContext, 0, cudaDevice ) );
+         it = devices.end() - 1;
+      }
+
+      // Throughput is reported per run
+      it->frameCount = 0;
+      it->start = it->end = std::chrono::steady_clock::time_point();
+      returnValue.push_back( &*it );
+   }
+   return returnValue;
+}
+// Encodes the input described by 'args' and reports on it. Returns the exit code.
+int Encode( std::deque< Device > & allDevices,
+   Scheduler & scheduler )
+{
+   scheduler.jobs.clear();
+   scheduler.nextJob = 0;
+   scheduler.sequenceParams.clear();
+   {
+      std::lock_guard< std::mutex > lock( g_control.mutex );
+      g_control.generation = 0;
+      g_control.settings = RateControlChange();
+   }
+   g_nv.tuningInfo = NV_ENC_TUNING_INFO_HIGH_QUALITY;
+
+   // The stream takes stdout over, everything printed goes to stderr from here on
+   if ( args.outputFilename == "-" && !scheduler.keepWarm && g_streamOutput < 0 )
+   {
+      std::cout.flush();
+#ifdef _WIN32
+      g_streamOutput = _dup( 1 );
+      _dup2( 2, 1 );
+#else
+      g_streamOutput = dup( STDOUT_FILENO );
+      dup2( STDERR_FILENO, STDOUT_FILENO );
+#endif
+   }
+
+   std::vector< Device * > devices;
+   Nv12Geometry sourceGeometry;
+   Rect visibleRegion;
+   std::vector< int > sceneCuts;
+   try
+   {
+      devices = OpenDevices( allDevices );
+
+      // Mask clean-up happens before anything else looks at the mask
+      std::vector< MaskStep > maskSteps;
+      for ( const auto & step : args.maskFilters )
+         maskSteps.push_back( ParseMaskStep( step ) );
+      g_maskFilter = MaskFilter( maskSteps );
+      if ( !args.alphaTemporal.empty() )
+         TemporalAlphaFilter( args.alphaTemporal ); // Every job makes its own, check the setting once up front
+
+      // A mask holding more than one frame is a sequence that advances with the video,
+      // otherwise it is a still used for every frame
+      sourceGeometry = Nv12Geometry( args.width, args.height, g_nv.surfaceAlignment );
+      g_file.inputFrameCount = CountFrames( args.inputYuvFramesFilename, sourceGeometry );
+      g_file.maskFrameCount = CountFrames( args.maskFilename, sourceGeometry );
+      g_file.maskIsSequence = g_file.maskFrameCount >= 2;
+      g_file.timeStamps.clear();
+      if ( !args.timecodesFilename.empty() )
+      {
+         g_file.timeStamps = ReadTimecodes( args.timecodesFilename );
+         if ( int(g_file.timeStamps.size()) < g_file.inputFrameCount )
+            throw std::runtime_error( "The timecodes cover " + std::to_string( g_file.timeStamps.size() ) + " frames, the input has "
+               + std::to_string( g_file.inputFrameCount ) );
+      }
+
+      // Without explicit renditions we encode at the input size
+      if ( args.renditions.empty() )
+         args.renditions.push_back( std::to_string( args.width ) + "x" + std::to_string( args.height ) );
+      if ( args.bitrates.empty() )
+         args.bitrates.push_back( 0 );
+      for ( int bitrate : args.bitrates )
+      {
+         if ( bitrate < 0 )
+            throw std::runtime_error( "Bitrate must not be negative" );
+      }
+      if ( args.container != "265" && args.container != "mp4" && args.container != "mov" )
+         throw std::runtime_error( "Unknown container: " + args.container );
+
+      // A chunk opens a session for every rendition and bitrate at once, which the limit must allow
+      size_t sessionsPerJob = args.renditions.size() * args.bitrates.size();
+      if ( args.sessionLimit < 1 )
+         throw std::runtime_error( "Session limit must be at least 1" );
+      if ( sessionsPerJob > size_t(args.sessionLimit) )
+         throw std::runtime_error( "Every chunk needs " + std::to_string( sessionsPerJob ) + " sessions, one per rendition and bitrate, but --sessionLimit is "
+            + std::to_string( args.sessionLimit ) );
+      if ( args.fragment < 0 || (args.fragment > 0 && args.container != "mp4") )
+         throw std::runtime_error( "Fragmented output needs --container mp4 and a positive duration" );
+      if ( args.index && args.container != "265" )
+         throw std::runtime_error( "The frame index is for raw output, MP4 and MOV carry their own sample tables" );
+      if ( args.segment < 0 )
+         throw std::runtime_error( "Segment duration must be positive" );
+      if ( args.segment > 0 )
+      {
+         // Segments are finished as the encode goes, so they come from one chunk written in order
+         if ( args.outputFilename == "-" || args.fragment > 0 || args.index || args.splitLayers )
+            throw std::runtime_error( "Segmented output cannot go to stdout, or be combined with --fragment, --index or --splitLayers" );
+         if ( args.chunks > 1 || devices.size() > 1 )
+            throw std::runtime_error( "Segments are written while encoding, which needs a single chunk on a single device" );
+         args.chunks = 1;
+      }
+      if ( args.outputFilename == "-" )
+      {
+         // stdout carries exactly one stream, written in order by a single session
+         if ( scheduler.keepWarm )
+            throw std::runtime_error( "Output to stdout is not available when serving" );
+         if ( args.renditions.size() > 1 || args.bitrates.size() > 1 )
+            throw std::runtime_error( "Only one rendition and bitrate can be written to stdout" );
+         if ( args.chunks > 1 )
+            throw std::runtime_error( "Chunks are joined after encoding, they cannot be written to stdout" );
+         if ( args.index || args.paramSets || args.splitLayers || args.autoCrop || args.sceneCut > 0 )
+            throw std::runtime_error( "Sidecar files need a named output, not stdout" );
+         args.chunks = 1;
+      }
+      if ( IsPipe( OutputFilename( args.renditions[ 0 ], args.bitrates[ 0 ] ) ) && args.container != "265" && args.fragment == 0 )
+         throw std::runtime_error( "MP4 and MOV go back to fill in sizes, a pipe needs --fragment" );
+      if ( !args.latency.empty() )
+      {
+         if ( args.latency == "low" )
+            g_nv.tuningInfo = NV_ENC_TUNING_INFO_LOW_LATENCY;
+         else if ( args.latency == "ultra" )
+            g_nv.tuningInfo = NV_ENC_TUNING_INFO_ULTRA_LOW_LATENCY;
+         else
+            throw std::runtime_error( "Unknown latency mode: " + args.latency );
+         if ( args.lookahead > 0 )
+            throw std::runtime_error( "Lookahead delays output, it cannot be used with low latency" );
+      }
+
+      // Find the part of the source that is ever visible
+      Rect fullRegion = { 0, 0, sourceGeometry.encodeWidth, sourceGeometry.encodeHeight };
+      visibleRegion = fullRegion;
+      if ( args.autoCrop )
+      {
+         AlphaBounds bounds = ScanMaskBounds( sourceGeometry );
+         if ( bounds.Empty() )
+            std::cout << "Mask is fully transparent, cropping to the smallest picture the encoder supports" << std::endl;
+         visibleRegion = FitRegion( { bounds.left, bounds.top, bounds.right - bounds.left, bounds.bottom - bounds.top },
+            0, 0, fullRegion.width, fullRegion.height );
+      }
+
+      // By default every GPU gets one chunk. Chunks split the input evenly, a single job reads it all.
+      int chunks = (args.chunks > 0) ? args.chunks : int(devices.size());
+      chunks = std::max( 1, std::min( chunks, g_file.inputFrameCount ) );
+      std::vector< int > boundaries;
+      for ( int i = 0; i <= chunks; ++i )
+         boundaries.push_back( int(int64_t(g_file.inputFrameCount) * i / chunks) );
+
+      // Chunks start with an IDR anyway, so with scene cuts found up front each chunk moves
+      // to start at the nearest cut within half a chunk
+      if ( args.sceneCut > 0 && chunks > 1 )
+      {
+         sceneCuts = ScanSceneCuts( sourceGeometry );
+         int reach = g_file.inputFrameCount / chunks / 2;
+         for ( int i = 1; i < chunks; ++i )
+         {
+            int nearest = -1;
+            for ( int cut : sceneCuts )
+            {
+               int distance = std::abs( cut - boundaries[ i ] );
+               if ( cut > boundaries[ i - 1 ] && cut < boundaries[ i + 1 ] && distance <= reach
+                  && (nearest < 0 || distance < std::abs( nearest - boundaries[ i ] )) )
+                  nearest = cut;
+            }
+            if ( nearest >= 0 )
+               boundaries[ i ] = nearest;
+         }
+      }
+
+      for ( int i = 0; i < chunks; ++i )
+      {
+         scheduler.jobs.emplace_back( new EncodeJob );
+         EncodeJob & job = *scheduler.jobs.back();
+         job.firstFrame = boundaries[ i ];
+         job.frameCount = boundaries[ i + 1 ] - boundaries[ i ];
+         if ( chunks > 1 )
+            job.outputSuffix = ".part" + std::to_string( i );
+      }
+
+      // Parked jobs are only any use for the same settings, otherwise their sessions are freed
+      std::string key = JobKey( sourceGeometry, visibleRegion );
+      if ( key != scheduler.warmKey )
+      {
+         scheduler.warmJobs.clear();
+         scheduler.warmKey = key;
+      }
    }
    catch ( const std::runtime_error & e )
    {
@@ -542,96 +2308,425 @@ int main( int argc, char *argv[] )
       return 1;
    }
    
-   // Create the output file
-   std::string outputFilename = "outputWithTransparency.265";
-   g_file.outputVideo = CreateOutputFile( outputFilename );
-   
-   // For every frame
-   int inputFrameCount = 0, outputFrameCount = 0;
-   bool done = false;
-   struct encodeBuffer { MyNvBuffer input; MyNvBuffer alpha; NV_ENC_PIC_PARAMS picParams; };
-   std::deque< encodeBuffer > buffers;
-   while ( !done )
-   {
-      // Allocate and register an input buffer
-      try
+   // Every chunk needs a session per rendition and bitrate, so the session limit caps the chunks
+   // each GPU encodes at once. The rest wait for a worker to finish.
+   std::vector< std::thread > workers;
+   int sessionsPerJob = int(args.renditions.size() * args.bitrates.size());
+   int workersPerDevice = args.sessionLimit / sessionsPerJob;
+   workersPerDevice = std::min( workersPerDevice, int(scheduler.jobs.size()) );
+   for ( Device * device : devices )
+   {
+      for ( int i = 0; i < workersPerDevice; ++i )
+         workers.emplace_back( RunWorker, std::ref( scheduler ), std::ref( *device ), std::cref( sourceGeometry ), std::cref( visibleRegion ) );
+   }
+   for ( auto & worker : workers )
+      worker.join();
+
+   auto & jobs = scheduler.jobs;
+   bool failed = false;
+   for ( const auto & job : jobs )
+   {
+      if ( !job->error.empty() )
       {
-         // Input video frame
-         auto inputBuffer = LockInputBuffer( raii.nvEncoder,
-            raii.cudaContext,
-            args.width,
-            args.height );
-         if ( inputBuffer.inputResource.mappedResource == nullptr )
+         std::cout << job->error << std::endl;
+         failed = true;
+      }
+   }
+   if ( failed )
+   {
+      RemoveParts( jobs );
+      return 1;
+   }
+
+   if ( args.autoCrop )
+   {
+      for ( size_t r = 0; r < args.renditions.size(); ++r )
+      {
+         for ( int bitrate : args.bitrates )
+            WriteCropSidecar( jobs[ 0 ]->renditions[ r ], OutputFilename( args.renditions[ r ], bitrate ) );
+      }
+   }
+
+   // Cuts found while encoding, plus any a chunk was moved to start at
+   if ( args.sceneCut > 0 )
+   {
+      for ( const auto & job : jobs )
+         sceneCuts.insert( sceneCuts.end(), job->cuts.begin(), job->cuts.end() );
+      std::sort( sceneCuts.begin(), sceneCuts.end() );
+      sceneCuts.erase( std::unique( sceneCuts.begin(), sceneCuts.end() ), sceneCuts.end() );
+      std::cout << "Found " << sceneCuts.size() << " scene cuts" << std::endl;
+      for ( const auto & size : args.renditions )
+      {
+         for ( int bitrate : args.bitrates )
+            WriteCutsSidecar( sceneCuts, OutputFilename( size, bitrate ) );
+      }
+   }
+
+   // Totals per output across all chunks, joining chunk outputs in order
+   int inputFrameCount = 0;
+   for ( const auto & job : jobs )
+      inputFrameCount += job->inputFrameCount;
+   std::cout << "Processed " << inputFrameCount << " frames" << std::endl;
+   for ( size_t r = 0; r < args.renditions.size(); ++r )
+   {
+      for ( size_t s = 0; s < args.bitrates.size(); ++s )
+      {
+         int outputFrameCount = 0;
+         uint64_t outputBytes = 0, alphaBytes = 0;
+         std::vector< std::string > parts;
+         std::vector< const EncodeSession * > sessions;
+         std::vector< double > latencies, fragmentLatencies, writeStalls;
+         for ( auto & job : jobs )
+         {
+            const EncodeSession & session = job->renditions[ r ].sessions[ s ];
+            outputFrameCount += session.outputFrameCount;
+            outputBytes += session.outputBytes;
+            alphaBytes += session.alphaBytes;
+            parts.push_back( session.outputFilename );
+            sessions.push_back( &session );
+            latencies.insert( latencies.end(), session.latencies.begin(), session.latencies.end() );
+            fragmentLatencies.insert( fragmentLatencies.end(), session.fragmentLatencies.begin(), session.fragmentLatencies.end() );
+            writeStalls.insert( writeStalls.end(), session.writeStalls.begin(), session.writeStalls.end() );
+         }
+
+         std::string outputFilename = OutputFilename( args.renditions[ r ], args.bitrates[ s ] );
+         if ( jobs.size() > 1 )
          {
-            // TODO: handle end of stream
-            done = true;
+            try
+            {
+               if ( args.container != "265" )
+                  MuxParts( outputFilename, sessions, jobs[ 0 ]->renditions[ r ].geometry );
+               else
+                  StitchParts( outputFilename, parts );
+               if ( args.splitLayers )
+               {
+                  for ( const char * layer : { ".base.265", ".alpha.265" } )
+                  {
+                     std::vector< std::string > layerParts;
+                     for ( const auto & part : parts )
+                        layerParts.push_back( part + layer );
+                     StitchParts( outputFilename + layer, layerParts );
+                  }
+               }
+            }
+            catch ( const std::runtime_error & e )
+            {
+               std::cout << e.what() << std::endl;
+            }
+         }
 
-            // NV_ENC_PIC_PARAMS picParams = { NV_ENC_PIC_PARAMS_VER };
-            // picParams.encodePicFlags = NV_ENC_PIC_FLAG_EOS;
-            // nvEncEncodePicture(m_hEncoder, &picParams);
+         // One index over the joined stream, each part's entries moved past the parts before it
+         if ( args.index )
+         {
+            std::vector< FrameIndexEntry > frameIndex;
+            uint64_t offset = 0;
+            uint32_t frameIdx = 0;
+            for ( const EncodeSession * session : sessions )
+            {
+               for ( FrameIndexEntry entry : session->frameIndex )
+               {
+                  entry.offset += offset;
+                  entry.frameIdx += frameIdx;
+                  frameIndex.push_back( entry );
+               }
+               offset += session->outputBytes;
+               frameIdx += uint32_t(session->outputFrameCount);
+            }
+            try
+            {
+               WriteFrameIndex( ExpandTilde( outputFilename + ".idx" ), frameIndex, uint32_t(TimeScale()) );
+            }
+            catch ( const std::runtime_error & e )
+            {
+               std::cout << e.what() << std::endl;
+            }
+         }
 
-            break;
+         if ( args.paramSets && !sessions.empty() )
+         {
+            try
+            {
+               WriteParamsSidecar( sessions[ 0 ]->sequenceParams, outputFilename );
+            }
+            catch ( const std::runtime_error & e )
+            {
+               std::cout << e.what() << std::endl;
+            }
+         }
+
+         std::cout << "   wrote " << outputFrameCount << " to `" << outputFilename << "'" << std::endl;
+         if ( args.segment > 0 && !sessions.empty() && sessions[ 0 ]->playlist )
+            std::cout << "      " << sessions[ 0 ]->playlist->Size() << " segments listed in `" << outputFilename << ".m3u8'" << std::endl;
+         if ( g_useAlpha && outputFrameCount > 0 )
+         {
+            std::cout << "      alpha layer " << alphaBytes << " of " << outputBytes << " bytes ("
+               << (outputBytes ? 100.0 * alphaBytes / outputBytes : 0.0) << "%), "
+               << alphaBytes / outputFrameCount << " bytes per frame" << std::endl;
+         }
+         auto percentile = []( const std::vector< double > & sorted, double p ) { return sorted[ std::min( sorted.size() - 1, size_t(p / 100 * sorted.size()) ) ]; };
+         if ( !args.latency.empty() && !latencies.empty() )
+         {
+            std::sort( latencies.begin(), latencies.end() );
+            std::cout << "      latency p50 " << percentile( latencies, 50 ) << " ms, p95 " << percentile( latencies, 95 ) << " ms, p99 "
+               << percentile( latencies, 99 ) << " ms, max " << latencies.back() << " ms" << std::endl;
          }
 
-         // Input alpha mask
-         auto alphaBuffer = LockAlphaBuffer( raii.nvEncoder, 
-            raii.cudaContext,
-            inputBuffer );
-
-         // Output bitstream
-         auto outputBuffer = LockOutputBuffer( raii.nvEncoder,
-            inputBuffer,
-            g_nv.externalAlloc );
-
-         // Create a frame, tying all the data together
-         // TODO: WAS SETTING PITCH, but don't think I need to
-         NV_ENC_PIC_PARAMS picParams = { NV_ENC_PIC_PARAMS_VER, uint32_t(args.width), uint32_t(args.height) };
-         picParams.bufferFmt = g_nv.inputFormat;
-         picParams.pictureStruct = NV_ENC_PIC_STRUCT_FRAME;
-         picParams.inputBuffer = inputBuffer.inputResource.mappedResource;
-         picParams.alphaBuffer = alphaBuffer.inputResource.mappedResource;
-         picParams.outputBitstream = outputBuffer;
-
-         // Keep track of frames to handle encoder latency
-         buffers.push_back( {inputBuffer, alphaBuffer, picParams} );
-         
-         // Encode a frame
-         NVENCSTATUS nvStatus = (*g_nv.functions.nvEncEncodePicture)( raii.nvEncoder, &picParams );
-         
-         // If we don't need more input to get an output
-         if ( nvStatus != NV_ENC_ERR_NEED_MORE_INPUT )
+         // Frames whose retrieval waited on the disk because every output buffer was still queued
+         if ( !writeStalls.empty() )
          {
-            NVE_CHECK( nvStatus, "Failed to encode frame" );
+            size_t stalledFrames = size_t(std::count_if( writeStalls.begin(), writeStalls.end(), []( double stall ) { return stall > 0.01; } ));
+            std::sort( writeStalls.begin(), writeStalls.end() );
+            std::cout << "      write stalls on " << stalledFrames << " frames, total " << std::accumulate( writeStalls.begin(), writeStalls.end(), 0.0 )
+               << " ms, p99 " << percentile( writeStalls, 99 ) << " ms, max " << writeStalls.back() << " ms" << std::endl;
+         }
+
+         // How long content waits to be playable: from a fragment's first frame being read to the fragment being written
+         if ( !fragmentLatencies.empty() )
+         {
+            std::sort( fragmentLatencies.begin(), fragmentLatencies.end() );
+            std::cout << "      " << fragmentLatencies.size() << " fragments, available after p50 " << percentile( fragmentLatencies, 50 ) << " ms, p95 "
+               << percentile( fragmentLatencies, 95 ) << " ms, max " << fragmentLatencies.back() << " ms" << std::endl;
+         }
+      }
+   }
+
+   // Throughput of each GPU over the time it was busy
+   for ( const Device * device : devices )
+   {
+      double seconds = std::chrono::duration< double >( device->end - device->start ).count();
+      std::cout << "   GPU " << device->index << " (" << device->name << "): " << device->frameCount << " frames";
+      if ( device->frameCount > 0 && seconds > 0 )
+         std::cout << " in " << seconds << " s, " << device->frameCount / seconds << " fps";
+      std::cout << std::endl;
+   }
+
+
+   // Keep the finished jobs' sessions for the next request
+   if ( scheduler.keepWarm )
+   {
+      int reused = 0;
+      for ( auto & job : jobs )
+      {
+         reused += job->reused ? 1 : 0;
+         scheduler.warmJobs.push_back( std::move( job ) );
+      }
+      std::cout << "   " << reused << " of " << jobs.size() << " chunks reused warm sessions" << std::endl;
+      jobs.clear();
+   }
+
+   return 0;
+}
+// Devices outlive the jobs that share their contexts
+struct EncoderState
+{
+   ~EncoderState()
+   {
+      scheduler.jobs.clear();
+      scheduler.warmJobs.clear();
+      for ( auto & device : devices )
+      {
+         if ( device.cudaContext )
+            cuCtxDestroy( (CUcontext)device.cudaContext );
+      }
+   }
+
+   std::deque< Device > devices;
+   Scheduler scheduler;
+};
+#ifndef _WIN32
+// Reads one request: the client's working directory, then its command-line arguments,
+// one per line, up to an empty line
+bool ReadRequest( int client,
+   std::string & directory,
+   std::vector< std::string > & arguments )
+{
+   std::string request;
+   char buffer[ 4096 ];
+   while ( request.find( "\n\n" ) == std::string::npos )
+   {
+      ssize_t size = read( client, buffer, sizeof(buffer) );
+      if ( size <= 0 )
+         break;
+      request.append( buffer, size );
+   }
+
+   std::istringstream lines( request );
+   std::string line;
+   if ( !std::getline( lines, directory ) || directory.empty() )
+      return false;
+   while ( std::getline( lines, line ) && !line.empty() )
+      arguments.push_back( line );
+   return true;
+}
+// Only the user running the server may send it requests, they read and write files as that user
+bool SameUser( int client )
+{
+#ifdef SO_PEERCRED
+   ucred credentials = {};
+   socklen_t size = sizeof(credentials);
+   return getsockopt( client, SOL_SOCKET, SO_PEERCRED, &credentials, &size ) == 0 && credentials.uid == getuid();
+#else
+   return true; // The socket's 0600 mode is the only check
+#endif
+}
+// Encodes requests from a Unix socket one at a time, keeping the encode API, CUDA contexts
+// and sessions open between them. Each request's output is sent back to its client.
+int Serve( const std::string & socketPath )
+{
+   EncoderState state;
+   state.scheduler.keepWarm = true;
+   int server = -1;
+   std::string home; // Every request changes to its own directory, this is where to return
+   try
+   {
+      InitializeApi();
 
-            auto buffer = buffers.front();
-            buffers.pop_front();
+      char directory[ PATH_MAX ];
+      if ( !getcwd( directory, sizeof(directory) ) )
+         throw std::runtime_error( std::string( "Could not read the working directory: " ) + strerror( errno ) );
+      home = directory;
 
-            // Lock output buffer, append to file, unlock
-            NV_ENC_LOCK_BITSTREAM outBitstream = { NV_ENC_LOCK_BITSTREAM_VER }; outBitstream.outputBitstream = buffer.picParams.outputBitstream;
-            NVE_CHECK( (*g_nv.functions.nvEncLockBitstream)( raii.nvEncoder, &outBitstream ), "Failed locking the output bitstream" );
-            g_file.outputVideo.write( (char *)outBitstream.bitstreamBufferPtr, outBitstream.bitstreamSizeInBytes );
-            NVE_CHECK( (*g_nv.functions.nvEncUnlockBitstream)( raii.nvEncoder, outBitstream.outputBitstream ), "Failed unlocking the output bitstream" );
+      sockaddr_un address = {};
+      address.sun_family = AF_UNIX;
+      if ( socketPath.size() >= sizeof(address.sun_path) )
+         throw std::runtime_error( "Socket path is too long: " + socketPath );
+      strcpy( address.sun_path, socketPath.c_str() );
+      server = socket( AF_UNIX, SOCK_STREAM, 0 );
+      unlink( socketPath.c_str() );
 
-            // Unlock all buffers
-            UnlockOutputBuffer( raii.nvEncoder, buffer.picParams.outputBitstream );
-            UnlockAlphaBuffer( raii.nvEncoder, raii.cudaContext, buffer.alpha );
-            UnlockInputBuffer( raii.nvEncoder, raii.cudaContext, buffer.input );
+      // Created as 0600 from the start, so no other user can connect before it is restricted
+      mode_t mask = umask( 0177 );
+      bool listening = server >= 0 && bind( server, (sockaddr *)&address, sizeof(address) ) == 0 && listen( server, 16 ) == 0;
+      int error = errno;
+      umask( mask );
+      if ( !listening )
+         throw std::runtime_error( "Could not listen on " + socketPath + ": " + strerror( error ) );
+   }
+   catch ( const std::runtime_error & e )
+   {
+      std::cout << e.what() << std::endl;
+      return 1;
+   }
 
-            ++outputFrameCount;
+   // A client hanging up mid-request must not take the server down with it
+   signal( SIGPIPE, SIG_IGN );
+   std::cout << "Serving on " << socketPath << std::endl;
+   for ( ;; )
+   {
+      int client = accept( server, nullptr, nullptr );
+      if ( client < 0 )
+      {
+         // Out of descriptors or memory fails again straight away, so give it time to clear
+         if ( errno != EINTR && errno != ECONNABORTED )
+         {
+            std::cout << "Failed accepting a request: " << strerror( errno ) << std::endl;
+            std::this_thread::sleep_for( std::chrono::milliseconds( 100 ) );
          }
+         continue;
+      }
+      if ( !SameUser( client ) )
+      {
+         close( client );
+         continue;
+      }
 
-         ++inputFrameCount;
+      std::string directory;
+      std::vector< std::string > arguments;
+      if ( !ReadRequest( client, directory, arguments ) )
+      {
+         close( client );
+         continue;
       }
-      catch ( const std::runtime_error & e )
+
+      // Everything the encode prints goes to the client, with the exit code last
+      auto start = std::chrono::steady_clock::now();
+      std::cout.flush();
+      int console = dup( STDOUT_FILENO );
+      dup2( client, STDOUT_FILENO );
+      int exitCode = 1;
+      if ( chdir( directory.c_str() ) != 0 )
+         std::cout << "Could not change to " << directory << std::endl;
+      else
       {
-         std::cout << e.what() << std::endl;
+         args = Args();
+         CLI::App app{ "App description" };
+         AddOptions( app );
+         std::vector< char * > argv = { (char *)"nvenc_h265_transparency" };
+         for ( auto & argument : arguments )
+            argv.push_back( &argument[ 0 ] );
+         try
+         {
+            app.parse( int(argv.size()), argv.data() );
+            exitCode = Encode( state.devices, state.scheduler );
+         }
+         catch ( const CLI::ParseError & e )
+         {
+            std::cout << e.what() << "\n";
+            std::cout << app.help();
+         }
       }
+      std::cout << "exit " << exitCode << std::endl;
+      std::cout.clear();
+      dup2( console, STDOUT_FILENO );
+      close( console );
+      close( client );
+      if ( chdir( home.c_str() ) != 0 )
+         std::cout << "Could not change back to " << home << std::endl;
+
+      double seconds = std::chrono::duration< double >( std::chrono::steady_clock::now() - start ).count();
+      std::cout << "Request in " << directory << " finished with " << exitCode << " in " << seconds << " s" << std::endl;
    }
+}
+#endif
+int main( int argc, char *argv[] )
+{
+   // Process command-line arguments
+   CLI::App app{ "App description" };
+   std::string socketPath;
+   CLI::Option * serve = app.add_option( "--serve", socketPath, "Run as an encode server on this Unix socket, keeping the encode API, CUDA contexts and sessions open between requests. Each request brings its own options\n" );
+   std::vector< CLI::Option * > required = AddOptions( app, serve );
    
-   // TODO: Destroy alpha buffer!
-   // TODO: Frame count is 1 off (too high)
+   try
+   {
+      app.parse(argc, argv);
+      for ( CLI::Option * option : required )
+      {
+         if ( !*serve && !*option )
+            throw CLI::RequiredError( option->get_name() );
+      }
+   }
+   catch( const CLI::ParseError &e )
+   {
+      std::cout << e.what() << "\n";
+      std::cout << app.help();
+      return 1;
+   }
 
-   std::cout << "Processed " << inputFrameCount << " frames, wrote " << outputFrameCount << " to `" << outputFilename << "'" << std::endl;
+   // Serving takes no other options, every request brings its own
+   if ( *serve )
+   {
+#ifndef _WIN32
+      return Serve( socketPath );
+#else
+      std::cout << "Serving requires Unix sockets" << std::endl;
+      return 1;
+#endif
+   }
 
-   return 0;
+#ifndef _WIN32
+   // A reader closing the output pipe is reported as a failed write rather than ending the process
+   signal( SIGPIPE, SIG_IGN );
+#endif
+
+   EncoderState state;
+   try
+   {
+      InitializeApi();
+   }
+   catch ( const std::runtime_error & e )
+   {
+      std::cout << e.what() << std::endl;
+      return 1;
+   }
+   return Encode( state.devices, state.scheduler );
 }
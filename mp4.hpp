@@ -0,0 +1,715 @@
+// MP4 and QuickTime muxing of the two-layer HEVC stream, base picture plus alpha.
+// The encoder's Annex-B access units are written to mdat as they arrive, with length
+// prefixes in place of start codes. Sample tables are kept in memory and moov is written
+// at the end, so mdat is never read back. Both layers go in one HEVC track: the base
+// layer's parameter sets in hvcC, the alpha layer's in lhvC, and the 'oinf' and 'linf'
+// sample groups describe layer 1 as an alpha auxiliary picture layer.
+// Fragmented (CMAF) output instead writes moov as an init segment with the first sample,
+// then a moof and mdat for each fragment, so the file can be played while it is written.
+#pragma once
+
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <map>
+#include <numeric>
+#include <set>
+#include <stdexcept>
+#include <string>
+#include <vector>
+#include "writer.hpp"
+#include "nal.hpp"
+
+// Where one access unit of a raw stream ended up, for muxing it later
+struct AccessUnitInfo
+{
+   uint32_t size = 0;                             // Bytes of Annex-B
+   int64_t presentation = 0;                      // Presentation time, in the muxer's timescale
+   uint32_t duration = 0;                         // How long it is shown, in the same units
+};
+
+// What the decoder configuration records need from the base layer's SPS
+struct HevcSequenceInfo
+{
+   uint8_t profileTierLevel[ 12 ] = {};           // General profile, tier and level exactly as coded
+   int temporalLayers = 1;
+   bool temporalIdNested = true;
+   int chromaFormat = 1;
+   int bitDepthLuma = 8;
+   int bitDepthChroma = 8;
+};
+
+inline HevcSequenceInfo ParseSps( const NalUnit & sps )
+{
+   std::vector< uint8_t > rbsp = ExtractRbsp( sps );
+   if ( rbsp.size() < 13 )
+      throw std::runtime_error( "SPS is too short" );
+
+   HevcSequenceInfo returnValue;
+   int maxSubLayersMinus1 = (rbsp[ 0 ] >> 1) & 7;
+   returnValue.temporalLayers = maxSubLayersMinus1 + 1;
+   returnValue.temporalIdNested = rbsp[ 0 ] & 1;
+   memcpy( returnValue.profileTierLevel, &rbsp[ 1 ], 12 );
+
+   // Skip any sub-layer profile and level, then read up to the bit depths
+   BitReader reader( rbsp, 13 * 8 );
+   std::vector< bool > profilePresent( maxSubLayersMinus1 ), levelPresent( maxSubLayersMinus1 );
+   for ( int i = 0; i < maxSubLayersMinus1; ++i )
+   {
+      profilePresent[ i ] = reader.Bits( 1 );
+      levelPresent[ i ] = reader.Bits( 1 );
+   }
+   if ( maxSubLayersMinus1 > 0 )
+      reader.Bits( 2 * (8 - maxSubLayersMinus1) );
+   for ( int i = 0; i < maxSubLayersMinus1; ++i )
+   {
+      if ( profilePresent[ i ] )
+      {
+         reader.Bits( 32 );
+         reader.Bits( 32 );
+         reader.Bits( 24 );
+      }
+      if ( levelPresent[ i ] )
+         reader.Bits( 8 );
+   }
+   reader.Golomb();                               // sps_seq_parameter_set_id
+   returnValue.chromaFormat = int(reader.Golomb());
+   if ( returnValue.chromaFormat == 3 )
+      reader.Bits( 1 );
+   reader.Golomb();                               // Width and height
+   reader.Golomb();
+   if ( reader.Bits( 1 ) )
+   {
+      for ( int i = 0; i < 4; ++i )
+         reader.Golomb();
+   }
+   returnValue.bitDepthLuma = 8 + int(reader.Golomb());
+   returnValue.bitDepthChroma = 8 + int(reader.Golomb());
+   return returnValue;
+}
+
+// Builds ISO BMFF boxes in memory, big-endian throughout
+class BoxBuilder
+{
+public:
+   void Begin( const char * type )
+   {
+      _open.push_back( data.size() );
+      U32( 0 );
+      FourCc( type );
+   }
+   void BeginFull( const char * type, uint8_t version, uint32_t flags )
+   {
+      Begin( type );
+      U32( (uint32_t(version) << 24) | flags );
+   }
+   // Patches the size of the innermost open box
+   void End()
+   {
+      size_t start = _open.back();
+      _open.pop_back();
+      uint32_t size = uint32_t(data.size() - start);
+      for ( int i = 0; i < 4; ++i )
+         data[ start + i ] = uint8_t(size >> (24 - 8 * i));
+   }
+
+   void U8( uint32_t value ) { data.push_back( uint8_t(value) ); }
+   void U16( uint32_t value ) { U8( value >> 8 ); U8( value ); }
+   void U32( uint32_t value ) { U16( value >> 16 ); U16( value ); }
+   void U64( uint64_t value ) { U32( uint32_t(value >> 32) ); U32( uint32_t(value) ); }
+   void FourCc( const char * type ) { Bytes( (const uint8_t *)type, 4 ); }
+   void Bytes( const uint8_t * bytes, size_t size ) { data.insert( data.end(), bytes, bytes + size ); }
+   void Zeros( size_t count ) { data.insert( data.end(), count, 0 ); }
+
+   std::vector< uint8_t > data;
+
+private:
+   std::vector< size_t > _open;
+};
+
+class Mp4Writer
+{
+public:
+   // Samples are timed in units of 1 / 'timescale' seconds and usually last 'frameDuration' of them.
+   // With 'fragmentFrames' the output is fragmented, each fragment starting at the first sync
+   // sample after the previous one has that many frames.
+   Mp4Writer( AsyncFileWriter & file,
+      int width,
+      int height,
+      int timescale,
+      int frameDuration,
+      bool quickTime,
+      int fragmentFrames = 0 )
+      : _file( file ), _width( width ), _height( height ), _timescale( timescale ), _frameDuration( frameDuration ),
+        _quickTime( quickTime ), _fragmentFrames( fragmentFrames )
+   {
+      BoxBuilder header;
+      header.Begin( "ftyp" );
+      if ( _quickTime )
+      {
+         header.FourCc( "qt  " );
+         header.U32( 0x20050300 );
+         header.FourCc( "qt  " );
+      }
+      else if ( _fragmentFrames > 0 )
+      {
+         header.FourCc( "iso6" );
+         header.U32( 0 );
+         for ( const char * brand : { "iso6", "isom", "cmfc" } )
+            header.FourCc( brand );
+      }
+      else
+      {
+         header.FourCc( "isom" );
+         header.U32( 0x200 );
+         for ( const char * brand : { "isom", "iso6", "mp41" } )
+            header.FourCc( brand );
+      }
+      header.End();
+      if ( _fragmentFrames > 0 )
+      {
+         Write( header.data );
+         return;
+      }
+
+      // mdat takes a 64-bit size, filled in once everything is written
+      _mdatStart = header.data.size();
+      header.U32( 1 );
+      header.FourCc( "mdat" );
+      header.U64( 0 );
+      Write( header.data );
+   }
+
+   // Takes the parameter sets of both layers ahead of the first sample, as the encoder reports
+   // them once it is initialized. A fragmented output writes its init segment straight away.
+   void SetParameterSets( const uint8_t * data,
+      size_t size )
+   {
+      NalScanner scanner( data, size );
+      NalUnit nal;
+      while ( scanner.Next( nal ) )
+      {
+         int type = nal.Type();
+         if ( type >= kNalVps && type <= kNalPps )
+            _parameterSets[ type * 64 + nal.Layer() ].assign( nal.data, nal.data + nal.size );
+      }
+      if ( _fragmentFrames > 0 && !_initWritten )
+      {
+         Write( BuildMoov( SequenceInfo() ) );
+         _initWritten = true;
+         _file.Flush();
+      }
+   }
+
+   // Appends one access unit of Annex-B, both layers, shown at 'presentation' for 'duration' in
+   // timescale units. Parameter sets go to the sample entry, only ones that change along the way
+   // are also kept in the samples, or all of them when fragmented. Returns true if a fragment was
+   // written out before this sample.
+   bool WriteSample( const uint8_t * data,
+      size_t size,
+      int64_t presentation,
+      uint32_t duration )
+   {
+      _sample.clear();
+      bool sync = false;
+      bool inBand = _fragmentFrames > 0;
+      NalScanner scanner( data, size );
+      NalUnit nal;
+      while ( scanner.Next( nal ) )
+      {
+         int type = nal.Type();
+         if ( type >= kNalVps && type <= kNalPps )
+         {
+            std::vector< uint8_t > & stored = _parameterSets[ type * 64 + nal.Layer() ];
+            if ( stored.empty() )
+            {
+               stored.assign( nal.data, nal.data + nal.size );
+               if ( !inBand )
+                  continue;
+            }
+            else if ( stored.size() == nal.size && memcmp( stored.data(), nal.data, nal.size ) == 0 )
+            {
+               if ( !inBand )
+                  continue;
+            }
+            else
+               _inBand.insert( type * 64 + nal.Layer() );
+         }
+         if ( type >= kNalIrapFirst && type <= kNalIrapLast && nal.Layer() == 0 )
+            sync = true;
+
+         for ( int i = 0; i < 4; ++i )
+            _sample.push_back( uint8_t(nal.size >> (24 - 8 * i)) );
+         _sample.insert( _sample.end(), nal.data, nal.data + nal.size );
+      }
+
+      bool returnValue = false;
+      if ( _fragmentFrames > 0 )
+      {
+         // Without parameter sets up front, the init segment goes out once the first sample has brought them
+         if ( _fragmentCount == 0 && _sizes.empty() )
+            _firstPresentation = presentation;
+         if ( !_initWritten )
+         {
+            Write( BuildMoov( SequenceInfo() ) );
+            _initWritten = true;
+         }
+         if ( sync && int(_sizes.size()) >= _fragmentFrames )
+         {
+            WriteFragment();
+            returnValue = true;
+         }
+         _fragment.insert( _fragment.end(), _sample.begin(), _sample.end() );
+      }
+      else
+         Write( _sample );
+
+      _sizes.push_back( uint32_t(_sample.size()) );
+      _presentation.push_back( presentation );
+      _durations.push_back( duration );
+      if ( sync )
+         _syncSamples.push_back( uint32_t(_sizes.size()) );
+      return returnValue;
+   }
+
+   // Completes mdat and writes moov, or writes the last fragment. Nothing can be added afterwards.
+   void Finish()
+   {
+      HevcSequenceInfo info = SequenceInfo();
+      if ( _fragmentFrames > 0 )
+      {
+         if ( !_sizes.empty() )
+            WriteFragment();
+         return;
+      }
+
+      BoxBuilder size;
+      size.U64( _file.Position() - _mdatStart );
+      _file.WriteAt( _mdatStart + 8, size.data.data(), size.data.size() );
+      Write( BuildMoov( info ) );
+   }
+
+private:
+   void Write( const std::vector< uint8_t > & data )
+   {
+      _file.Write( data.data(), data.size() );
+   }
+
+   HevcSequenceInfo SequenceInfo()
+   {
+      auto it = _parameterSets.find( kNalSps * 64 );
+      if ( it == _parameterSets.end() )
+         throw std::runtime_error( "No sequence parameters were written, cannot finish the MP4" );
+      NalUnit sps = { it->second.data(), it->second.size() };
+      return ParseSps( sps );
+   }
+
+   // Samples are decoded one after another, each for as long as the frame shown in its place,
+   // so a reordered sample's decode time is that of the frame it displaces in display order
+   std::vector< uint32_t > DecodeDurations() const
+   {
+      std::vector< size_t > order( _presentation.size() );
+      std::iota( order.begin(), order.end(), size_t(0) );
+      std::stable_sort( order.begin(), order.end(), [this]( size_t a, size_t b ) { return _presentation[ a ] < _presentation[ b ]; } );
+      std::vector< uint32_t > returnValue;
+      for ( size_t i : order )
+         returnValue.push_back( _durations[ i ] );
+      return returnValue;
+   }
+
+   // Writes the samples gathered since the last fragment as a moof and mdat, and queues them
+   // for writing straight away so a reader following the file sees the whole fragment
+   void WriteFragment()
+   {
+      std::vector< uint32_t > durations = DecodeDurations();
+      bool uniform = std::all_of( durations.begin(), durations.end(), [this]( uint32_t d ) { return d == uint32_t(_frameDuration); } );
+
+      BoxBuilder box;
+      box.Begin( "moof" );
+      box.BeginFull( "mfhd", 0, 0 );
+      box.U32( ++_fragmentCount );
+      box.End();
+      box.Begin( "traf" );
+      box.BeginFull( "tfhd", 0, 0x020008 );      // Offsets from moof, default duration
+      box.U32( 1 );
+      box.U32( _frameDuration );
+      box.End();
+      box.BeginFull( "tfdt", 1, 0 );
+      box.U64( uint64_t(_decodeTime) );
+      box.End();
+
+      // Signed composition offsets put the first sample's presentation at zero without an edit list.
+      // Durations are only listed when they differ from the default.
+      box.BeginFull( "trun", 1, uniform ? 0x000e01 : 0x000f01 ); // Data offset, per sample duration, size, flags and offset
+      box.U32( uint32_t(_sizes.size()) );
+      size_t dataOffset = box.data.size();
+      box.U32( 0 );
+      size_t sync = 0;
+      int64_t decodeTime = _decodeTime;
+      for ( size_t i = 0; i < _sizes.size(); ++i )
+      {
+         bool isSync = sync < _syncSamples.size() && _syncSamples[ sync ] == i + 1;
+         sync += isSync ? 1 : 0;
+         if ( !uniform )
+            box.U32( durations[ i ] );
+         box.U32( _sizes[ i ] );
+         box.U32( isSync ? 0x02000000 : 0x01010000 );
+         box.U32( uint32_t(int32_t(_presentation[ i ] - _firstPresentation - decodeTime)) );
+         decodeTime += durations[ i ];
+      }
+      box.End();
+      box.End();                                  // traf
+      box.End();                                  // moof
+
+      uint32_t offset = uint32_t(box.data.size() + 8);
+      for ( int i = 0; i < 4; ++i )
+         box.data[ dataOffset + i ] = uint8_t(offset >> (24 - 8 * i));
+      box.U32( uint32_t(_fragment.size() + 8) );
+      box.FourCc( "mdat" );
+      Write( box.data );
+      Write( _fragment );
+      _file.Flush();
+
+      _decodeTime = decodeTime;
+      _fragment.clear();
+      _sizes.clear();
+      _presentation.clear();
+      _durations.clear();
+      _syncSamples.clear();
+   }
+
+   // Parameter set arrays of one layer, as hvcC and lhvC share them
+   void WriteArrays( BoxBuilder & box, int layer, std::initializer_list< int > types )
+   {
+      std::vector< int > present;
+      for ( int type : types )
+      {
+         if ( _parameterSets.count( type * 64 + layer ) )
+            present.push_back( type );
+      }
+      box.U8( uint32_t(present.size()) );
+      for ( int type : present )
+      {
+         const std::vector< uint8_t > & nal = _parameterSets[ type * 64 + layer ];
+         box.U8( (_fragmentFrames > 0 || _inBand.count( type * 64 + layer ) ? 0 : 0x80) | type );
+         box.U16( 1 );
+         box.U16( uint32_t(nal.size()) );
+         box.Bytes( nal.data(), nal.size() );
+      }
+   }
+
+   std::vector< uint8_t > BuildMoov( const HevcSequenceInfo & info )
+   {
+      bool alpha = _parameterSets.count( kNalSps * 64 + 1 ) > 0;
+      uint32_t sampleCount = uint32_t(_sizes.size());
+      std::vector< uint32_t > durations = DecodeDurations();
+      uint64_t duration = std::accumulate( durations.begin(), durations.end(), uint64_t(0) );
+
+      // Decode order is sample order. Reordered samples get composition offsets, shifted to be
+      // non-negative and taken back out by an edit list.
+      int64_t first = sampleCount ? *std::min_element( _presentation.begin(), _presentation.end() ) : 0;
+      int64_t shift = 0;
+      bool reordered = false;
+      std::vector< int64_t > offsets;
+      int64_t decodeTime = 0;
+      for ( uint32_t i = 0; i < sampleCount; ++i )
+      {
+         offsets.push_back( _presentation[ i ] - first - decodeTime );
+         decodeTime += durations[ i ];
+         shift = std::min( shift, offsets.back() );
+         reordered = reordered || offsets.back() != 0;
+      }
+
+      BoxBuilder box;
+      box.Begin( "moov" );
+
+      box.BeginFull( "mvhd", 1, 0 );
+      box.U64( 0 );
+      box.U64( 0 );
+      box.U32( _timescale );
+      box.U64( duration );
+      box.U32( 0x00010000 );                      // Rate 1.0
+      box.U16( 0x0100 );                          // Volume 1.0
+      box.Zeros( 10 );
+      WriteMatrix( box );
+      box.Zeros( 24 );
+      box.U32( 2 );                               // Next track ID
+      box.End();
+
+      box.Begin( "trak" );
+      box.BeginFull( "tkhd", 1, 3 );              // Enabled, in movie
+      box.U64( 0 );
+      box.U64( 0 );
+      box.U32( 1 );
+      box.U32( 0 );
+      box.U64( duration );
+      box.Zeros( 8 );
+      box.U16( 0 );                               // Layer
+      box.U16( 0 );                               // Alternate group
+      box.U16( 0 );                               // Volume
+      box.U16( 0 );
+      WriteMatrix( box );
+      box.U32( uint32_t(_width) << 16 );
+      box.U32( uint32_t(_height) << 16 );
+      box.End();
+
+      if ( reordered && shift != 0 )
+      {
+         box.Begin( "edts" );
+         box.BeginFull( "elst", 1, 0 );
+         box.U32( 1 );
+         box.U64( duration );
+         box.U64( uint64_t(-shift) );
+         box.U32( 0x00010000 );
+         box.End();
+         box.End();
+      }
+
+      box.Begin( "mdia" );
+      box.BeginFull( "mdhd", 1, 0 );
+      box.U64( 0 );
+      box.U64( 0 );
+      box.U32( _timescale );
+      box.U64( duration );
+      box.U16( 0x55c4 );                          // 'und'
+      box.U16( 0 );
+      box.End();
+      box.BeginFull( "hdlr", 0, 0 );
+      box.FourCc( _quickTime ? "mhlr" : "\0\0\0\0" );
+      box.FourCc( "vide" );
+      box.Zeros( 12 );
+      box.U8( 0 );                                // Empty name, also an empty counted string for QuickTime
+      box.End();
+
+      box.Begin( "minf" );
+      box.BeginFull( "vmhd", 0, 1 );
+      box.Zeros( 8 );
+      box.End();
+      box.Begin( "dinf" );
+      box.BeginFull( "dref", 0, 0 );
+      box.U32( 1 );
+      box.BeginFull( "url ", 0, 1 );              // Media is in this file
+      box.End();
+      box.End();
+      box.End();
+
+      box.Begin( "stbl" );
+      WriteSampleEntry( box, info, alpha );
+
+      std::vector< std::pair< uint32_t, uint32_t > > runs;
+      for ( uint32_t sampleDuration : durations )
+      {
+         if ( runs.empty() || runs.back().second != sampleDuration )
+            runs.push_back( { 0, sampleDuration } );
+         ++runs.back().first;
+      }
+      box.BeginFull( "stts", 0, 0 );
+      box.U32( uint32_t(runs.size()) );
+      for ( const auto & run : runs )
+      {
+         box.U32( run.first );
+         box.U32( run.second );
+      }
+      box.End();
+
+      if ( reordered )
+      {
+         runs.clear();
+         for ( uint32_t i = 0; i < sampleCount; ++i )
+         {
+            uint32_t offset = uint32_t(offsets[ i ] - shift);
+            if ( runs.empty() || runs.back().second != offset )
+               runs.push_back( { 0, offset } );
+            ++runs.back().first;
+         }
+         box.BeginFull( "ctts", 0, 0 );
+         box.U32( uint32_t(runs.size()) );
+         for ( const auto & run : runs )
+         {
+            box.U32( run.first );
+            box.U32( run.second );
+         }
+         box.End();
+      }
+
+      if ( _fragmentFrames == 0 )
+      {
+         box.BeginFull( "stss", 0, 0 );
+         box.U32( uint32_t(_syncSamples.size()) );
+         for ( uint32_t sample : _syncSamples )
+            box.U32( sample );
+         box.End();
+      }
+
+      // Every sample is in one chunk, contiguous in mdat
+      box.BeginFull( "stsc", 0, 0 );
+      box.U32( sampleCount ? 1 : 0 );
+      if ( sampleCount )
+      {
+         box.U32( 1 );
+         box.U32( sampleCount );
+         box.U32( 1 );
+      }
+      box.End();
+      box.BeginFull( "stsz", 0, 0 );
+      box.U32( 0 );
+      box.U32( sampleCount );
+      for ( uint32_t size : _sizes )
+         box.U32( size );
+      box.End();
+      box.BeginFull( "co64", 0, 0 );
+      box.U32( sampleCount ? 1 : 0 );
+      if ( sampleCount )
+         box.U64( _mdatStart + 16 );
+      box.End();
+
+      if ( alpha )
+         WriteLayerGroups( box, info );
+
+      box.End();                                  // stbl
+      box.End();                                  // minf
+      box.End();                                  // mdia
+      box.End();                                  // trak
+
+      if ( _fragmentFrames > 0 )
+      {
+         box.Begin( "mvex" );
+         box.BeginFull( "trex", 0, 0 );
+         box.U32( 1 );
+         box.U32( 1 );                            // Sample description
+         box.Zeros( 12 );                         // Defaults all come from each fragment
+         box.End();
+         box.End();
+      }
+      box.End();                                  // moov
+      return box.data;
+   }
+
+   void WriteMatrix( BoxBuilder & box )
+   {
+      for ( uint32_t value : { 0x00010000u, 0u, 0u, 0u, 0x00010000u, 0u, 0u, 0u, 0x40000000u } )
+         box.U32( value );
+   }
+
+   void WriteSampleEntry( BoxBuilder & box, const HevcSequenceInfo & info, bool alpha )
+   {
+      box.BeginFull( "stsd", 0, 0 );
+      box.U32( 1 );
+      // Parameter sets in the samples need 'hev1', 'hvc1' promises they are all in the sample entry
+      box.Begin( (_fragmentFrames > 0 || !_inBand.empty()) ? "hev1" : "hvc1" );
+      box.Zeros( 6 );
+      box.U16( 1 );                               // Data reference index
+      box.Zeros( 16 );
+      box.U16( uint32_t(_width) );
+      box.U16( uint32_t(_height) );
+      box.U32( 0x00480000 );                      // 72 dpi
+      box.U32( 0x00480000 );
+      box.U32( 0 );
+      box.U16( 1 );                               // Frames per sample
+      uint8_t compressor[ 32 ] = { 4, 'H', 'E', 'V', 'C' };
+      box.Bytes( compressor, sizeof( compressor ) );
+      box.U16( alpha ? 0x20 : 0x18 );             // Depth, 32 tells QuickTime there is alpha
+      box.U16( 0xffff );
+
+      uint32_t lengthAndLayers = (uint32_t(info.temporalLayers) << 3) | (info.temporalIdNested ? 4 : 0) | 3;
+      box.Begin( "hvcC" );
+      box.U8( 1 );
+      box.Bytes( info.profileTierLevel, sizeof( info.profileTierLevel ) );
+      box.U16( 0xf000 );
+      box.U8( 0xfc );
+      box.U8( 0xfc | info.chromaFormat );
+      box.U8( 0xf8 | (info.bitDepthLuma - 8) );
+      box.U8( 0xf8 | (info.bitDepthChroma - 8) );
+      box.U16( 0 );                               // Frame rate unspecified
+      box.U8( lengthAndLayers );
+      WriteArrays( box, 0, { kNalVps, kNalSps, kNalPps } );
+      box.End();
+
+      if ( alpha )
+      {
+         box.Begin( "lhvC" );
+         box.U8( 1 );
+         box.U16( 0xf000 );
+         box.U8( 0xfc );
+         box.U8( 0xc0 | lengthAndLayers );
+         WriteArrays( box, 1, { kNalSps, kNalPps } );
+         box.End();
+      }
+
+      box.End();                                  // hvc1 or hev1
+      box.End();                                  // stsd
+   }
+
+   // 'oinf' and 'linf' sample groups for every sample, by default rather than mapped per sample
+   void WriteLayerGroups( BoxBuilder & box, const HevcSequenceInfo & info )
+   {
+      BoxBuilder entry;
+      entry.U16( 0x8000 >> 3 );                   // Scalability mask: AuxId
+      entry.U8( 1 );                              // One profile, tier and level, shared by both layers
+      entry.Bytes( info.profileTierLevel, sizeof( info.profileTierLevel ) );
+      entry.U16( 2 );                             // Operating points: the picture alone, then with its alpha
+      for ( uint32_t layers = 1; layers <= 2; ++layers )
+      {
+         entry.U16( layers - 1 );                 // Output layer set
+         entry.U8( uint32_t(info.temporalLayers - 1) );
+         entry.U8( layers );
+         for ( uint32_t layer = 0; layer < layers; ++layer )
+         {
+            entry.U8( 0 );
+            entry.U8( (layer << 2) | 2 );         // Output layer
+         }
+         entry.U16( uint32_t(_width) );
+         entry.U16( uint32_t(_height) );
+         entry.U16( uint32_t(_width) );
+         entry.U16( uint32_t(_height) );
+         entry.U8( (uint32_t(info.chromaFormat) << 6) | (uint32_t(std::max( info.bitDepthLuma, info.bitDepthChroma ) - 8) << 3) );
+      }
+      entry.U8( 2 );                              // Layers, with their AuxId
+      for ( uint32_t layer = 0; layer < 2; ++layer )
+      {
+         entry.U8( layer );
+         entry.U8( 0 );                           // No inter-layer prediction
+         entry.U8( layer );                       // 1 is AUX_ALPHA
+      }
+      WriteGroupDescription( box, "oinf", entry.data );
+
+      entry.data.clear();
+      entry.U8( 2 );
+      for ( uint32_t layer = 0; layer < 2; ++layer )
+      {
+         entry.U16( (layer << 6) | uint32_t(info.temporalLayers - 1) );
+         entry.U8( 0 );
+      }
+      WriteGroupDescription( box, "linf", entry.data );
+   }
+
+   void WriteGroupDescription( BoxBuilder & box, const char * groupingType, const std::vector< uint8_t > & entry )
+   {
+      box.BeginFull( "sgpd", 2, 0 );
+      box.FourCc( groupingType );
+      box.U32( uint32_t(entry.size()) );
+      box.U32( 1 );                               // Default for samples without a mapping
+      box.U32( 1 );
+      box.Bytes( entry.data(), entry.size() );
+      box.End();
+   }
+
+   AsyncFileWriter & _file;
+   int _width = 0, _height = 0;
+   int _timescale = 0, _frameDuration = 0;
+   bool _quickTime = false;
+   int _fragmentFrames = 0;
+   uint32_t _fragmentCount = 0;
+   int64_t _decodeTime = 0;                       // Duration of earlier fragments
+   int64_t _firstPresentation = 0;
+   bool _initWritten = false;                     // Fragmented init segment
+   std::vector< uint8_t > _fragment;              // Sample data of the current fragment
+   uint64_t _mdatStart = 0;
+   std::map< int, std::vector< uint8_t > > _parameterSets; // First of each, keyed by NAL type * 64 + layer
+   std::set< int > _inBand;                      // Parameter sets that changed, so the samples carry them too
+   std::vector< uint8_t > _sample;                // Length prefixed NAL units of the current sample
+   std::vector< uint32_t > _sizes;                // Every sample, or those of the current fragment
+   std::vector< int64_t > _presentation;          // Presentation time of each sample
+   std::vector< uint32_t > _durations;            // How long each sample is shown
+   std::vector< uint32_t > _syncSamples;          // 1-based
+};
@@ -0,0 +1,265 @@
+// HEVC NAL unit scanning over Annex-B byte streams.
+// The scanner never copies: each NAL unit is a pointer into the caller's buffer. Start codes
+// are found 16 bytes at a time (SSE2 when available) by matching zero, zero, one at three
+// offsets at once. The two-layer stream the encoder writes can be split into separate base
+// and alpha elementary streams on the fly.
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+#include <algorithm>
+#include <stdexcept>
+#include <vector>
+#include "writer.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64)
+   #include <emmintrin.h>
+   #define NAL_USE_SSE2 1
+   #ifdef _MSC_VER
+      #include <intrin.h>
+   #endif
+#endif
+
+// One NAL unit of an Annex-B stream, without its start code
+struct NalUnit
+{
+   const uint8_t * data = nullptr;
+   size_t size = 0;
+
+   int Type() const { return (data[ 0 ] >> 1) & 0x3f; }
+   int Layer() const { return ((data[ 0 ] & 1) << 5) | (data[ 1 ] >> 3); }
+};
+
+enum HevcNalType
+{
+   kNalIrapFirst = 16,                            // BLA, IDR and CRA pictures
+   kNalIdrWithLeading = 19,
+   kNalIdrNoLeading = 20,
+   kNalCra = 21,
+   kNalIrapLast = 21,
+   kNalIrapReservedLast = 23,
+   kNalVclLast = 31,
+   kNalVps = 32,
+   kNalSps = 33,
+   kNalPps = 34,
+   kNalSeiPrefix = 39,
+   kNalSeiSuffix = 40
+};
+
+// Coarse kinds of NAL unit, for statistics
+enum NalCategory
+{
+   kNalCategoryVcl,
+   kNalCategoryParameterSet,
+   kNalCategorySei,
+   kNalCategoryOther,
+   kNalCategoryCount
+};
+
+inline NalCategory CategorizeNal( int type )
+{
+   if ( type <= kNalVclLast )
+      return kNalCategoryVcl;
+   if ( type >= kNalVps && type <= kNalPps )
+      return kNalCategoryParameterSet;
+   if ( type == kNalSeiPrefix || type == kNalSeiSuffix )
+      return kNalCategorySei;
+   return kNalCategoryOther;
+}
+
+// The payload of a NAL unit after its two byte header, emulation prevention bytes removed.
+// 'limit' stops early, for when only the start of a slice is read.
+inline std::vector< uint8_t > ExtractRbsp( const NalUnit & nal,
+   size_t limit = SIZE_MAX )
+{
+   std::vector< uint8_t > returnValue;
+   for ( size_t i = 2; i < nal.size && returnValue.size() < limit; ++i )
+   {
+      if ( i >= 4 && nal.data[ i ] == 3 && nal.data[ i - 1 ] == 0 && nal.data[ i - 2 ] == 0 )
+         continue;
+      returnValue.push_back( nal.data[ i ] );
+   }
+   return returnValue;
+}
+
+// Reads exp-Golomb and fixed-width fields from an RBSP
+class BitReader
+{
+public:
+   BitReader( const std::vector< uint8_t > & data, size_t bit ) : _data( data ), _bit( bit ) {}
+
+   uint32_t Bits( int count )
+   {
+      uint32_t returnValue = 0;
+      for ( int i = 0; i < count; ++i, ++_bit )
+      {
+         if ( _bit / 8 >= _data.size() )
+            throw std::runtime_error( "NAL unit ended early" );
+         returnValue = (returnValue << 1) | ((_data[ _bit / 8 ] >> (7 - _bit % 8)) & 1);
+      }
+      return returnValue;
+   }
+
+   uint32_t Golomb()
+   {
+      int zeros = 0;
+      while ( Bits( 1 ) == 0 )
+      {
+         if ( ++zeros > 31 )
+            throw std::runtime_error( "Bad exp-Golomb code" );
+      }
+      return (uint32_t(1) << zeros) - 1 + Bits( zeros );
+   }
+
+   void Skip( size_t count ) { _bit += count; }
+   bool ByteAligned() const { return _bit % 8 == 0; }
+
+private:
+   const std::vector< uint8_t > & _data;
+   size_t _bit = 0;
+};
+
+// Finds the next 00 00 01 at or after 'data'. Returns 'end' when there is none.
+inline const uint8_t * FindStartCode( const uint8_t * data,
+   const uint8_t * end )
+{
+   const uint8_t * p = data;
+
+#ifdef NAL_USE_SSE2
+   const __m128i zero = _mm_setzero_si128();
+   const __m128i one = _mm_set1_epi8( 1 );
+   for ( ; end - p >= 18; p += 16 )
+   {
+      __m128i a = _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i *)p ), zero );
+      __m128i b = _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i *)(p + 1) ), zero );
+      __m128i c = _mm_cmpeq_epi8( _mm_loadu_si128( (const __m128i *)(p + 2) ), one );
+      unsigned mask = unsigned(_mm_movemask_epi8( _mm_and_si128( _mm_and_si128( a, b ), c ) ));
+      if ( mask )
+      {
+#ifdef _MSC_VER
+         unsigned long index;
+         _BitScanForward( &index, mask );
+         return p + index;
+#else
+         return p + __builtin_ctz( mask );
+#endif
+      }
+   }
+#endif
+
+   for ( ; end - p >= 3; ++p )
+   {
+      if ( p[ 0 ] == 0 && p[ 1 ] == 0 && p[ 2 ] == 1 )
+         return p;
+   }
+   return end;
+}
+
+// Walks the NAL units of an Annex-B buffer in place. Zero bytes before a start code belong
+// to it, and anything before the first start code is skipped.
+class NalScanner
+{
+public:
+   NalScanner( const uint8_t * data, size_t size ) : _end( data + size )
+   {
+      const uint8_t * first = FindStartCode( data, _end );
+      _next = (first == _end) ? _end : first + 3;
+   }
+
+   bool Next( NalUnit & nal )
+   {
+      while ( _next < _end )
+      {
+         const uint8_t * start = _next;
+         const uint8_t * stop = FindStartCode( start, _end );
+         _next = (stop == _end) ? _end : stop + 3;
+         while ( stop > start && stop[ -1 ] == 0 )
+            --stop;
+         if ( stop - start >= 2 )
+         {
+            nal.data = start;
+            nal.size = size_t(stop - start);
+            return true;
+         }
+      }
+      return false;
+   }
+
+private:
+   const uint8_t * _next = nullptr;
+   const uint8_t * _end = nullptr;
+};
+
+// NAL units and bytes per layer and category
+struct NalStatistics
+{
+   uint64_t count[ 2 ][ kNalCategoryCount ] = {};
+   uint64_t bytes[ 2 ][ kNalCategoryCount ] = {};
+
+   void Add( const NalUnit & nal )
+   {
+      int layer = std::min( nal.Layer(), 1 );
+      NalCategory category = CategorizeNal( nal.Type() );
+      ++count[ layer ][ category ];
+      bytes[ layer ][ category ] += nal.size;
+   }
+};
+
+// Writes the base and alpha layers of the encoder's output as two elementary streams.
+// Both get the VPS. Alpha NAL units keep nuh_layer_id 1: a layer 1 SPS and slice header
+// have extension syntax that a layer 0 one doesn't, so relabeling them would misparse.
+// An alpha SPS in multi-layer extension syntax takes its profile, size and more from the
+// base layer's VPS entries, so its stream is refused rather than written half usable.
+class LayerSplitter
+{
+public:
+   LayerSplitter( AsyncFileWriter & base, AsyncFileWriter & alpha ) : _base( base ), _alpha( alpha ) {}
+
+   // Throws if the stream, or the parameter sets ahead of it, can't be split
+   static void Check( const uint8_t * data, size_t size )
+   {
+      NalScanner scanner( data, size );
+      NalUnit nal;
+      while ( scanner.Next( nal ) )
+         Check( nal );
+   }
+
+   void Write( const uint8_t * data, size_t size )
+   {
+      NalScanner scanner( data, size );
+      NalUnit nal;
+      while ( scanner.Next( nal ) )
+      {
+         Check( nal );
+         statistics.Add( nal );
+         if ( nal.Layer() == 0 )
+         {
+            Emit( _base, nal );
+            if ( nal.Type() == kNalVps )
+               Emit( _alpha, nal );
+         }
+         else
+            Emit( _alpha, nal );
+      }
+   }
+
+   NalStatistics statistics;
+
+private:
+   // sps_ext_or_max_sub_layers_minus1 of 7 follows the 4-bit VPS id
+   static void Check( const NalUnit & nal )
+   {
+      if ( nal.Type() == kNalSps && nal.Layer() > 0 && nal.size > 2 && ((nal.data[ 2 ] >> 1) & 7) == 7 )
+         throw std::runtime_error( "The alpha layer's SPS uses multi-layer extension syntax, which depends on the base layer, so the layers can't be split into standalone streams" );
+   }
+
+   static void Emit( AsyncFileWriter & output, const NalUnit & nal )
+   {
+      static const uint8_t startCode[] = { 0, 0, 0, 1 };
+      output.Write( startCode, sizeof( startCode ) );
+      output.Write( nal.data, nal.size );
+   }
+
+   AsyncFileWriter & _base;
+   AsyncFileWriter & _alpha;
+};
@@ -0,0 +1,81 @@
+// HLS-style media playlist of the segments a long encode rolls over to. Only finished segments
+// are listed, so a worker following the playlist can take each one as soon as it appears.
+// The playlist is written whole to a temporary file and renamed over the old one, which
+// readers see as a single change rather than a half-written file. It stays an EVENT playlist
+// with a fixed target duration throughout, as HLS requires of a playlist that is followed.
+#pragma once
+
+#include <cmath>
+#include <cstdio>
+#include <fstream>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+class SegmentPlaylist
+{
+public:
+   // 'targetSeconds' is the longest a segment can last, so no segment ever exceeds the target
+   SegmentPlaylist( const std::string & filename,
+      double targetSeconds )
+      : _filename( filename ), _targetDuration( int(std::ceil( targetSeconds )) )
+   {
+      Write();
+   }
+
+   // Lists a finished segment, named relative to the playlist
+   void Add( const std::string & uri,
+      double seconds )
+   {
+      _segments.push_back( { uri, seconds } );
+      Write();
+   }
+
+   // Marks the list complete, no more segments follow
+   void Finish()
+   {
+      _ended = true;
+      Write();
+   }
+
+   size_t Size() const { return _segments.size(); }
+
+private:
+   struct Segment
+   {
+      std::string uri;
+      double seconds = 0;
+   };
+
+   void Write() const
+   {
+      std::stringstream ss;
+      ss << "#EXTM3U\n#EXT-X-VERSION:3\n#EXT-X-TARGETDURATION:" << _targetDuration
+         << "\n#EXT-X-MEDIA-SEQUENCE:0\n#EXT-X-PLAYLIST-TYPE:EVENT\n";
+      ss.precision( 6 );
+      ss << std::fixed;
+      for ( const auto & segment : _segments )
+         ss << "#EXTINF:" << segment.seconds << ",\n" << segment.uri << "\n";
+      if ( _ended )
+         ss << "#EXT-X-ENDLIST\n";
+
+      std::string temporary = _filename + ".tmp";
+      {
+         std::ofstream file( temporary, std::ios::binary );
+         file << ss.str();
+         if ( !file.good() )
+            throw std::runtime_error( "Failed writing playlist " + temporary );
+      }
+#ifdef _WIN32
+      std::remove( _filename.c_str() );          // rename doesn't replace on Windows
+#endif
+      if ( std::rename( temporary.c_str(), _filename.c_str() ) != 0 )
+         throw std::runtime_error( "Could not replace playlist " + _filename );
+   }
+
+   std::string _filename;
+   const int _targetDuration;
+   bool _ended = false;
+   std::vector< Segment > _segments;
+};
@@ -0,0 +1,270 @@
+// Separable CPU resampler used to produce several renditions from one source frame.
+// Filtering is done in two passes: a vertical pass (SSE2 when available) into a 16-bit
+// intermediate row, followed by a horizontal pass into the destination. Output rows are
+// split into bands that are processed on separate threads.
+#pragma once
+
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+#include <vector>
+#include <stdexcept>
+#include "utility.hpp"
+
+#if defined(__SSE2__) || defined(_M_X64)
+   #include <emmintrin.h>
+   #define SCALER_USE_SSE2 1
+#endif
+
+enum class ScaleFilter
+{
+   Area,    // Box filter weighted by pixel coverage, best for downscaling
+   Bicubic  // Keys cubic (a = -0.5), widened by the scale ratio when downscaling
+};
+
+inline ScaleFilter ParseScaleFilter( const std::string & name )
+{
+   if ( name == "area" )
+      return ScaleFilter::Area;
+   if ( name == "bicubic" )
+      return ScaleFilter::Bicubic;
+   throw std::runtime_error( "Unknown scale filter: " + name );
+}
+
+// Filter taps for one dimension. Every output sample uses 'size' consecutive input
+// samples starting at 'start[i]', weighted by 'weights[i * stride .. i * stride + size)'.
+// Weights are fixed point with 14 fractional bits and sum to exactly 1 << 14. The
+// stride is padded to a multiple of 8 with zero weights for the SIMD loops.
+struct ScaleTaps
+{
+   static constexpr int kWeightBits = 14;
+   int size = 0;
+   int stride = 0;
+   std::vector< int > start;
+   std::vector< int16_t > weights;
+};
+
+inline double CubicWeight( double x )
+{
+   const double a = -0.5;
+   x = std::fabs( x );
+   if ( x < 1.0 )
+      return ((a + 2.0) * x - (a + 3.0)) * x * x + 1.0;
+   if ( x < 2.0 )
+      return ((a * x - 5.0 * a) * x + 8.0 * a) * x - 4.0 * a;
+   return 0.0;
+}
+
+inline ScaleTaps ComputeScaleTaps( int srcLength, int dstLength, ScaleFilter filter )
+{
+   ScaleTaps returnValue;
+   double ratio = double(srcLength) / double(dstLength);
+   double stretch = std::max( 1.0, ratio );
+   double support = (filter == ScaleFilter::Area) ? std::max( 1.0, ratio * 0.5 ) : (2.0 * stretch);
+
+   returnValue.size = std::min( srcLength, int(std::ceil( support * 2.0 )) + 1 );
+   returnValue.stride = (returnValue.size + 7) & ~7;
+   returnValue.start.resize( dstLength );
+   returnValue.weights.assign( size_t(dstLength) * returnValue.stride, 0 );
+
+   std::vector< double > w( returnValue.size );
+   for ( int i = 0; i < dstLength; ++i )
+   {
+      double center = (i + 0.5) * ratio;
+      int first = int(std::floor( center - support ));
+      int start = std::max( 0, std::min( first, srcLength - returnValue.size ) );
+      returnValue.start[ i ] = start;
+
+      // Accumulate weights, folding anything outside the source onto the edge samples
+      std::fill( w.begin(), w.end(), 0.0 );
+      double sum = 0.0;
+      for ( int j = first; j <= int(std::ceil( center + support )); ++j )
+      {
+         double weight;
+         if ( filter == ScaleFilter::Area )
+         {
+            // Overlap between output pixel [i, i+1) and input pixel [j, j+1) in source units
+            double lo = std::max( double(j), center - ratio * 0.5 );
+            double hi = std::min( double(j + 1), center + ratio * 0.5 );
+            weight = (ratio <= 1.0) ? std::max( 0.0, 1.0 - std::fabs( j + 0.5 - center ) ) : std::max( 0.0, hi - lo );
+         }
+         else
+            weight = CubicWeight( (j + 0.5 - center) / stretch );
+
+         if ( weight == 0.0 )
+            continue;
+
+         int index = std::max( 0, std::min( j, srcLength - 1 ) ) - start;
+         index = std::max( 0, std::min( index, returnValue.size - 1 ) );
+         w[ index ] += weight;
+         sum += weight;
+      }
+
+      // Convert to fixed point, putting any rounding residue on the largest tap
+      int16_t * dst = &returnValue.weights[ size_t(i) * returnValue.stride ];
+      int total = 0, largest = 0;
+      for ( int k = 0; k < returnValue.size; ++k )
+      {
+         dst[ k ] = int16_t(std::lround( w[ k ] / sum * (1 << ScaleTaps::kWeightBits) ));
+         total += dst[ k ];
+         if ( dst[ k ] > dst[ largest ] )
+            largest = k;
+      }
+      dst[ largest ] += int16_t((1 << ScaleTaps::kWeightBits) - total);
+   }
+
+   return returnValue;
+}
+
+// Vertical pass: filters 'count' bytes from the source rows selected by 'taps' into
+// 16-bit intermediates carrying 6 fractional bits.
+inline void ScaleRowVertical( const uint8_t * src,
+   int srcPitch,
+   int count,
+   const ScaleTaps & taps,
+   int row,
+   int16_t * dst )
+{
+   const uint8_t * first = src + size_t(taps.start[ row ]) * srcPitch;
+   const int16_t * weights = &taps.weights[ size_t(row) * taps.stride ];
+   constexpr int shift = ScaleTaps::kWeightBits - 6;
+   int x = 0;
+
+#ifdef SCALER_USE_SSE2
+   const __m128i zero = _mm_setzero_si128();
+   const __m128i round = _mm_set1_epi32( 1 << (shift - 1) );
+   for ( ; x + 8 <= count; x += 8 )
+   {
+      __m128i lo = round, hi = round;
+      for ( int k = 0; k < taps.size; k += 2 )
+      {
+         // Interleave two source rows so one madd applies both of their weights.
+         // An odd trailing tap is paired with itself and a zero weight.
+         int k1 = std::min( k + 1, taps.size - 1 );
+         int16_t w1 = (k1 == k) ? 0 : weights[ k1 ];
+         __m128i a = _mm_unpacklo_epi8( _mm_loadl_epi64( (const __m128i *)(first + size_t(k) * srcPitch + x) ), zero );
+         __m128i b = _mm_unpacklo_epi8( _mm_loadl_epi64( (const __m128i *)(first + size_t(k1) * srcPitch + x) ), zero );
+         __m128i w = _mm_set1_epi32( int(uint16_t(weights[ k ])) | (int(w1) << 16) );
+         lo = _mm_add_epi32( lo, _mm_madd_epi16( _mm_unpacklo_epi16( a, b ), w ) );
+         hi = _mm_add_epi32( hi, _mm_madd_epi16( _mm_unpackhi_epi16( a, b ), w ) );
+      }
+      _mm_storeu_si128( (__m128i *)(dst + x), _mm_packs_epi32( _mm_srai_epi32( lo, shift ), _mm_srai_epi32( hi, shift ) ) );
+   }
+#endif
+
+   for ( ; x < count; ++x )
+   {
+      int sum = 1 << (shift - 1);
+      for ( int k = 0; k < taps.size; ++k )
+         sum += weights[ k ] * first[ size_t(k) * srcPitch + x ];
+      dst[ x ] = int16_t(std::max( -32768, std::min( 32767, sum >> shift ) ));
+   }
+}
+
+// Horizontal pass over a single channel of 16-bit intermediates. 'src' must have at
+// least 'taps.stride' readable elements past the last start position.
+inline void ScaleRowHorizontal( const int16_t * src,
+   const ScaleTaps & taps,
+   int dstLength,
+   uint8_t * dst,
+   int dstStride )
+{
+   constexpr int shift = ScaleTaps::kWeightBits + 6;
+   for ( int i = 0; i < dstLength; ++i )
+   {
+      const int16_t * s = src + taps.start[ i ];
+      const int16_t * w = &taps.weights[ size_t(i) * taps.stride ];
+      int sum = 1 << (shift - 1);
+#ifdef SCALER_USE_SSE2
+      __m128i acc = _mm_setzero_si128();
+      for ( int k = 0; k < taps.stride; k += 8 )
+         acc = _mm_add_epi32( acc, _mm_madd_epi16( _mm_loadu_si128( (const __m128i *)(s + k) ), _mm_loadu_si128( (const __m128i *)(w + k) ) ) );
+      acc = _mm_add_epi32( acc, _mm_shuffle_epi32( acc, _MM_SHUFFLE( 1, 0, 3, 2 ) ) );
+      acc = _mm_add_epi32( acc, _mm_shuffle_epi32( acc, _MM_SHUFFLE( 2, 3, 0, 1 ) ) );
+      sum += _mm_cvtsi128_si32( acc );
+#else
+      for ( int k = 0; k < taps.size; ++k )
+         sum += s[ k ] * w[ k ];
+#endif
+      dst[ size_t(i) * dstStride ] = uint8_t(std::max( 0, std::min( 255, sum >> shift ) ));
+   }
+}
+
+// Resamples an 8-bit plane of 'channels' interleaved components (1 for luma, 2 for NV12 chroma)
+class PlaneScaler
+{
+public:
+   PlaneScaler() = default;
+   PlaneScaler( int srcWidth, int srcHeight, int dstWidth, int dstHeight, int channels, ScaleFilter filter )
+      : _srcWidth( srcWidth ), _srcHeight( srcHeight ), _dstWidth( dstWidth ), _dstHeight( dstHeight ), _channels( channels )
+   {
+      _horizontal = ComputeScaleTaps( srcWidth, dstWidth, filter );
+      _vertical = ComputeScaleTaps( srcHeight, dstHeight, filter );
+   }
+
+   void Scale( const uint8_t * src, int srcPitch, uint8_t * dst, int dstPitch, int threads ) const
+   {
+      ParallelFor( _dstHeight, threads, [&]( int firstRow, int lastRow )
+      {
+         // Per-band scratch, padded so the horizontal SIMD loads never run off the end
+         std::vector< int16_t > rowBuffer( size_t(_srcWidth) * _channels + _horizontal.stride );
+         std::vector< int16_t > channelBuffer( _srcWidth + _horizontal.stride );
+         for ( int y = firstRow; y < lastRow; ++y )
+         {
+            uint8_t * dstRow = dst + size_t(y) * dstPitch;
+            ScaleRowVertical( src, srcPitch, _srcWidth * _channels, _vertical, y, rowBuffer.data() );
+            if ( _channels == 1 )
+               ScaleRowHorizontal( rowBuffer.data(), _horizontal, _dstWidth, dstRow, 1 );
+            else
+            {
+               for ( int c = 0; c < _channels; ++c )
+               {
+                  for ( int x = 0; x < _srcWidth; ++x )
+                     channelBuffer[ x ] = rowBuffer[ size_t(x) * _channels + c ];
+                  ScaleRowHorizontal( channelBuffer.data(), _horizontal, _dstWidth, dstRow + c, _channels );
+               }
+            }
+         }
+      } );
+   }
+
+private:
+   int _srcWidth = 0, _srcHeight = 0, _dstWidth = 0, _dstHeight = 0, _channels = 1;
+   ScaleTaps _horizontal, _vertical;
+};
+
+// Resamples NV12 frames (luma plane plus interleaved UV at half resolution)
+class Nv12Scaler
+{
+public:
+   Nv12Scaler( int srcWidth, int srcHeight, int dstWidth, int dstHeight, ScaleFilter filter )
+      : _luma( srcWidth, srcHeight, dstWidth, dstHeight, 1, filter ),
+        _chroma( srcWidth / 2, srcHeight / 2, dstWidth / 2, dstHeight / 2, 2, filter )
+   {
+      if ( (srcWidth | srcHeight | dstWidth | dstHeight) & 1 )
+         throw std::runtime_error( "NV12 scaling requires even dimensions" );
+   }
+
+   // Scales both planes. Luma and chroma rows share the same pitch within a frame.
+   void Scale( const uint8_t * srcLuma,
+      const uint8_t * srcChroma,
+      int srcPitch,
+      uint8_t * dstLuma,
+      uint8_t * dstChroma,
+      int dstPitch,
+      int threads ) const
+   {
+      _luma.Scale( srcLuma, srcPitch, dstLuma, dstPitch, threads );
+      _chroma.Scale( srcChroma, srcPitch, dstChroma, dstPitch, threads );
+   }
+
+   // Scales only the luma plane, which is all that matters for an alpha mask
+   void ScaleLuma( const uint8_t * src, int srcPitch, uint8_t * dst, int dstPitch, int threads ) const
+   {
+      _luma.Scale( src, srcPitch, dst, dstPitch, threads );
+   }
+
+private:
+   PlaneScaler _luma, _chroma;
+};
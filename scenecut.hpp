@@ -0,0 +1,120 @@
+// Shot boundary detection on the CPU, cheap enough to run on every frame as it is read.
+// Luma is reduced to a thumbnail of 8x8 block averages. A frame is a cut when its thumbnail
+// differs from the previous one both per block (SAD) and in overall brightness distribution
+// (histogram), so fast motion alone, which moves blocks but keeps the histogram, isn't one.
+#pragma once
+
+#include <cstdint>
+#include <cstdlib>
+#include <algorithm>
+#include <vector>
+
+#if defined(__SSE2__) || defined(_M_X64)
+   #include <emmintrin.h>
+   #define SCENECUT_USE_SSE2 1
+#endif
+
+// Averages each 8x8 block of a plane into one byte. Partial blocks at the edges are left out.
+inline void ThumbnailPlane( const uint8_t * plane,
+   int pitch,
+   int width,
+   int height,
+   uint8_t * thumbnail )
+{
+   int blocksX = width / 8, blocksY = height / 8;
+   for ( int by = 0; by < blocksY; ++by )
+   {
+      const uint8_t * rows = plane + size_t(by) * 8 * pitch;
+      uint8_t * dst = thumbnail + size_t(by) * blocksX;
+      int bx = 0;
+
+#ifdef SCENECUT_USE_SSE2
+      // A SAD against zero sums each half of a 16 byte load, so two blocks at a time
+      const __m128i zero = _mm_setzero_si128();
+      for ( ; bx + 2 <= blocksX; bx += 2 )
+      {
+         __m128i sum = zero;
+         for ( int row = 0; row < 8; ++row )
+            sum = _mm_add_epi64( sum, _mm_sad_epu8( _mm_loadu_si128( (const __m128i *)(rows + size_t(row) * pitch + bx * 8) ), zero ) );
+         dst[ bx ] = uint8_t((_mm_cvtsi128_si32( sum ) + 32) >> 6);
+         dst[ bx + 1 ] = uint8_t((_mm_cvtsi128_si32( _mm_srli_si128( sum, 8 ) ) + 32) >> 6);
+      }
+#endif
+
+      for ( ; bx < blocksX; ++bx )
+      {
+         int sum = 0;
+         for ( int row = 0; row < 8; ++row )
+         {
+            for ( int x = 0; x < 8; ++x )
+               sum += rows[ size_t(row) * pitch + bx * 8 + x ];
+         }
+         dst[ bx ] = uint8_t((sum + 32) >> 6);
+      }
+   }
+}
+
+// Sum of absolute differences of two byte arrays
+inline uint64_t SumAbsDiff( const uint8_t * a,
+   const uint8_t * b,
+   size_t size )
+{
+   uint64_t returnValue = 0;
+   size_t i = 0;
+
+#ifdef SCENECUT_USE_SSE2
+   __m128i sum = _mm_setzero_si128();
+   for ( ; i + 16 <= size; i += 16 )
+      sum = _mm_add_epi64( sum, _mm_sad_epu8( _mm_loadu_si128( (const __m128i *)(a + i) ), _mm_loadu_si128( (const __m128i *)(b + i) ) ) );
+   returnValue = uint64_t(_mm_cvtsi128_si32( sum )) + uint64_t(_mm_cvtsi128_si32( _mm_srli_si128( sum, 8 ) ));
+#endif
+
+   for ( ; i < size; ++i )
+      returnValue += uint64_t(std::abs( int(a[ i ]) - int(b[ i ]) ));
+   return returnValue;
+}
+
+class SceneCutDetector
+{
+public:
+   static constexpr int kHistogramBins = 32;
+   static constexpr double kHistogramThreshold = 0.3; // Share of blocks that changed brightness bin
+
+   SceneCutDetector() = default;
+   // 'threshold' is the mean difference of 8x8 block averages, in luma levels, that counts as a cut
+   explicit SceneCutDetector( int threshold ) : _threshold( threshold ) {}
+
+   bool Empty() const { return _threshold <= 0; }
+
+   // Looks at the next frame's luma. The first frame seeds the detector and is never a cut.
+   bool IsCut( const uint8_t * luma, int pitch, int width, int height )
+   {
+      size_t size = size_t(width / 8) * (height / 8);
+      if ( size == 0 )
+         return false;
+      std::swap( _current, _previous );
+      _current.resize( size );
+      ThumbnailPlane( luma, pitch, width, height, _current.data() );
+      if ( _previous.size() != size )
+         return false;
+
+      double sad = double(SumAbsDiff( _current.data(), _previous.data(), size )) / size;
+      if ( sad < _threshold )
+         return false;
+
+      int current[ kHistogramBins ] = {}, previous[ kHistogramBins ] = {};
+      for ( size_t i = 0; i < size; ++i )
+      {
+         ++current[ _current[ i ] * kHistogramBins / 256 ];
+         ++previous[ _previous[ i ] * kHistogramBins / 256 ];
+      }
+      size_t moved = 0;
+      for ( int bin = 0; bin < kHistogramBins; ++bin )
+         moved += size_t(std::abs( current[ bin ] - previous[ bin ] ));
+      return moved / 2.0 / size >= kHistogramThreshold;
+   }
+
+private:
+   int _threshold = 0;
+   std::vector< uint8_t > _current, _previous; // Thumbnails of this frame and the one before
+};
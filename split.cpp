@@ -0,0 +1,75 @@
+// Splits an existing two-layer .265 into base and alpha elementary streams, no GPU needed
+#include <iostream>
+#include <chrono>
+#include <CLI/CLI.hpp>
+
+#include "utility.hpp"
+#include "writer.hpp"
+#include "nal.hpp"
+
+struct Args
+{
+   std::string inputFilename;
+   std::string baseFilename;
+   std::string alphaFilename;
+}args;
+
+int main( int argc, char *argv[] )
+{
+   CLI::App app{ "Splits HEVC with an alpha layer into base and alpha elementary streams" };
+   app.add_option( "input", args.inputFilename, "Two-layer HEVC stream, as encoded\n" )->required();
+   app.add_option( "--base", args.baseFilename, "Base layer output. Defaults to <input>.base.265\n" );
+   app.add_option( "--alpha", args.alphaFilename, "Alpha layer output. Defaults to <input>.alpha.265\n" );
+   try
+   {
+      app.parse( argc, argv );
+   }
+   catch( const CLI::ParseError &e )
+   {
+      std::cout << e.what() << "\n";
+      std::cout << app.help();
+      return 1;
+   }
+   if ( args.baseFilename.empty() )
+      args.baseFilename = args.inputFilename + ".base.265";
+   if ( args.alphaFilename.empty() )
+      args.alphaFilename = args.inputFilename + ".alpha.265";
+
+   try
+   {
+      MappedFile input( ExpandTilde( args.inputFilename ) );
+      // Refused before either output is created
+      LayerSplitter::Check( input.Data(), input.Size() );
+      AsyncFileWriter base( ExpandTilde( args.baseFilename ), false );
+      AsyncFileWriter alpha( ExpandTilde( args.alphaFilename ), false );
+      LayerSplitter splitter( base, alpha );
+
+      auto start = std::chrono::steady_clock::now();
+      splitter.Write( input.Data(), input.Size() );
+      double seconds = std::chrono::duration< double >( std::chrono::steady_clock::now() - start ).count();
+      base.Close();
+      alpha.Close();
+
+      std::cout << "Scanned " << input.Size() << " bytes in " << seconds * 1000 << " ms";
+      if ( seconds > 0 )
+         std::cout << " (" << input.Size() / seconds / 1e6 << " MB/s)";
+      std::cout << std::endl;
+
+      static const char * categories[ kNalCategoryCount ] = { "slices", "parameter sets", "SEI", "other" };
+      for ( int layer = 0; layer < 2; ++layer )
+      {
+         std::cout << "   " << (layer ? "alpha" : "base") << " layer:";
+         for ( int category = 0; category < kNalCategoryCount; ++category )
+            std::cout << " " << splitter.statistics.count[ layer ][ category ] << " " << categories[ category ]
+               << " (" << splitter.statistics.bytes[ layer ][ category ] << " bytes)" << (category + 1 < kNalCategoryCount ? "," : "");
+         std::cout << std::endl;
+      }
+      std::cout << "   wrote `" << args.baseFilename << "' and `" << args.alphaFilename << "'" << std::endl;
+   }
+   catch ( const std::runtime_error & e )
+   {
+      std::cout << e.what() << std::endl;
+      return 1;
+   }
+   return 0;
+}
@@ -0,0 +1,344 @@
+// Stand-in for the CUDA driver API and NVENC, so the encoder's scheduling can be tested on
+// machines without a GPU. FAKE_GPU_DEVICES sets how many devices there are (default 1), and
+// FAKE_GPU_ENCODE_US makes every encode take that long, so chunks spread across devices.
+// "Device memory" is host memory. Every picture is a handful of dummy NAL units whose base
+// layer slice names the frame's timestamp and the device that encoded it, for tests to check.
+#include <cuda.h>
+#include "nvEncodeAPI.h"
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+struct CUctx_st
+{
+   int device = 0;
+};
+struct CUstream_st {};
+struct CUevent_st {};
+
+namespace
+{
+   int DeviceCount()
+   {
+      const char * count = getenv( "FAKE_GPU_DEVICES" );
+      return count ? atoi( count ) : 1;
+   }
+
+   thread_local std::vector< CUcontext > t_contexts;
+
+   CUresult NeedContext()
+   {
+      return (t_contexts.empty() || !t_contexts.back()) ? CUDA_ERROR_INVALID_CONTEXT : CUDA_SUCCESS;
+   }
+}
+
+extern "C"
+{
+CUresult cuInit( unsigned int ) { return CUDA_SUCCESS; }
+CUresult cuDeviceGet( CUdevice * device, int ordinal )
+{
+   if ( ordinal < 0 || ordinal >= DeviceCount() )
+      return CUDA_ERROR_INVALID_DEVICE;
+   *device = ordinal;
+   return CUDA_SUCCESS;
+}
+CUresult cuDeviceGetName( char * name, int length, CUdevice device )
+{
+   snprintf( name, size_t(length), "Fake GPU %d", int(device) );
+   return CUDA_SUCCESS;
+}
+CUresult cuCtxCreate( CUcontext * context, unsigned int, CUdevice device )
+{
+   *context = new CUctx_st;
+   (*context)->device = int(device);
+   return CUDA_SUCCESS;
+}
+CUresult cuCtxDestroy( CUcontext context ) { delete context; return CUDA_SUCCESS; }
+CUresult cuCtxPushCurrent( CUcontext context ) { t_contexts.push_back( context ); return CUDA_SUCCESS; }
+CUresult cuCtxPopCurrent( CUcontext * context )
+{
+   if ( t_contexts.empty() )
+      return CUDA_ERROR_INVALID_CONTEXT;
+   if ( context )
+      *context = t_contexts.back();
+   t_contexts.pop_back();
+   return CUDA_SUCCESS;
+}
+CUresult cuMemAllocPitch( CUdeviceptr * pointer, size_t * pitch, size_t width, size_t height, unsigned int )
+{
+   if ( NeedContext() != CUDA_SUCCESS )
+      return CUDA_ERROR_INVALID_CONTEXT;
+   *pitch = (width + 255) / 256 * 256;
+   *pointer = CUdeviceptr(malloc( *pitch * height ));
+   return CUDA_SUCCESS;
+}
+CUresult cuMemAlloc( CUdeviceptr * pointer, size_t size )
+{
+   if ( NeedContext() != CUDA_SUCCESS )
+      return CUDA_ERROR_INVALID_CONTEXT;
+   *pointer = CUdeviceptr(malloc( size ));
+   return CUDA_SUCCESS;
+}
+CUresult cuMemFree( CUdeviceptr pointer ) { free( (void *)pointer ); return CUDA_SUCCESS; }
+CUresult cuMemHostAlloc( void ** pointer, size_t size, unsigned int )
+{
+   if ( NeedContext() != CUDA_SUCCESS )
+      return CUDA_ERROR_INVALID_CONTEXT;
+   *pointer = malloc( size );
+   return CUDA_SUCCESS;
+}
+CUresult cuMemFreeHost( void * pointer ) { free( pointer ); return CUDA_SUCCESS; }
+CUresult cuMemcpy2D( const CUDA_MEMCPY2D * copy )
+{
+   if ( NeedContext() != CUDA_SUCCESS )
+      return CUDA_ERROR_INVALID_CONTEXT;
+   const char * source = (copy->srcMemoryType == CU_MEMORYTYPE_HOST) ? (const char *)copy->srcHost : (const char *)copy->srcDevice;
+   char * destination = (copy->dstMemoryType == CU_MEMORYTYPE_HOST) ? (char *)copy->dstHost : (char *)copy->dstDevice;
+   for ( size_t row = 0; row < copy->Height; ++row )
+   {
+      memcpy( destination + (copy->dstY + row) * copy->dstPitch + copy->dstXInBytes,
+         source + (copy->srcY + row) * copy->srcPitch + copy->srcXInBytes, copy->WidthInBytes );
+   }
+   return CUDA_SUCCESS;
+}
+CUresult cuMemcpy2DAsync( const CUDA_MEMCPY2D * copy, CUstream ) { return cuMemcpy2D( copy ); }
+CUresult cuStreamCreate( CUstream * stream, unsigned int ) { *stream = new CUstream_st; return CUDA_SUCCESS; }
+CUresult cuStreamDestroy( CUstream stream ) { delete stream; return CUDA_SUCCESS; }
+CUresult cuEventCreate( CUevent * event, unsigned int ) { *event = new CUevent_st; return CUDA_SUCCESS; }
+CUresult cuEventDestroy( CUevent event ) { delete event; return CUDA_SUCCESS; }
+CUresult cuEventRecord( CUevent, CUstream ) { return CUDA_SUCCESS; }
+CUresult cuEventSynchronize( CUevent ) { return CUDA_SUCCESS; }
+CUresult cuGetErrorName( CUresult error, const char ** name )
+{
+   static thread_local char buffer[ 32 ];
+   snprintf( buffer, sizeof(buffer), "CUDA_ERROR_%d", int(error) );
+   *name = buffer;
+   return CUDA_SUCCESS;
+}
+}
+
+namespace
+{
+   struct FakeBitstream
+   {
+      std::vector< uint8_t > data;
+      bool ready = false;
+      NV_ENC_PIC_TYPE pictureType = NV_ENC_PIC_TYPE_P;
+      uint32_t frameIdx = 0;
+      uint64_t timeStamp = 0;
+      uint64_t duration = 0;
+      uint32_t alphaBytes = 0;
+   };
+
+   struct FakeResource
+   {
+      void * pointer = nullptr;
+   };
+
+   struct FakeEncoder
+   {
+      std::mutex mutex;
+      int device = 0;
+      NV_ENC_CONFIG config = {};
+      uint32_t frameIdx = 0;
+   };
+
+   void AppendNal( std::vector< uint8_t > & data,
+      int type,
+      int layer,
+      const std::string & payload )
+   {
+      data.insert( data.end(), { 0, 0, 0, 1, uint8_t(type << 1), uint8_t((layer << 3) | 1), 0x80 } );
+      data.insert( data.end(), payload.begin(), payload.end() );
+   }
+
+   void AppendParameterSets( std::vector< uint8_t > & data )
+   {
+      AppendNal( data, 32, 0, "vps" );
+      AppendNal( data, 33, 0, "sps" );
+      AppendNal( data, 34, 0, "pps" );
+      AppendNal( data, 33, 1, "sps" );
+      AppendNal( data, 34, 1, "pps" );
+   }
+
+   NVENCSTATUS OpenSession( NV_ENC_OPEN_ENCODE_SESSION_EX_PARAMS * params, void ** encoder )
+   {
+      if ( !params->device )
+         return NV_ENC_ERR_INVALID_PARAM;
+      FakeEncoder * fake = new FakeEncoder;
+      fake->device = ((CUcontext)params->device)->device;
+      *encoder = fake;
+      return NV_ENC_SUCCESS;
+   }
+   NVENCSTATUS GuidCount( void *, uint32_t * count ) { *count = 1; return NV_ENC_SUCCESS; }
+   NVENCSTATUS Guids( void *, GUID * guids, uint32_t, uint32_t * count )
+   {
+      guids[ 0 ] = NV_ENC_CODEC_HEVC_GUID;
+      *count = 1;
+      return NV_ENC_SUCCESS;
+   }
+   NVENCSTATUS ProfileGuidCount( void *, GUID, uint32_t * count ) { *count = 1; return NV_ENC_SUCCESS; }
+   NVENCSTATUS ProfileGuids( void *, GUID, GUID * guids, uint32_t, uint32_t * count )
+   {
+      guids[ 0 ] = NV_ENC_HEVC_PROFILE_MAIN_GUID;
+      *count = 1;
+      return NV_ENC_SUCCESS;
+   }
+   NVENCSTATUS Caps( void *, GUID, NV_ENC_CAPS_PARAM * caps, int * value )
+   {
+      switch ( caps->capsToQuery )
+      {
+         case NV_ENC_CAPS_WIDTH_MAX:
+         case NV_ENC_CAPS_HEIGHT_MAX:
+            *value = 8192;
+            break;
+         case NV_ENC_CAPS_WIDTH_MIN:
+         case NV_ENC_CAPS_HEIGHT_MIN:
+            *value = 16;
+            break;
+         case NV_ENC_CAPS_NUM_MAX_BFRAMES:
+            *value = 0;
+            break;
+         default:
+            *value = 1;
+      }
+      return NV_ENC_SUCCESS;
+   }
+   NVENCSTATUS PresetConfig( void *, GUID, GUID, NV_ENC_TUNING_INFO, NV_ENC_PRESET_CONFIG * preset )
+   {
+      memset( &preset->presetCfg, 0, sizeof(preset->presetCfg) );
+      preset->presetCfg.version = NV_ENC_CONFIG_VER;
+      preset->presetCfg.gopLength = 250;
+      preset->presetCfg.frameIntervalP = 1;
+      preset->presetCfg.rcParams.rateControlMode = NV_ENC_PARAMS_RC_VBR;
+      preset->presetCfg.encodeCodecConfig.hevcConfig.idrPeriod = 250;
+      return NV_ENC_SUCCESS;
+   }
+   NVENCSTATUS Initialize( void * encoder, NV_ENC_INITIALIZE_PARAMS * params )
+   {
+      if ( !params->encodeConfig || params->encodeWidth == 0 || params->encodeHeight == 0 )
+         return NV_ENC_ERR_INVALID_PARAM;
+      ((FakeEncoder *)encoder)->config = *params->encodeConfig;
+      return NV_ENC_SUCCESS;
+   }
+   NVENCSTATUS CreateBitstream( void *, NV_ENC_CREATE_BITSTREAM_BUFFER * params )
+   {
+      params->bitstreamBuffer = new FakeBitstream;
+      return NV_ENC_SUCCESS;
+   }
+   NVENCSTATUS DestroyBitstream( void *, NV_ENC_OUTPUT_PTR bitstream ) { delete (FakeBitstream *)bitstream; return NV_ENC_SUCCESS; }
+   // Every picture is output as soon as it is submitted, there is no reordering
+   NVENCSTATUS Encode( void * encoder, NV_ENC_PIC_PARAMS * params )
+   {
+      FakeEncoder * fake = (FakeEncoder *)encoder;
+      std::lock_guard< std::mutex > lock( fake->mutex );
+      if ( params->encodePicFlags & NV_ENC_PIC_FLAG_EOS )
+         return NV_ENC_SUCCESS;
+      if ( !params->inputBuffer || !params->outputBitstream )
+         return NV_ENC_ERR_INVALID_PTR;
+      if ( const char * delay = getenv( "FAKE_GPU_ENCODE_US" ) )
+         std::this_thread::sleep_for( std::chrono::microseconds( atoi( delay ) ) );
+
+      FakeBitstream * bitstream = (FakeBitstream *)params->outputBitstream;
+      bool idr = fake->frameIdx == 0 || (params->encodePicFlags & NV_ENC_PIC_FLAG_FORCEIDR);
+      bitstream->data.clear();
+      if ( idr )
+         AppendParameterSets( bitstream->data );
+      AppendNal( bitstream->data, idr ? 19 : 1, 0,
+         "frame " + std::to_string( params->inputTimeStamp ) + " device " + std::to_string( fake->device ) );
+      size_t alphaStart = bitstream->data.size();
+      AppendNal( bitstream->data, idr ? 19 : 1, 1, "alpha" );
+      bitstream->alphaBytes = uint32_t(bitstream->data.size() - alphaStart);
+      bitstream->pictureType = idr ? NV_ENC_PIC_TYPE_IDR : NV_ENC_PIC_TYPE_P;
+      bitstream->frameIdx = fake->frameIdx++;
+      bitstream->timeStamp = params->inputTimeStamp;
+      bitstream->duration = params->inputDuration;
+      bitstream->ready = true;
+      return NV_ENC_SUCCESS;
+   }
+   NVENCSTATUS LockBitstream( void *, NV_ENC_LOCK_BITSTREAM * params )
+   {
+      FakeBitstream * bitstream = (FakeBitstream *)params->outputBitstream;
+      if ( !bitstream->ready )
+         return NV_ENC_ERR_LOCK_BUSY;
+      params->bitstreamBufferPtr = bitstream->data.data();
+      params->bitstreamSizeInBytes = uint32_t(bitstream->data.size());
+      params->pictureType = bitstream->pictureType;
+      params->frameIdx = bitstream->frameIdx;
+      params->outputTimeStamp = bitstream->timeStamp;
+      params->outputDuration = bitstream->duration;
+      params->alphaLayerSizeInBytes = bitstream->alphaBytes;
+      return NV_ENC_SUCCESS;
+   }
+   NVENCSTATUS UnlockBitstream( void *, NV_ENC_OUTPUT_PTR bitstream ) { ((FakeBitstream *)bitstream)->ready = false; return NV_ENC_SUCCESS; }
+   NVENCSTATUS SequenceParams( void *, NV_ENC_SEQUENCE_PARAM_PAYLOAD * params )
+   {
+      std::vector< uint8_t > data;
+      AppendParameterSets( data );
+      if ( params->inBufferSize < data.size() )
+         return NV_ENC_ERR_INVALID_PARAM;
+      memcpy( params->spsppsBuffer, data.data(), data.size() );
+      *params->outSPSPPSPayloadSize = uint32_t(data.size());
+      return NV_ENC_SUCCESS;
+   }
+   NVENCSTATUS Register( void *, NV_ENC_REGISTER_RESOURCE * params )
+   {
+      params->registeredResource = new FakeResource{ params->resourceToRegister };
+      return NV_ENC_SUCCESS;
+   }
+   NVENCSTATUS Unregister( void *, NV_ENC_REGISTERED_PTR resource ) { delete (FakeResource *)resource; return NV_ENC_SUCCESS; }
+   NVENCSTATUS Map( void *, NV_ENC_MAP_INPUT_RESOURCE * params )
+   {
+      params->mappedResource = params->registeredResource;
+      params->mappedBufferFmt = NV_ENC_BUFFER_FORMAT_NV12;
+      return NV_ENC_SUCCESS;
+   }
+   NVENCSTATUS Unmap( void *, NV_ENC_INPUT_PTR ) { return NV_ENC_SUCCESS; }
+   NVENCSTATUS Reconfigure( void * encoder, NV_ENC_RECONFIGURE_PARAMS * params )
+   {
+      FakeEncoder * fake = (FakeEncoder *)encoder;
+      std::lock_guard< std::mutex > lock( fake->mutex );
+      fake->config = *params->reInitEncodeParams.encodeConfig;
+      return NV_ENC_SUCCESS;
+   }
+   NVENCSTATUS SetStreams( void *, NV_ENC_CUSTREAM_PTR, NV_ENC_CUSTREAM_PTR ) { return NV_ENC_SUCCESS; }
+   NVENCSTATUS Destroy( void * encoder ) { delete (FakeEncoder *)encoder; return NV_ENC_SUCCESS; }
+}
+
+NVENCSTATUS NVENCAPI NvEncodeAPIGetMaxSupportedVersion( uint32_t * version )
+{
+   *version = (NVENCAPI_MAJOR_VERSION << 4) | NVENCAPI_MINOR_VERSION;
+   return NV_ENC_SUCCESS;
+}
+NVENCSTATUS NVENCAPI NvEncodeAPICreateInstance( NV_ENCODE_API_FUNCTION_LIST * functions )
+{
+   functions->nvEncOpenEncodeSessionEx = OpenSession;
+   functions->nvEncGetEncodeGUIDCount = GuidCount;
+   functions->nvEncGetEncodeGUIDs = Guids;
+   functions->nvEncGetEncodeProfileGUIDCount = ProfileGuidCount;
+   functions->nvEncGetEncodeProfileGUIDs = ProfileGuids;
+   functions->nvEncGetEncodeCaps = Caps;
+   functions->nvEncGetEncodePresetConfigEx = PresetConfig;
+   functions->nvEncInitializeEncoder = Initialize;
+   functions->nvEncCreateBitstreamBuffer = CreateBitstream;
+   functions->nvEncDestroyBitstreamBuffer = DestroyBitstream;
+   functions->nvEncEncodePicture = Encode;
+   functions->nvEncLockBitstream = LockBitstream;
+   functions->nvEncUnlockBitstream = UnlockBitstream;
+   functions->nvEncGetSequenceParams = SequenceParams;
+   functions->nvEncRegisterResource = Register;
+   functions->nvEncUnregisterResource = Unregister;
+   functions->nvEncMapInputResource = Map;
+   functions->nvEncUnmapInputResource = Unmap;
+   functions->nvEncReconfigureEncoder = Reconfigure;
+   functions->nvEncSetIOCudaStreams = SetStreams;
+   functions->nvEncDestroyEncoder = Destroy;
+   return NV_ENC_SUCCESS;
+}
@@ -0,0 +1,139 @@
+// Runs the encoder linked against the stand-in GPU layer (fake_gpu.cpp) with several devices,
+// and checks that chunks are shared out across them and joined back in frame order.
+// Usage: scheduler_test <encoder built with fake_gpu.cpp>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <set>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include "../nal.hpp"
+
+static const int kWidth = 160;
+static const int kHeight = 120;
+static const int kFrames = 24;
+static const int kChunks = 6;
+
+static int g_failures = 0;
+
+static void Check( bool condition, const std::string & what )
+{
+   if ( !condition )
+   {
+      std::cerr << "FAILED: " << what << std::endl;
+      ++g_failures;
+   }
+}
+
+static std::string ReadFile( const std::string & filename )
+{
+   std::ifstream file( filename, std::ios::binary );
+   return std::string( std::istreambuf_iterator< char >( file ), std::istreambuf_iterator< char >() );
+}
+
+static bool Exists( const std::string & filename )
+{
+   return std::ifstream( filename ).good();
+}
+
+static void WriteFrames( const std::string & filename, int frames, int seed )
+{
+   std::vector< char > frame( size_t(kWidth) * kHeight * 3 / 2 );
+   std::ofstream file( filename, std::ios::binary );
+   for ( int f = 0; f < frames; ++f )
+   {
+      for ( size_t i = 0; i < frame.size(); ++i )
+         frame[ i ] = char((i * 7 + size_t(f) * 13 + size_t(seed)) & 0xff);
+      file.write( frame.data(), std::streamsize(frame.size()) );
+   }
+}
+
+static int Run( const std::string & encoder, const std::string & environment, const std::string & options, const std::string & log )
+{
+   std::string command = environment + " \"" + encoder + "\" --yuvFrames scheduler_in.yuv --mask scheduler_mask.yuv"
+      " --width " + std::to_string( kWidth ) + " --height " + std::to_string( kHeight ) + " --fpsn 30 --fpsd 1 " + options + " > " + log + " 2>&1";
+   int status = std::system( command.c_str() );
+   return (status == 0) ? 0 : 1;
+}
+
+// Four devices' worth of chunks on three devices, one session each, so chunks queue and interleave
+static void TestSharedAndOrdered( const std::string & encoder )
+{
+   const std::string output = "scheduler_out.265", log = "scheduler_out.log";
+   std::remove( output.c_str() );
+   int status = Run( encoder, "FAKE_GPU_DEVICES=3 FAKE_GPU_ENCODE_US=2000",
+      "--devices 0 --devices 1 --devices 2 --chunks " + std::to_string( kChunks ) + " --sessionLimit 1 --container 265 -o " + output, log );
+   Check( status == 0, "encode on three devices succeeds, see " + log );
+
+   // Every base layer slice names its frame and device, the joined stream must have them in order
+   std::string stream = ReadFile( output );
+   NalScanner scanner( (const uint8_t *)stream.data(), stream.size() );
+   NalUnit nal;
+   int expected = 0, idrs = 0;
+   std::set< int > devices;
+   std::vector< int > chunkDevice( kChunks, -1 );
+   while ( scanner.Next( nal ) )
+   {
+      if ( nal.Type() > kNalVclLast || nal.Layer() != 0 )
+         continue;
+      int frame = -1, device = -1;
+      std::string payload( (const char *)nal.data + 3, nal.size - 3 );
+      std::sscanf( payload.c_str(), "frame %d device %d", &frame, &device );
+      Check( frame == expected, "frame " + std::to_string( expected ) + " is next in the joined stream, found " + std::to_string( frame ) );
+      expected = frame + 1;
+
+      int chunk = frame * kChunks / kFrames;
+      if ( chunk >= 0 && chunk < kChunks )
+      {
+         if ( chunkDevice[ chunk ] < 0 )
+         {
+            chunkDevice[ chunk ] = device;
+            Check( nal.Type() >= kNalIrapFirst && nal.Type() <= kNalIrapLast, "chunk " + std::to_string( chunk ) + " starts with an IRAP" );
+         }
+         Check( chunkDevice[ chunk ] == device, "chunk " + std::to_string( chunk ) + " stays on one device" );
+      }
+      idrs += (nal.Type() == kNalIdrWithLeading || nal.Type() == kNalIdrNoLeading);
+      devices.insert( device );
+   }
+   Check( expected == kFrames, "all " + std::to_string( kFrames ) + " frames are joined, found " + std::to_string( expected ) );
+   Check( idrs >= kChunks, "every chunk starts with an IDR" );
+   Check( devices.size() > 1, "chunks are shared across devices" );
+
+   std::string report = ReadFile( log );
+   for ( int d = 0; d < 3; ++d )
+      Check( report.find( "GPU " + std::to_string( d ) + " (Fake GPU " + std::to_string( d ) + ")" ) != std::string::npos, "GPU " + std::to_string( d ) + " is reported" );
+   for ( int i = 0; i < kChunks; ++i )
+      Check( !Exists( output + ".part" + std::to_string( i ) ), "part " + std::to_string( i ) + " is removed after joining" );
+}
+
+// A device that does not exist fails the encode instead of leaving its chunks unassigned
+static void TestMissingDevice( const std::string & encoder )
+{
+   const std::string output = "scheduler_missing.265";
+   int status = Run( encoder, "FAKE_GPU_DEVICES=2", "--devices 0 --devices 2 --chunks 4 --container 265 -o " + output, "scheduler_missing.log" );
+   Check( status != 0, "encode on a missing device fails" );
+   for ( int i = 0; i < 4; ++i )
+      Check( !Exists( output + ".part" + std::to_string( i ) ), "part " + std::to_string( i ) + " of a failed encode is removed" );
+}
+
+int main( int argc, char * argv[] )
+{
+   if ( argc != 2 )
+   {
+      std::cerr << "Usage: " << argv[ 0 ] << " <encoder built with fake_gpu.cpp>" << std::endl;
+      return 2;
+   }
+   WriteFrames( "scheduler_in.yuv", kFrames, 0 );
+   WriteFrames( "scheduler_mask.yuv", 1, 1 );
+
+   TestSharedAndOrdered( argv[ 1 ] );
+   TestMissingDevice( argv[ 1 ] );
+
+   if ( g_failures == 0 )
+      std::cout << "All scheduler tests passed" << std::endl;
+   return g_failures == 0 ? 0 : 1;
+}
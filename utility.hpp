@@ -1,3 +1,5 @@
+#pragma once
+
 #ifdef _WIN32
    #define WIN32_LEAN_AND_MEAN
    #define NOMINMAX
@@ -17,12 +19,16 @@
    #include <dirent.h>
    #include <regex.h>
    #include <sys/stat.h>
+   #include <sys/mman.h>
+   #include <fcntl.h>
+   #include <unistd.h>
    #include <dlfcn.h>
 
    // Needed for filtering files
    regex_t * filter = nullptr;
 #endif
 
+#include <cstdint>
 #include <sstream>
 #include <string>
 #include <sys/stat.h>
@@ -31,9 +37,13 @@
 #include <fstream>
 #include <stdio.h>
 #include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
 #include <array>
 #include <vector>
 #include <stdexcept>
+#include <algorithm>
 
 // File system helpers
 std::string ExpandTilde( std::string directory )
@@ -57,3 +67,164 @@ std::string ExpandTilde( std::string directory )
    
    return directory;
 }
+
+// Splits [0, count) into contiguous bands and runs 'fn( first, last )' for each band,
+// using up to 'threads' threads. The calling thread processes the first band.
+template< typename Fn >
+void ParallelFor( int count, int threads, Fn && fn )
+{
+   threads = std::max( 1, std::min( threads, count ) );
+   if ( threads == 1 )
+   {
+      fn( 0, count );
+      return;
+   }
+
+   std::vector< std::thread > workers;
+   int band = (count + threads - 1) / threads;
+   for ( int first = band; first < count; first += band )
+      workers.emplace_back( [&fn, first, band, count]() { fn( first, std::min( count, first + band ) ); } );
+   fn( 0, std::min( count, band ) );
+   for ( auto & worker : workers )
+      worker.join();
+}
+
+// Read-only memory map of a whole file, so large inputs are scanned without copying
+class MappedFile
+{
+public:
+   explicit MappedFile( const std::string & filename )
+   {
+      // The destructor never runs for a constructor that throws, so release what was opened
+      try
+      {
+#ifdef _WIN32
+         _file = CreateFileA( filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_FLAG_SEQUENTIAL_SCAN, nullptr );
+         LARGE_INTEGER size;
+         if ( _file == INVALID_HANDLE_VALUE || !GetFileSizeEx( _file, &size ) )
+            throw std::runtime_error( "Could not open " + filename );
+         _size = size_t(size.QuadPart);
+         if ( _size > 0 )
+         {
+            _mapping = CreateFileMappingA( _file, nullptr, PAGE_READONLY, 0, 0, nullptr );
+            _data = _mapping ? (const uint8_t *)MapViewOfFile( _mapping, FILE_MAP_READ, 0, 0, 0 ) : nullptr;
+         }
+#else
+         _fd = open( filename.c_str(), O_RDONLY );
+         struct stat info;
+         if ( _fd < 0 || fstat( _fd, &info ) != 0 )
+            throw std::runtime_error( "Could not open " + filename );
+         _size = size_t(info.st_size);
+         if ( _size > 0 )
+         {
+            void * data = mmap( nullptr, _size, PROT_READ, MAP_PRIVATE, _fd, 0 );
+            _data = (data == MAP_FAILED) ? nullptr : (const uint8_t *)data;
+            if ( _data )
+               madvise( data, _size, MADV_SEQUENTIAL );
+         }
+#endif
+         if ( _size > 0 && !_data )
+            throw std::runtime_error( "Could not map " + filename );
+      }
+      catch ( ... )
+      {
+         Release();
+         throw;
+      }
+   }
+   ~MappedFile()
+   {
+      Release();
+   }
+   MappedFile( const MappedFile & ) = delete;
+   MappedFile & operator=( const MappedFile & ) = delete;
+
+   const uint8_t * Data() const { return _data; }
+   size_t Size() const { return _size; }
+
+private:
+   void Release()
+   {
+#ifdef _WIN32
+      if ( _data )
+         UnmapViewOfFile( _data );
+      if ( _mapping )
+         CloseHandle( _mapping );
+      if ( _file != INVALID_HANDLE_VALUE )
+         CloseHandle( _file );
+#else
+      if ( _data )
+         munmap( (void *)_data, _size );
+      if ( _fd >= 0 )
+         close( _fd );
+#endif
+   }
+
+   const uint8_t * _data = nullptr;
+   size_t _size = 0;
+#ifdef _WIN32
+   HANDLE _file = INVALID_HANDLE_VALUE;
+   HANDLE _mapping = nullptr;
+#else
+   int _fd = -1;
+#endif
+};
+
+// Thread-safe FIFO. Pop() waits for an item and returns false once the queue is closed and drained.
+template< typename T >
+class BlockingQueue
+{
+public:
+   void Push( T item )
+   {
+      {
+         std::lock_guard< std::mutex > lock( _mutex );
+         _items.push_back( std::move( item ) );
+      }
+      _changed.notify_one();
+   }
+
+   bool Pop( T & item )
+   {
+      std::unique_lock< std::mutex > lock( _mutex );
+      _changed.wait( lock, [this]() { return !_items.empty() || _closed; } );
+      if ( _items.empty() )
+         return false;
+      item = std::move( _items.front() );
+      _items.pop_front();
+      return true;
+   }
+
+   // Takes the next item only if there is one already
+   bool TryPop( T & item )
+   {
+      std::lock_guard< std::mutex > lock( _mutex );
+      if ( _items.empty() )
+         return false;
+      item = std::move( _items.front() );
+      _items.pop_front();
+      return true;
+   }
+
+   void Close()
+   {
+      {
+         std::lock_guard< std::mutex > lock( _mutex );
+         _closed = true;
+      }
+      _changed.notify_all();
+   }
+
+   // Accepts items again after Close
+   void Reopen()
+   {
+      std::lock_guard< std::mutex > lock( _mutex );
+      _closed = false;
+   }
+
+private:
+   std::mutex _mutex;
+   std::condition_variable _changed;
+   std::deque< T > _items;
+   bool _closed = false;
+};
@@ -0,0 +1,337 @@
+// Buffered file output written on a thread of its own.
+// Write() only copies into a ring of large page-aligned buffers. Full buffers are queued to
+// the writer thread, which writes everything queued so far with one writev, so the caller
+// only waits when every buffer is still queued. That wait is counted as a stall.
+#pragma once
+
+#include <cerrno>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <algorithm>
+#include <chrono>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+#include "utility.hpp"
+
+#ifdef _WIN32
+   #include <io.h>
+   #include <fcntl.h>
+   #include <malloc.h>
+#else
+   #include <fcntl.h>
+   #include <sys/uio.h>
+   #include <unistd.h>
+#endif
+
+class AsyncFileWriter
+{
+public:
+   static constexpr size_t kBufferSize = 2 << 20;
+   static constexpr int kBufferCount = 4;
+   static constexpr uint64_t kPreallocateStep = 64 << 20;
+   static constexpr size_t kAlignment = 4096;
+
+   // 'preallocate' reserves disk space ahead of the writes, where the file system supports it
+   AsyncFileWriter( const std::string & filename, bool preallocate ) : _preallocate( preallocate )
+   {
+#ifdef _WIN32
+      _fd = _open( filename.c_str(), _O_WRONLY | _O_CREAT | _O_TRUNC | _O_BINARY, _S_IREAD | _S_IWRITE );
+#else
+      _fd = open( filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644 );
+#endif
+      if ( _fd < 0 )
+         throw std::runtime_error( "Could not open file for writing: " + filename + ": " + strerror( errno ) );
+      Start();
+   }
+   // Takes over a descriptor that is already open, such as stdout or a pipe
+   explicit AsyncFileWriter( int fd ) : _fd( fd )
+   {
+#ifdef _WIN32
+      _setmode( _fd, _O_BINARY );
+#endif
+      Start();
+   }
+   ~AsyncFileWriter()
+   {
+      try
+      {
+         Close();
+      }
+      catch ( const std::runtime_error & )
+      {
+      }
+      Release();
+   }
+   AsyncFileWriter( const AsyncFileWriter & ) = delete;
+   AsyncFileWriter & operator=( const AsyncFileWriter & ) = delete;
+
+   void Write( const void * data, size_t size )
+   {
+      CheckError();
+      const uint8_t * bytes = (const uint8_t *)data;
+      _position += size;
+      while ( size > 0 )
+      {
+         size_t count = std::min( size, kBufferSize - _current->used );
+         memcpy( _current->data + _current->used, bytes, count );
+         _current->used += count;
+         bytes += count;
+         size -= count;
+         if ( _current->used == kBufferSize )
+            NextBuffer();
+      }
+   }
+
+   // Overwrites bytes written earlier, such as a size field. Waits for everything before it.
+   void WriteAt( uint64_t offset, const void * data, size_t size )
+   {
+      Drain();
+#ifdef _WIN32
+      bool written = _lseeki64( _fd, int64_t(offset), SEEK_SET ) >= 0 && _write( _fd, data, unsigned(size) ) == int(size)
+         && _lseeki64( _fd, 0, SEEK_END ) >= 0;
+#else
+      bool written = pwrite( _fd, data, size, off_t(offset) ) == ssize_t(size);
+#endif
+      if ( !written )
+         throw std::runtime_error( std::string( "Failed writing output: " ) + strerror( errno ) );
+   }
+
+   // Queues whatever is buffered so far without waiting for it to be written
+   void Flush()
+   {
+      CheckError();
+      if ( _current->used > 0 )
+         NextBuffer();
+   }
+
+   // Writes everything and closes the file. Throws if any write failed.
+   void Close()
+   {
+      if ( _fd < 0 )
+         return;
+      if ( _current && _current->used > 0 )
+         _full.Push( _current );
+      _current = nullptr;
+      _full.Close();
+      if ( _thread.joinable() )
+         _thread.join();
+
+#ifdef _WIN32
+      _close( _fd );
+#else
+      // Hand back whatever was preallocated past the end
+      if ( _allocated > _position )
+         (void)!ftruncate( _fd, off_t(_position) );
+      close( _fd );
+#endif
+      _fd = -1;
+      CheckError();
+   }
+
+   // True once a write has failed, for instance because the reader of a pipe went away.
+   // Every later call to Write() throws.
+   bool Failed() const
+   {
+      std::lock_guard< std::mutex > lock( _mutex );
+      return !_error.empty();
+   }
+
+   uint64_t Position() const { return _position; }
+
+   // Total time Write() and Flush() waited for a free buffer
+   double StallMilliseconds() const { return _stall; }
+
+private:
+   struct Buffer
+   {
+      uint8_t * data = nullptr;
+      size_t used = 0;
+   };
+
+   void Start()
+   {
+      // The destructor never runs for a constructor that throws, so release what was opened
+      try
+      {
+         _buffers.resize( kBufferCount );
+         for ( auto & buffer : _buffers )
+         {
+#ifdef _WIN32
+            buffer.data = (uint8_t *)_aligned_malloc( kBufferSize, kAlignment );
+#else
+            if ( posix_memalign( (void **)&buffer.data, kAlignment, kBufferSize ) != 0 )
+               buffer.data = nullptr;
+#endif
+            if ( !buffer.data )
+               throw std::runtime_error( "Out of memory for output buffers" );
+            _free.Push( &buffer );
+         }
+         _free.Pop( _current );
+         _thread = std::thread( &AsyncFileWriter::Run, this );
+      }
+      catch ( ... )
+      {
+         Release();
+         throw;
+      }
+   }
+
+   // Frees the buffers, and closes the descriptor unless Close() already has
+   void Release()
+   {
+      for ( auto & buffer : _buffers )
+      {
+#ifdef _WIN32
+         _aligned_free( buffer.data );
+#else
+         free( buffer.data );
+#endif
+      }
+      _buffers.clear();
+      if ( _fd >= 0 )
+      {
+#ifdef _WIN32
+         _close( _fd );
+#else
+         close( _fd );
+#endif
+         _fd = -1;
+      }
+   }
+
+   void NextBuffer()
+   {
+      _full.Push( _current );
+      auto start = std::chrono::steady_clock::now();
+      _free.Pop( _current );
+      _stall += std::chrono::duration< double, std::milli >( std::chrono::steady_clock::now() - start ).count();
+   }
+
+   // Waits until every buffer has been written out
+   void Drain()
+   {
+      Flush();
+      std::vector< Buffer * > buffers( 1, _current );
+      while ( int(buffers.size()) < kBufferCount )
+      {
+         Buffer * buffer = nullptr;
+         _free.Pop( buffer );
+         buffers.push_back( buffer );
+      }
+      for ( size_t i = 1; i < buffers.size(); ++i )
+         _free.Push( buffers[ i ] );
+      CheckError();
+   }
+
+   void CheckError()
+   {
+      std::lock_guard< std::mutex > lock( _mutex );
+      if ( !_error.empty() )
+         throw std::runtime_error( _error );
+   }
+
+   // Writer thread: takes every buffer queued so far and writes them in one go
+   void Run()
+   {
+      Buffer * buffer = nullptr;
+      std::vector< Buffer * > batch;
+      while ( _full.Pop( buffer ) )
+      {
+         batch.assign( 1, buffer );
+         while ( _full.TryPop( buffer ) )
+            batch.push_back( buffer );
+
+         bool failed;
+         {
+            std::lock_guard< std::mutex > lock( _mutex );
+            failed = !_error.empty();
+         }
+         if ( !failed )
+         {
+            std::string error = WriteBatch( batch );
+            if ( !error.empty() )
+            {
+               std::lock_guard< std::mutex > lock( _mutex );
+               _error = error;
+            }
+         }
+
+         // Buffers go back even after a failure, so the producer never waits forever
+         for ( Buffer * written : batch )
+         {
+            written->used = 0;
+            _free.Push( written );
+         }
+      }
+   }
+
+   std::string WriteBatch( const std::vector< Buffer * > & batch )
+   {
+      uint64_t size = 0;
+      for ( const Buffer * buffer : batch )
+         size += buffer->used;
+
+#if defined(__linux__)
+      if ( _preallocate && _written + size > _allocated )
+      {
+         uint64_t length = std::max( uint64_t(kPreallocateStep), _written + size - _allocated );
+         if ( fallocate( _fd, FALLOC_FL_KEEP_SIZE, off_t(_allocated), off_t(length) ) == 0 )
+            _allocated += length;
+         else
+            _preallocate = false;                 // Not supported here, just write
+      }
+#endif
+
+#ifdef _WIN32
+      for ( const Buffer * buffer : batch )
+      {
+         if ( _write( _fd, buffer->data, unsigned(buffer->used) ) != int(buffer->used) )
+            return std::string( "Failed writing output: " ) + strerror( errno );
+      }
+#else
+      std::vector< iovec > vectors;
+      for ( const Buffer * buffer : batch )
+         vectors.push_back( { buffer->data, buffer->used } );
+
+      // writev may stop short, carry on from wherever it got to
+      size_t first = 0;
+      while ( first < vectors.size() )
+      {
+         ssize_t count = writev( _fd, &vectors[ first ], int(vectors.size() - first) );
+         if ( count < 0 && errno == EINTR )
+            continue;
+         if ( count < 0 && errno == EPIPE )
+            return "Output closed by its reader";
+         if ( count < 0 )
+            return std::string( "Failed writing output: " ) + strerror( errno );
+         while ( first < vectors.size() && size_t(count) >= vectors[ first ].iov_len )
+            count -= ssize_t(vectors[ first++ ].iov_len);
+         if ( first < vectors.size() )
+         {
+            vectors[ first ].iov_base = (uint8_t *)vectors[ first ].iov_base + count;
+            vectors[ first ].iov_len -= size_t(count);
+         }
+      }
+#endif
+      _written += size;
+      return std::string();
+   }
+
+   int _fd = -1;
+   bool _preallocate = false;
+   uint64_t _allocated = 0;                       // Bytes reserved on disk, writer thread only
+   uint64_t _written = 0;                         // Bytes written, writer thread only
+   uint64_t _position = 0;                        // Bytes passed to Write()
+   double _stall = 0;
+   std::vector< Buffer > _buffers;
+   Buffer * _current = nullptr;                   // Being filled by Write()
+   BlockingQueue< Buffer * > _free;
+   BlockingQueue< Buffer * > _full;
+   std::thread _thread;
+   mutable std::mutex _mutex;
+   std::string _error;                            // First write failure, reported to the caller
+};